@@ -0,0 +1,106 @@
+/*
+ * arena.c - bump allocator for per-connection state
+ *
+ * Allocations are carved in order from a chunk; when it runs out a new
+ * one twice its size (or as big as the request) is taken from malloc.
+ * Nothing is freed on its own: arena_reset drops everything at once
+ * between requests, keeping only the first chunk, and arena_free returns
+ * that too. A connection thus costs what its requests actually use.
+ */
+#include <string.h>
+#include "csapp.h"
+#include "arena.h"
+
+#define ALIGN 16
+
+struct arena_chunk {
+    arena_chunk *prev;
+    size_t size;  // Bytes of data
+    char data[] __attribute__((aligned(ALIGN)));
+};
+
+static void held_add(arena *a, long n) {
+    a->held += n;
+    if (a->held > a->peak)
+        a->peak = a->held;
+    if (a->gauge)
+        __sync_fetch_and_add(a->gauge, n);
+}
+
+void arena_init(arena *a, long *gauge) {
+    memset(a, 0, sizeof(*a));
+    a->gauge = gauge;
+}
+
+static void chunk_new(arena *a, size_t need) {
+    size_t size = a->chunk ? a->chunk->size * 2 : ARENA_CHUNK - sizeof(arena_chunk);
+    arena_chunk *c;
+
+    if (size < need)
+        size = need;
+    c = Malloc(sizeof(arena_chunk) + size);
+    c->prev = a->chunk;
+    c->size = size;
+    a->chunk = c;
+    a->used = 0;
+    held_add(a, sizeof(arena_chunk) + size);
+}
+
+/* Returns size bytes aligned for any type; never fails */
+void *arena_alloc(arena *a, size_t size) {
+    size_t off = (a->used + ALIGN - 1) & ~(size_t)(ALIGN - 1);
+
+    if (a->chunk == NULL || off + size > a->chunk->size) {
+        chunk_new(a, size);
+        off = 0;
+    }
+    a->last = off;
+    a->used = off + size;
+    return a->chunk->data + off;
+}
+
+/*
+ * Resizes p, of old bytes, to size. The newest allocation grows in place
+ * while its chunk has room; anything else is copied.
+ */
+void *arena_realloc(arena *a, void *p, size_t old, size_t size) {
+    void *q;
+
+    if (p && p == a->chunk->data + a->last && a->last + size <= a->chunk->size) {
+        a->used = a->last + size;
+        return p;
+    }
+    q = arena_alloc(a, size);
+    if (p)
+        memcpy(q, p, old < size ? old : size);
+    return q;
+}
+
+char *arena_strndup(arena *a, const char *s, size_t n) {
+    char *d = arena_alloc(a, n + 1);
+    memcpy(d, s, n);
+    d[n] = '\0';
+    return d;
+}
+
+/* Frees everything allocated, keeping the first chunk for the next request */
+void arena_reset(arena *a) {
+    arena_chunk *c;
+
+    while (a->chunk && a->chunk->prev) {
+        c = a->chunk;
+        a->chunk = c->prev;
+        held_add(a, -(long)(sizeof(arena_chunk) + c->size));
+        Free(c);
+    }
+    a->used = a->last = 0;
+}
+
+void arena_free(arena *a) {
+    arena_reset(a);
+    if (a->chunk) {
+        held_add(a, -(long)(sizeof(arena_chunk) + a->chunk->size));
+        Free(a->chunk);
+        a->chunk = NULL;
+    }
+}
@@ -0,0 +1,29 @@
+/*
+ * arena.h - bump allocator for per-connection state
+ */
+#ifndef __ARENA_H__
+#define __ARENA_H__
+
+#include <stddef.h>
+
+#define ARENA_CHUNK 4096  // Size of the first chunk; later ones double
+
+typedef struct arena_chunk arena_chunk;
+
+typedef struct {
+    arena_chunk *chunk;  // Newest chunk, the one being carved
+    size_t used;         // Bytes of it handed out
+    size_t last;         // Offset in it of the newest allocation, for arena_realloc
+    size_t held;         // Bytes in all chunks, headers included
+    size_t peak;         // Most held since arena_init
+    long *gauge;         // Also tracks held, across arenas; may be NULL
+} arena;
+
+void arena_init(arena *a, long *gauge);
+void *arena_alloc(arena *a, size_t size);
+void *arena_realloc(arena *a, void *p, size_t old, size_t size);
+char *arena_strndup(arena *a, const char *s, size_t n);
+void arena_reset(arena *a);
+void arena_free(arena *a);
+
+#endif /* __ARENA_H__ */
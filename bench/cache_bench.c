@@ -0,0 +1,146 @@
+/*
+ * cache_bench.c - cost of cache lookups and evictions
+ *
+ * Fills the cache, then times hit lookups (spread over every key, and on a
+ * hot set small enough for the per-thread front cache), miss lookups and
+ * inserts that each evict the LRU entry, reading the hardware cache-miss
+ * counter around every phase. For comparison the same scans are run over the previous
+ * layout, where every slot interleaved a 100 KB object and an 8 KB URL with
+ * its hot fields.
+ *
+ * usage: bench/cache_bench [iterations]
+ */
+#include <stdint.h>
+#include <time.h>
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <sys/ioctl.h>
+#include "csapp.h"
+#include "cache.h"
+
+typedef struct {
+    char cache_obj[MAX_OBJECT_SIZE];
+    char cache_url[MAXLINE];
+    int LRU;
+    int isEmpty;
+} legacy_block;
+
+static int perf_fd = -1;
+
+static void counter_open() {
+    struct perf_event_attr attr;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.config = PERF_COUNT_HW_CACHE_MISSES;
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    perf_fd = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+    if (perf_fd < 0)
+        fprintf(stderr, "perf_event_open: %s (cache misses not reported)\n", strerror(errno));
+}
+
+static void counter_start() {
+    if (perf_fd >= 0) {
+        ioctl(perf_fd, PERF_EVENT_IOC_RESET, 0);
+        ioctl(perf_fd, PERF_EVENT_IOC_ENABLE, 0);
+    }
+}
+
+static long long counter_stop() {
+    long long count = -1;
+    if (perf_fd >= 0) {
+        ioctl(perf_fd, PERF_EVENT_IOC_DISABLE, 0);
+        if (read(perf_fd, &count, sizeof(count)) != sizeof(count))
+            count = -1;
+    }
+    return count;
+}
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void report(const char *phase, int iters, double secs, long long misses) {
+    printf("%-16s %10.1f ns/op", phase, secs * 1e9 / iters);
+    if (misses >= 0)
+        printf(" %10.2f cache-misses/op", (double)misses / iters);
+    printf("\n");
+}
+
+#define PHASE(name, iters, ...) do {                    \
+        double t0 = now();                              \
+        counter_start();                                \
+        for (int it = 0; it < (iters); it++) { __VA_ARGS__; } \
+        long long m = counter_stop();                   \
+        report(name, iters, now() - t0, m);             \
+    } while (0)
+
+int main(int argc, char **argv) {
+    int iters = argc > 1 ? atoi(argv[1]) : 20000;
+    char key[64], obj[256];
+    cache_obj hit;
+    size_t objLen;
+    volatile int sink = 0;
+
+    counter_open();
+    cache_init();
+
+    objLen = sprintf(obj, "HTTP/1.0 200 OK\r\nContent-length: 4\r\n\r\nbody");
+    for (int i = 0; i < CACHE_OBJS_COUNT; i++) {
+        sprintf(key, "http://bench.example/object/%d", i);
+        obj[objLen - 1] = 'a' + i % 26;  // Keep dedup out of the picture
+        cache_uri(key, NULL, obj, objLen);
+    }
+
+    printf("slots: %d\n", CACHE_OBJS_COUNT);
+    PHASE("lookup hit", iters, {
+        sprintf(key, "http://bench.example/object/%d", (it * 7919) % CACHE_OBJS_COUNT);
+        if (cache_lookup(key, &hit)) {
+            sink += hit.body->size;
+            cache_release(&hit);
+        }
+    });
+    PHASE("lookup hot", iters, {  // Served by the thread's front cache
+        sprintf(key, "http://bench.example/object/%d", it % 16);
+        if (cache_lookup(key, &hit)) {
+            sink += hit.body->size;
+            cache_release(&hit);
+        }
+    });
+    PHASE("lookup miss", iters, {
+        sprintf(key, "http://bench.example/missing/%d", it);
+        sink += cache_lookup(key, &hit);
+    });
+    PHASE("insert+evict", iters, {
+        sprintf(key, "http://bench.example/new/%d", it);
+        cache_uri(key, NULL, obj, objLen);
+    });
+
+    /* The same scans over the old interleaved layout */
+    legacy_block *legacy = Calloc(CACHE_OBJS_COUNT, sizeof(legacy_block));
+    for (int i = 0; i < CACHE_OBJS_COUNT; i++) {
+        sprintf(legacy[i].cache_url, "http://bench.example/object/%d", i);
+        legacy[i].LRU = i;
+    }
+    PHASE("legacy miss", iters, {
+        sprintf(key, "http://bench.example/missing/%d", it);
+        for (int i = 0; i < CACHE_OBJS_COUNT; i++)
+            if (!legacy[i].isEmpty && !strcmp(key, legacy[i].cache_url))
+                sink++;
+    });
+    PHASE("legacy evict", iters, {
+        int min = INT32_MAX, minindex = 0;
+        for (int i = 0; i < CACHE_OBJS_COUNT; i++)
+            if (legacy[i].LRU < min) {
+                min = legacy[i].LRU;
+                minindex = i;
+            }
+        legacy[minindex].LRU = CACHE_OBJS_COUNT + it;
+    });
+    Free(legacy);
+    return sink == -1;
+}
@@ -0,0 +1,236 @@
+/*
+ * parse_bench.c - request head parse throughput
+ *
+ * Parses the same request heads over and over with each kernel in
+ * hparse.c this CPU supports, and with the line-at-a-time sscanf parsing
+ * the proxy used before, and reports GB/s of head parsed.
+ *
+ * With "split", instead checks the resumable parser in hstream.c: every
+ * head, good and bad, is fed through hs_feed in two pieces split at each
+ * byte boundary and then one byte at a time, and each result must match
+ * a one-shot hp_parse_request of the same bytes under every kernel.
+ *
+ * usage: bench/parse_bench [iterations]
+ *        bench/parse_bench split
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include "hparse.h"
+#include "hstream.h"
+
+static const char *heads[] = {
+    /* What the driver's clients send */
+    "GET http://localhost:18101/home.html HTTP/1.0\r\n"
+    "Host: localhost:18101\r\n"
+    "\r\n",
+
+    /* A browser */
+    "GET http://www.example.com/static/css/site.min.css?v=20120305 HTTP/1.1\r\n"
+    "Host: www.example.com\r\n"
+    "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:10.0.3) Gecko/20120305 Firefox/10.0.3\r\n"
+    "Accept: text/css,*/*;q=0.1\r\n"
+    "Accept-Language: en-US,en;q=0.5\r\n"
+    "Accept-Encoding: gzip, deflate\r\n"
+    "Referer: http://www.example.com/index.html\r\n"
+    "Connection: keep-alive\r\n"
+    "Proxy-Connection: keep-alive\r\n"
+    "If-Modified-Since: Mon, 05 Mar 2012 10:00:00 GMT\r\n"
+    "If-None-Match: \"5f3a-4b8e2c1d\"\r\n"
+    "Cache-Control: max-age=0\r\n"
+    "\r\n",
+
+    /* Bare LFs, empty and padded values */
+    "GET /a?b=c HTTP/1.1\n"
+    "Host: localhost\n"
+    "X-Empty:\n"
+    "X-Padded: \t spaced out \t\r\n"
+    "\n",
+};
+
+/* Heads both parsers must refuse; only the split check uses them */
+static const char *bad_heads[] = {
+    "GET http://localhost/ HTTP/1.0\r\nHost : localhost\r\n\r\n",
+    "GET http://localhost/ HTTP/1.0\r\nHost\t: localhost\r\n\r\n",
+    "GET http://localhost/ HTTP/1.0\r\n: empty name\r\n\r\n",
+    "GET http://localhost/ HTTP/1.0\r\nHost: localhost\r\n folded\r\n\r\n",
+    "GET http://localhost/ HTTP/1.0\r\nNo colon here\r\n\r\n",
+    "GET HTTP/1.0\r\n\r\n",
+};
+
+#define NELEMS(a) ((int)(sizeof(a) / sizeof((a)[0])))
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void report(const char *name, const char *head, long iters, double secs) {
+    double bytes = (double)strlen(head) * iters;
+    printf("%-8s %5zu B %8.2f GB/s %8.1f ns/head\n", name, strlen(head), bytes / secs / 1e9,
+           secs * 1e9 / iters);
+}
+
+/* The previous parsing: sscanf on the request line, then a prefix test per line */
+static int parse_lines(const char *head) {
+    char line[8192], method[8192], uri[8192], version[8192];
+    const char *p = head, *eol;
+    int n = 0;
+
+    while ((eol = strchr(p, '\n')) != NULL) {
+        size_t len = eol - p + 1;
+        memcpy(line, p, len);
+        line[len] = '\0';
+        p = eol + 1;
+        if (n++ == 0) {
+            sscanf(line, "%s %s %s", method, uri, version);
+            continue;
+        }
+        if (!strcmp(line, "\r\n"))
+            break;
+        n += !strncasecmp(line, "Host", 4);
+    }
+    return n;
+}
+
+/* What a parser saw: the request line parts and the fields, one per line */
+typedef struct {
+    char text[8192];
+    size_t len;
+} transcript;
+
+static void add(transcript *t, const char *s, size_t n, char sep) {
+    if (t->len + n + 1 < sizeof(t->text)) {
+        memcpy(t->text + t->len, s, n);
+        t->len += n;
+        t->text[t->len++] = sep;
+        t->text[t->len] = '\0';
+    }
+}
+
+static int on_start(hs_parser *p, const char *a, size_t alen, const char *b, size_t blen,
+                    const char *c, size_t clen) {
+    add(p->arg, a, alen, ' ');
+    add(p->arg, b, blen, ' ');
+    add(p->arg, c, clen, '\n');
+    return 0;
+}
+
+static int on_header(hs_parser *p, const char *name, size_t nlen, const char *value, size_t vlen) {
+    add(p->arg, name, nlen, ':');
+    add(p->arg, value, vlen, '\n');
+    return 0;
+}
+
+static const hs_callbacks split_callbacks = { on_start, on_header, NULL, NULL, NULL };
+
+/* The one-shot parse: its head length, or -1, and the transcript */
+static long one_shot(const char *head, size_t len, transcript *t) {
+    hp_request req;
+    long n = hp_parse_request(head, len, &req);
+
+    t->len = 0;
+    t->text[0] = '\0';
+    if (n <= 0)
+        return n < 0 ? -1 : 0;
+    add(t, HP_AT(head, req.method), req.method.len, ' ');
+    add(t, HP_AT(head, req.target), req.target.len, ' ');
+    add(t, HP_AT(head, req.version), req.version.len, '\n');
+    for (int i = 0; i < req.nheaders; i++) {
+        add(t, HP_AT(head, req.headers[i].name), req.headers[i].name.len, ':');
+        add(t, HP_AT(head, req.headers[i].value), req.headers[i].value.len, '\n');
+    }
+    return n;
+}
+
+/* Feeds head in pieces of at most step bytes after the first cut; the same result shape as one_shot */
+static long fed(const char *head, size_t len, size_t cut, size_t step, transcript *t) {
+    hs_parser p;
+    size_t pos = 0;
+    long consumed = 0;
+
+    t->len = 0;
+    t->text[0] = '\0';
+    hs_init(&p, HS_REQUEST, &split_callbacks, t, NULL);
+    while (pos < len && !hs_done(&p)) {
+        size_t n = pos < cut ? cut - pos : len - pos;
+        ssize_t used;
+        if (n > step && pos >= cut)
+            n = step;
+        if ((used = hs_feed(&p, head + pos, n)) < 0) {
+            consumed = -1;
+            break;
+        }
+        consumed += used;
+        pos += n;
+    }
+    if (consumed >= 0 && !hs_done(&p))
+        consumed = 0;
+    hs_free(&p);
+    return consumed;
+}
+
+static int check(const char *head, const char *kernel, size_t cut, size_t step) {
+    static transcript want, got;
+    size_t len = strlen(head);
+    long n = one_shot(head, len, &want), m = fed(head, len, cut, step, &got);
+
+    if (n == m && (n < 0 || !strcmp(want.text, got.text)))
+        return 0;
+    printf("MISMATCH %s cut %zu step %zu: hparse %ld, hstream %ld\n%s--\n%s--\n", kernel, cut, step, n, m,
+           want.text, got.text);
+    return 1;
+}
+
+/* Every split of every head under every kernel; returns the number of mismatches */
+static int split_check(const char **kernels, int nkernels) {
+    int fails = 0, runs = 0;
+
+    for (int k = 0; k < nkernels; k++) {
+        if (hp_use(kernels[k]) < 0)
+            continue;
+        for (int h = 0; h < NELEMS(heads) + NELEMS(bad_heads); h++) {
+            const char *head = h < NELEMS(heads) ? heads[h] : bad_heads[h - NELEMS(heads)];
+            size_t len = strlen(head);
+            for (size_t cut = 0; cut <= len; cut++, runs++)
+                fails += check(head, kernels[k], cut, len);
+            fails += check(head, kernels[k], 0, 1);
+            runs++;
+        }
+    }
+    printf("split: %d runs, %d mismatches\n", runs, fails);
+    return fails;
+}
+
+int main(int argc, char **argv) {
+    static const char *kernels[] = { "avx2", "sse4.2", "scalar" };
+    long iters = argc > 1 ? atol(argv[1]) : 2000000;
+    volatile long sink = 0;
+    hp_request req;
+
+    if (argc > 1 && !strcmp(argv[1], "split"))
+        return split_check(kernels, NELEMS(kernels)) != 0;
+
+    printf("default kernel: %s\n", hp_kernel());
+    for (int h = 0; h < NELEMS(heads); h++) {
+        size_t len = strlen(heads[h]);
+        for (int k = 0; k < NELEMS(kernels); k++) {
+            if (hp_use(kernels[k]) < 0) {
+                printf("%-8s not supported\n", kernels[k]);
+                continue;
+            }
+            double t0 = now();
+            for (long i = 0; i < iters; i++)
+                sink += hp_parse_request(heads[h], len, &req) + req.nheaders;
+            report(kernels[k], heads[h], iters, now() - t0);
+        }
+        double t0 = now();
+        for (long i = 0; i < iters; i++)
+            sink += parse_lines(heads[h]);
+        report("sscanf", heads[h], iters, now() - t0);
+    }
+    return sink == -1;
+}
@@ -0,0 +1,1549 @@
+/*
+ * cache.c - shared web object cache
+ *
+ * A lookup goes through an open-addressing index of whole-object slots by
+ * key hash, so a hit costs a probe or two whatever the table size.
+ * Eviction scans the per-slot metadata, so it is kept in its own dense
+ * array of small, cache-line-aligned records: a full scan of
+ * CACHE_OBJS_COUNT slots reads contiguous lines instead of touching a
+ * different page per entry. Keys, response heads and bodies live out of
+ * line and are only dereferenced once the key hash matches.
+ *
+ * Response bodies are hashed on insert and shared between every key whose
+ * body is byte-for-byte identical, so mirrors and cache-busting variants of
+ * one asset are charged only once against MAX_CACHE_SIZE.
+ *
+ * Partial (206) responses are kept as byte-range segments of their key,
+ * next to but never visible as the whole object. Segments of the same
+ * representation that touch are merged, and once they cover the object it
+ * is promoted to an ordinary entry.
+ *
+ * Responses carrying Vary are stored under variant keys: the canonical key
+ * followed by the normalized values of the request headers it names. A
+ * small table maps the canonical key to those header names, so a lookup
+ * costs one probe there plus the usual key lookup.
+ *
+ * With the tier shared between worker processes (shmcache.c), that tier
+ * is the full-size store and this one a private front of
+ * PRIVATE_TIER_SIZE, so each worker adds a quarter of the cache on top of
+ * it rather than a whole second copy. The Vary lists then live in the
+ * shared segment too, so every worker derives the same variant keys.
+ */
+#include <limits.h>
+#include <strings.h>
+#include "csapp.h"
+#include "cache.h"
+#include "gzip.h"
+#include "mrc.h"
+#include "http.h"
+#include "shmcache.h"
+
+#define PRIVATE_TIER_SIZE (MAX_CACHE_SIZE / 4)  // In front of a shared tier
+
+#define INDEX_SLOTS (2 * CACHE_OBJS_COUNT)  // Power of two; at most half full
+#define INDEX_MASK (INDEX_SLOTS - 1)
+
+#define CACHE_VALID 0x1
+#define CACHE_GZIP  0x2   // Body stored gzip-encoded
+#define CACHE_SEGMENT 0x4 // Body is a byte range of the object
+
+/* Hot per-slot state; two records share a 64-byte line */
+typedef struct {
+    unsigned long hash;  // Hash of the key
+    uint32_t length;     // Head plus body bytes
+    uint32_t LRU;        // Clock stamp of the last use
+    uint16_t flags;
+    uint16_t part;       // Partition the key belongs to
+    unsigned long bodyHash;  // Hash of the body, for dedup on insert
+} __attribute__((aligned(32))) cache_meta;
+
+_Static_assert(sizeof(cache_meta) == 32, "two metadata records per cache line");
+
+/* Cold per-slot state, touched on a hash match or an insert */
+typedef struct {
+    char *key;
+    cache_payload *head;
+    cache_payload *body;    // Possibly shared with other keys
+    long segStart;          // Segments: offset of body in the object
+    long segTotal;          // Segments: length of the whole object
+} cache_entry;
+
+typedef struct {
+    cache_meta meta[CACHE_OBJS_COUNT] __attribute__((aligned(64)));
+    cache_entry entries[CACHE_OBJS_COUNT];
+    int16_t index[INDEX_SLOTS];  // Slot + 1 of each whole object, by key hash; 0 for none
+    int cache_num;
+    size_t used;        // Bytes actually held, shared bodies counted once
+    size_t logical;     // Bytes as seen by keys, shared bodies counted per key
+    long dedupHits;     // Inserts that reused an existing body
+    int segments;       // Entries holding byte ranges
+    long segHits;       // Range requests served from segments
+    long lookups;
+    long hits;
+    uint32_t clock;
+
+    int readCnt;  // Count of readers
+    sem_t wmutex;  // Protects access to cache
+    sem_t rdcntmutex;  // Protects access to readCnt
+} Cache;
+
+static Cache cache;
+
+/*
+ * With compression on, text-like bodies (HTML, CSS, JS, JSON, XML) are kept
+ * gzip-encoded, typically fitting 3-5x as many of them in MAX_CACHE_SIZE.
+ */
+#define CTYPE_LEN 64
+#define CTYPE_STATS 16
+#define GZIP_MIN_SIZE 256
+
+static int compressBodies;
+
+static struct {
+    char type[CTYPE_LEN];
+    long objects;
+    size_t raw;      // Body bytes as received
+    size_t stored;   // Body bytes as held in the cache
+} ctype_stats[CTYPE_STATS];
+
+/*
+ * Partitions keep one busy origin from evicting everyone else. Each has a
+ * guaranteed minimum and a maximum share of MAX_CACHE_SIZE (counted per
+ * key, shared bodies included); space below other partitions' minimums
+ * may be borrowed while it is unused. Partition 0 takes every key that no
+ * configured rule matches.
+ */
+#define CACHE_PARTS 16
+#define PART_ANY -1        // cache_lru: any slot
+#define PART_BORROWERS -2  // cache_lru: slots of partitions above their minimum
+
+typedef struct {
+    char name[32];
+    char match[256];  // Origin host, or key prefix if isPrefix
+    int isPrefix;
+    size_t min;
+    size_t max;
+    size_t used;      // Head plus body bytes of its keys, under the write lock
+    int objects;
+    long lookups;     // Shared-cache lookups; front-cache hits are per thread
+    long hits;
+} cache_part;
+
+static cache_part parts[CACHE_PARTS] = {
+    { "default", "", 0, 0, MAX_CACHE_SIZE }
+};
+static int nparts = 1;
+
+/* Keys known to vary, by canonical key */
+#define VARY_SLOTS 256
+#define VARY_PROBES 8
+#define VARY_NAMES 128
+#define VARY_MAX_VARIANTS 8
+#define VARY_SEP " vary "  // Between the canonical key and the header values
+
+typedef struct {
+    unsigned long hash;     // Hash of the canonical key
+    char *key;              // NULL for a never-used slot
+    char names[VARY_NAMES]; // Normalized Vary list; empty once the key stops varying
+    int variants;           // Variant keys cached, under the write lock
+} vary_rec;
+
+static vary_rec varies[VARY_SLOTS];
+
+#define L1_SLOTS 32
+#define L1_MAX_BYTES (4 * MAX_OBJECT_SIZE)
+#define L1_TOUCH_INTERVAL 16
+
+typedef struct {
+    char *key;              // NULL for a free entry
+    unsigned long hash;
+    cache_obj obj;          // References owned by this entry
+    int slot;               // Shared slot the object was found in
+    int part;
+    int dead;               // Slot emptied while the entry was lent out
+    unsigned hits;
+    unsigned LRU;
+} l1_entry;
+
+typedef struct l1_cache {
+    l1_entry e[L1_SLOTS];
+    pthread_mutex_t lock;   // Owner thread, and writers dropping slots
+    l1_entry *lent;         // Entry behind the owner's borrowed cache_obj
+    size_t bytes;
+    unsigned clock;
+    long lookups;
+    long hits;
+    long partHits[CACHE_PARTS];
+    struct l1_cache *next;  // All front caches, for cache_report
+    struct l1_cache *nextFree;
+} l1_cache;
+
+/* Responses being relayed from the origin that readers may attach to */
+#define FILL_ACTIVE  0
+#define FILL_DONE    1
+#define FILL_ABORTED 2
+
+struct cache_fill {
+    char *key;
+    char *buf;              // MAX_OBJECT_SIZE bytes
+    size_t len;             // Bytes received so far
+    size_t headLen;         // 0 until the head is complete
+    size_t expected;        // Head plus Content-Length, 0 if unknown
+    char *reqHeaders;       // Request the response answers, for Vary; NULL for none
+    http_meta meta;         // Of the head, once headLen is set
+    int unshared;           // Vary or not cacheable: not for readers of other requests
+    int state;
+    unsigned wakes;         // Bumped by cache_fill_wake
+    int refCnt;             // Filler plus attached readers
+    pthread_mutex_t lock;
+    pthread_cond_t more;    // Signalled on new bytes and on completion
+    struct cache_fill *next;
+};
+
+static cache_fill *fills;
+static sem_t fills_mutex;  // Protects fills
+static struct {
+    long started;
+    long attached;
+    long aborted;
+} fillStats;
+
+static __thread l1_cache *l1;
+static l1_cache *l1_list;
+static l1_cache *l1_free;  // Front caches no thread holds
+static sem_t l1_mutex;  // Protects both lists; taken inside the cache lock
+
+static void readerPre();
+static void readerAfter();
+static void writePre();
+static void writeAfter();
+static int cache_find(const char *key, unsigned long hash);
+static int cache_eviction();
+static int cache_lru(int part);
+static int cache_victim(int part, size_t size);
+static void cache_LRU(int index);
+static void cache_touch(int slot, unsigned long hash);
+static void vary_trim(const char *key, vary_rec *v);
+static int cache_lookup_shared(const char *key, cache_obj *obj);
+static void cache_uri_local(const char *key, const http_meta *meta, const char *buf, size_t size);
+
+void cache_init() {
+    memset(&cache, 0, sizeof(cache));
+    Sem_init(&cache.wmutex, 0, 1);
+    Sem_init(&cache.rdcntmutex, 0, 1);
+    Sem_init(&l1_mutex, 0, 1);
+    Sem_init(&fills_mutex, 0, 1);
+}
+
+void cache_set_compression(int on) {
+    compressBodies = on;
+}
+
+/*
+ * Reads partition rules, one per line:
+ *
+ *     # name    match                           min      max
+ *     news      host news.example.com           100000   400000
+ *     static    prefix http://cdn.example.com/  0        600000
+ *
+ * Returns the number of partitions defined, or -1 on error. The minimums,
+ * together with the default partition's, must fit in MAX_CACHE_SIZE.
+ */
+int cache_load_partitions(const char *filename) {
+    char line[MAXLINE], kind[16];
+    size_t minTotal = 0;
+    FILE *fp;
+
+    if ((fp = fopen(filename, "r")) == NULL)
+        return -1;
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        cache_part *p = &parts[nparts];
+
+        line[strcspn(line, "#")] = '\0';
+        if (sscanf(line, "%31s %15s %255s %zu %zu", p->name, kind, p->match, &p->min, &p->max) != 5)
+            continue;
+        if (nparts == CACHE_PARTS || (strcmp(kind, "host") && strcmp(kind, "prefix")) ||
+            p->min > p->max || p->max > MAX_CACHE_SIZE) {
+            fprintf(stderr, "bad partition rule: %s", line);
+            fclose(fp);
+            return -1;
+        }
+        p->isPrefix = !strcmp(kind, "prefix");
+        minTotal += p->min;
+        nparts++;
+    }
+    fclose(fp);
+    if (minTotal > MAX_CACHE_SIZE) {
+        fprintf(stderr, "partition minimums exceed MAX_CACHE_SIZE\n");
+        return -1;
+    }
+    return nparts - 1;
+}
+
+/* Partition of a canonical key (http://host[:port]/...) */
+static int part_of(const char *key) {
+    const char *host = key + (strncmp(key, "http://", 7) ? 0 : 7);
+    size_t hostLen = strcspn(host, ":/");
+
+    for (int i = 1; i < nparts; i++) {
+        if (parts[i].isPrefix) {
+            if (!strncmp(key, parts[i].match, strlen(parts[i].match)))
+                return i;
+        } else if (strlen(parts[i].match) == hostLen && !strncasecmp(host, parts[i].match, hostLen)) {
+            return i;
+        }
+    }
+    return 0;
+}
+
+/*
+ * The whole table is guarded by one readers-writer lock: inserts move bytes
+ * between entries (eviction, dedup), so per-slot locks would not suffice.
+ */
+static void readerPre() {
+    P(&cache.rdcntmutex);
+    cache.readCnt++;
+    if (cache.readCnt == 1)
+        P(&cache.wmutex);
+    V(&cache.rdcntmutex);
+}
+
+static void readerAfter() {
+    P(&cache.rdcntmutex);
+    cache.readCnt--;
+    if (cache.readCnt == 0)
+        V(&cache.wmutex);
+    V(&cache.rdcntmutex);
+}
+
+static void writePre() {
+    P(&cache.wmutex);
+}
+
+static void writeAfter() {
+    V(&cache.wmutex);
+}
+
+unsigned long cache_hash(const char *buf, size_t size) {
+    unsigned long h = 14695981039346656037UL;
+    for (size_t i = 0; i < size; i++) {
+        h ^= (unsigned char)buf[i];
+        h *= 1099511628211UL;
+    }
+    return h;
+}
+
+/* Slot of the whole object cached under key, or -1; caller holds the cache lock */
+static int cache_find(const char *key, unsigned long hash) {
+    int i;
+
+    for (unsigned long p = hash & INDEX_MASK; cache.index[p]; p = (p + 1) & INDEX_MASK) {
+        i = cache.index[p] - 1;
+        if (cache.meta[i].hash == hash && strcmp(key, cache.entries[i].key) == 0)
+            return i;
+    }
+    return -1;
+}
+
+/* Indexes whole-object slot i by its key hash; caller holds the write lock */
+static void index_add(int i) {
+    unsigned long p = cache.meta[i].hash & INDEX_MASK;
+
+    while (cache.index[p])
+        p = (p + 1) & INDEX_MASK;
+    cache.index[p] = i + 1;
+}
+
+/*
+ * Unindexes slot i, moving back any later entry of its probe run that
+ * would otherwise become unreachable. Caller holds the write lock.
+ */
+static void index_remove(int i) {
+    unsigned long p = cache.meta[i].hash & INDEX_MASK, q, home;
+
+    while (cache.index[p] != i + 1)
+        p = (p + 1) & INDEX_MASK;
+    cache.index[p] = 0;
+    for (q = (p + 1) & INDEX_MASK; cache.index[q]; q = (q + 1) & INDEX_MASK) {
+        home = cache.meta[cache.index[q] - 1].hash & INDEX_MASK;
+        if (((q - home) & INDEX_MASK) >= ((q - p) & INDEX_MASK)) {  // Home at or before the hole
+            cache.index[p] = cache.index[q];
+            cache.index[q] = 0;
+            p = q;
+        }
+    }
+}
+
+/* Whether slot i holds a segment of the key with hash; caller holds the lock */
+static int is_segment(int i, const char *key, unsigned long hash) {
+    return (cache.meta[i].flags & CACHE_SEGMENT) && cache.meta[i].hash == hash &&
+           strcmp(key, cache.entries[i].key) == 0;
+}
+
+/* Length of the canonical key that key, possibly a variant key, starts with */
+static size_t primary_len(const char *key) {
+    const char *sep = strstr(key, VARY_SEP);
+    return sep ? (size_t)(sep - key) : strlen(key);
+}
+
+/* Record for the canonical key of len bytes, or NULL; caller holds the lock */
+static vary_rec *vary_find(const char *key, size_t len) {
+    unsigned long hash = cache_hash(key, len);
+
+    for (int p = 0; p < VARY_PROBES; p++) {
+        vary_rec *v = &varies[(hash + p) % VARY_SLOTS];
+        if (v->key == NULL)
+            return NULL;
+        if (v->hash == hash && strlen(v->key) == len && !strncmp(v->key, key, len))
+            return v;
+    }
+    return NULL;
+}
+
+/* Records that key varies by names; caller holds the write lock */
+static vary_rec *vary_set(const char *key, const char *names) {
+    unsigned long hash = cache_hash(key, strlen(key));
+    vary_rec *v = vary_find(key, strlen(key));
+
+    for (int p = 0; v == NULL && p < VARY_PROBES; p++) {
+        vary_rec *r = &varies[(hash + p) % VARY_SLOTS];
+        if (r->key == NULL || (r->names[0] == '\0' && r->variants == 0))
+            v = r;
+    }
+    if (v == NULL)
+        v = &varies[hash % VARY_SLOTS];  // Crowded: the displaced key just stops matching variants
+    if (v->key == NULL || strcmp(v->key, key)) {
+        if (v->key)
+            Free(v->key);
+        v->key = strdup(key);
+        v->hash = hash;
+        v->variants = 0;
+    }
+    strcpy(v->names, names);
+    return v;
+}
+
+/*
+ * Appends to key (a canonical key of at most size bytes) the normalized
+ * values reqHeaders has for names, the normalized Vary list. Returns -1 if
+ * the variant key would not fit.
+ */
+static int vary_append(char *key, size_t size, const char *names, const char *reqHeaders) {
+    char list[VARY_NAMES], val[MAXLINE], norm[MAXLINE], *save;
+    size_t len = strlen(key);
+    int n;
+
+    strcpy(list, names);
+    if ((n = snprintf(key + len, size - len, "%s", VARY_SEP)) < 0 || (size_t)n >= size - len)
+        return -1;
+    len += n;
+    for (char *name = strtok_r(list, ",", &save); name; name = strtok_r(NULL, ",", &save)) {
+        norm[0] = '\0';
+        if (reqHeaders && http_header_value(reqHeaders, strlen(reqHeaders), name, val, sizeof(val)) &&
+            http_normalize_list(val, norm, sizeof(norm)) < 0)
+            return -1;
+        if ((n = snprintf(key + len, size - len, "%s=%s;", name, norm)) < 0 || (size_t)n >= size - len)
+            return -1;
+        len += n;
+    }
+    return 0;
+}
+
+/*
+ * Turns the canonical key (a buffer of size bytes) into the variant key for
+ * this request if responses for it are known to vary. Returns -1 if the
+ * variant key does not fit, in which case the request is not cacheable.
+ */
+int cache_variant_key(char *key, size_t size, const char *reqHeaders) {
+    char names[VARY_NAMES] = "";
+    vary_rec *v;
+
+    if (shm_cache_enabled()) {
+        if (!shm_vary_get(key, names, sizeof(names)))
+            return 0;
+    } else {
+        readerPre();
+        if ((v = vary_find(key, strlen(key))) != NULL)
+            strcpy(names, v->names);
+        readerAfter();
+    }
+    if (names[0] == '\0')
+        return 0;
+    return vary_append(key, size, names, reqHeaders);
+}
+
+static cache_payload *payload_new(const char *buf, size_t size, unsigned long hash) {
+    cache_payload *p = Malloc(sizeof(cache_payload) + size);
+    p->hash = hash;
+    p->size = size;
+    p->refCnt = 1;
+    p->keyCnt = 0;
+    p->meta = NULL;
+    p->prefetched = 0;
+    memcpy(p->data, buf, size);
+    return p;
+}
+
+static cache_payload *head_new(const char *head, size_t len, const http_meta *meta) {
+    cache_payload *p = payload_new(head, len, 0);
+    p->meta = Malloc(sizeof(http_meta));
+    *p->meta = *meta;
+    return p;
+}
+
+static void payload_get(cache_payload *p) {
+    __sync_fetch_and_add(&p->refCnt, 1);
+}
+
+static void payload_put(cache_payload *p) {
+    if (__sync_sub_and_fetch(&p->refCnt, 1) == 0) {
+        if (p->meta)
+            Free(p->meta);
+        Free(p);
+    }
+}
+
+/* Whether a body of this type is worth storing gzip-compressed */
+static int compressible(const http_meta *meta, size_t bodyLen) {
+    static const char *types[] = {
+        "application/javascript", "application/x-javascript", "application/json",
+        "application/xml", "image/svg+xml", NULL
+    };
+
+    if (bodyLen < GZIP_MIN_SIZE || meta->content_encoding[0])
+        return 0;
+    if (!strncmp(meta->content_type, "text/", 5))
+        return 1;
+    for (int i = 0; types[i]; i++) {
+        if (!strcmp(meta->content_type, types[i]))
+            return 1;
+    }
+    return 0;
+}
+
+/* Per-content-type byte counts; caller holds the write lock */
+static void ctype_account(const char *ctype, size_t rawLen, size_t storedLen) {
+    int i;
+
+    for (i = 0; i < CTYPE_STATS - 1 && ctype_stats[i].objects > 0; i++) {
+        if (!strcmp(ctype_stats[i].type, ctype))
+            break;
+    }
+    if (ctype_stats[i].objects == 0)
+        strcpy(ctype_stats[i].type, i == CTYPE_STATS - 1 ? "other" : ctype);
+    ctype_stats[i].objects++;
+    ctype_stats[i].raw += rawLen;
+    ctype_stats[i].stored += storedLen;
+}
+
+/*
+ * Per-thread front cache. Each thread keeps references to the objects it
+ * served most recently, so a hit on one of them takes only the thread's
+ * own, uncontended lock and touches no shared cache line. An entry lives
+ * exactly as long as its shared slot: cache_drop removes it from every
+ * front cache, so nothing stale is served and no body outlives the
+ * shared cache's budget. The one a thread has lent out is released when
+ * the thread releases it. Every L1_TOUCH_INTERVAL hits an entry refreshes
+ * its shared LRU stamp, under the read lock, so hot objects are not
+ * evicted there.
+ *
+ * Connection threads are short-lived, so a front cache is not freed with
+ * its thread: cache_thread_done puts it back in a pool, and the next
+ * thread to look something up takes it over, entries and all. There are
+ * as many as there have ever been concurrent connections.
+ */
+static l1_cache *l1_get() {
+    if (l1 == NULL) {
+        P(&l1_mutex);
+        if ((l1 = l1_free) != NULL) {
+            l1_free = l1->nextFree;
+        } else {
+            l1 = Calloc(1, sizeof(l1_cache));
+            pthread_mutex_init(&l1->lock, NULL);
+            l1->next = l1_list;
+            l1_list = l1;
+        }
+        V(&l1_mutex);
+    }
+    return l1;
+}
+
+/* Hands the calling thread's front cache on; call with nothing borrowed, before the thread exits */
+void cache_thread_done() {
+    if (l1 == NULL)
+        return;
+    P(&l1_mutex);
+    l1->nextFree = l1_free;
+    l1_free = l1;
+    V(&l1_mutex);
+    l1 = NULL;
+}
+
+/* Caller holds c->lock */
+static void l1_drop(l1_cache *c, l1_entry *e) {
+    c->bytes -= e->obj.head->size + e->obj.body->size;
+    payload_put(e->obj.head);
+    payload_put(e->obj.body);
+    Free(e->key);
+    e->key = NULL;
+}
+
+/* Removes slot from every front cache; caller holds the write lock */
+static void l1_evict(int slot) {
+    P(&l1_mutex);
+    for (l1_cache *c = l1_list; c; c = c->next) {
+        pthread_mutex_lock(&c->lock);
+        for (int i = 0; i < L1_SLOTS; i++) {
+            l1_entry *e = &c->e[i];
+            if (e->key == NULL || e->slot != slot)
+                continue;
+            if (e == c->lent)
+                e->dead = 1;  // In use by its owner, who drops it on release
+            else
+                l1_drop(c, e);
+        }
+        pthread_mutex_unlock(&c->lock);
+    }
+    V(&l1_mutex);
+}
+
+static int l1_find(l1_cache *c, const char *key, unsigned long hash, cache_obj *obj) {
+    l1_entry *e = NULL;
+    int touch = 0, slot = -1;
+
+    pthread_mutex_lock(&c->lock);
+    c->lookups++;
+    for (int i = 0; i < L1_SLOTS; i++) {
+        if (c->e[i].key && !c->e[i].dead && c->e[i].hash == hash && !strcmp(c->e[i].key, key)) {
+            e = &c->e[i];
+            break;
+        }
+    }
+    if (e) {
+        touch = ++e->hits % L1_TOUCH_INTERVAL == 0;
+        slot = e->slot;
+        e->LRU = ++c->clock;
+        c->partHits[e->part]++;
+        c->hits++;
+        c->lent = e;
+        *obj = e->obj;
+        obj->borrowed = 1;
+    }
+    pthread_mutex_unlock(&c->lock);
+    if (e == NULL)
+        return 0;
+
+    if (touch) {  // Not under c->lock, which writers take inside the cache lock
+        readerPre();
+        cache_touch(slot, hash);
+        readerAfter();
+    }
+    mrc_access(hash, obj->head->size + obj->body->size);
+    return 1;
+}
+
+/* Ends the loan of the entry behind a borrowed cache_obj */
+static void l1_return(l1_cache *c) {
+    pthread_mutex_lock(&c->lock);
+    if (c->lent && c->lent->dead) {
+        c->lent->dead = 0;
+        l1_drop(c, c->lent);
+    }
+    c->lent = NULL;
+    pthread_mutex_unlock(&c->lock);
+}
+
+static l1_entry *l1_oldest(l1_cache *c) {
+    l1_entry *oldest = NULL;
+    for (int i = 0; i < L1_SLOTS; i++) {
+        if (c->e[i].key && (oldest == NULL || c->e[i].LRU < oldest->LRU))
+            oldest = &c->e[i];
+    }
+    return oldest;
+}
+
+static l1_entry *l1_free_slot(l1_cache *c) {
+    for (int i = 0; i < L1_SLOTS; i++) {
+        if (c->e[i].key == NULL)
+            return &c->e[i];
+    }
+    return NULL;
+}
+
+/*
+ * Adds a shared-cache hit in slot to the front cache, taking its own
+ * references. Caller holds the read lock, so the slot is still current.
+ */
+static void l1_fill(l1_cache *c, const char *key, unsigned long hash, const cache_obj *obj, int slot) {
+    size_t size = obj->head->size + obj->body->size;
+    l1_entry *e;
+
+    if (size > L1_MAX_BYTES)
+        return;
+    pthread_mutex_lock(&c->lock);
+    while ((e = l1_free_slot(c)) == NULL || c->bytes + size > L1_MAX_BYTES)
+        l1_drop(c, l1_oldest(c));
+
+    e->key = strdup(key);
+    e->hash = hash;
+    e->obj = *obj;
+    payload_get(e->obj.head);
+    payload_get(e->obj.body);
+    e->slot = slot;
+    e->part = cache.meta[slot].part;
+    e->dead = 0;
+    e->hits = 0;
+    e->LRU = ++c->clock;
+    c->bytes += size;
+    pthread_mutex_unlock(&c->lock);
+}
+
+/* Refreshes the LRU stamp of slot if it still holds the key with hash */
+static void cache_touch(int slot, unsigned long hash) {
+    if ((cache.meta[slot].flags & CACHE_VALID) && cache.meta[slot].hash == hash)
+        cache_LRU(slot);
+}
+
+/*
+ * Looks key up and, on a hit, fills obj with references to the cached head
+ * and body that stay valid until cache_release, even if the entry is
+ * evicted meanwhile. Hits from the calling thread's front cache are
+ * borrowed rather than referenced, so obj must be released before the same
+ * thread looks anything else up. Returns 1 on a hit and 0 on a miss.
+ */
+int cache_lookup(const char *key, cache_obj *obj) {
+    unsigned long hash = cache_hash(key, strlen(key));
+    l1_cache *c = l1_get();
+    int i;
+
+    if (l1_find(c, key, hash, obj))
+        return 1;
+
+    __sync_fetch_and_add(&cache.lookups, 1);
+    readerPre();
+    if ((i = cache_find(key, hash)) == -1) {
+        readerAfter();
+        int part = part_of(key), hit = shm_cache_enabled() && cache_lookup_shared(key, obj);
+        __sync_fetch_and_add(&parts[part].lookups, 1);
+        if (hit) {
+            __sync_fetch_and_add(&cache.hits, 1);
+            __sync_fetch_and_add(&parts[part].hits, 1);
+        }
+        return hit;
+    }
+    int part = cache.meta[i].part;
+    obj->head = cache.entries[i].head;
+    obj->body = cache.entries[i].body;
+    obj->gzip = (cache.meta[i].flags & CACHE_GZIP) != 0;
+    obj->borrowed = 0;
+    payload_get(obj->head);
+    payload_get(obj->body);
+    cache_LRU(i);
+    l1_fill(c, key, hash, obj, i);
+    readerAfter();
+    __sync_fetch_and_add(&cache.hits, 1);
+    __sync_fetch_and_add(&parts[part].lookups, 1);
+    __sync_fetch_and_add(&parts[part].hits, 1);
+    mrc_access(hash, obj->head->size + obj->body->size);
+    return 1;
+}
+
+/* Bytes the cache currently holds: the shared tier's, if there is one */
+size_t cache_bytes_used() {
+    if (shm_cache_enabled())
+        return shm_cache_bytes_used();
+    return __atomic_load_n(&cache.used, __ATOMIC_RELAXED);
+}
+
+/* Bytes this process's table may hold */
+static size_t cache_budget() {
+    return shm_cache_enabled() ? PRIVATE_TIER_SIZE : MAX_CACHE_SIZE;
+}
+
+typedef struct {
+    void (*fn)(const char *key, void *arg);
+    void *arg;
+} key_visitor;
+
+/* Passes on a shared-tier key this table does not also hold; caller holds the lock */
+static void shared_key(const char *key, void *arg) {
+    key_visitor *v = arg;
+
+    if (cache_find(key, cache_hash(key, strlen(key))) == -1)
+        v->fn(key, v->arg);
+}
+
+/*
+ * Calls fn once on the key of every cached whole object, in this table or
+ * in the tier shared with other processes, under the read lock.
+ */
+void cache_for_each_key(void (*fn)(const char *key, void *arg), void *arg) {
+    key_visitor v = { fn, arg };
+
+    readerPre();
+    for (int i = 0; i < CACHE_OBJS_COUNT; i++) {
+        if ((cache.meta[i].flags & (CACHE_VALID | CACHE_SEGMENT)) == CACHE_VALID)
+            fn(cache.entries[i].key, arg);
+    }
+    shm_cache_for_each_key(shared_key, &v);
+    readerAfter();
+}
+
+/* Whether key is cached, without counting as a lookup */
+int cache_contains(const char *key) {
+    unsigned long hash = cache_hash(key, strlen(key));
+    int found;
+
+    readerPre();
+    found = cache_find(key, hash) != -1;
+    readerAfter();
+    return found;
+}
+
+/* Copies key in from the tier shared with other processes, then looks it up */
+static int cache_lookup_shared(const char *key, cache_obj *obj) {
+    char *buf;
+    size_t size = shm_cache_get(key, &buf);
+    unsigned long hash = cache_hash(key, strlen(key));
+    int i, found = 0;
+
+    if (size == 0)
+        return 0;
+    cache_uri_local(key, NULL, buf, size);
+    Free(buf);
+
+    readerPre();
+    if ((i = cache_find(key, hash)) != -1) {
+        obj->head = cache.entries[i].head;
+        obj->body = cache.entries[i].body;
+        obj->gzip = (cache.meta[i].flags & CACHE_GZIP) != 0;
+        obj->borrowed = 0;
+        payload_get(obj->head);
+        payload_get(obj->body);
+        cache_LRU(i);
+        found = 1;
+    }
+    readerAfter();
+    return found;
+}
+
+/* Marks the entry for key as brought in by a prefetch, for cache_take_prefetched */
+void cache_mark_prefetched(const char *key) {
+    int i;
+
+    readerPre();
+    if ((i = cache_find(key, cache_hash(key, strlen(key)))) != -1)
+        cache.entries[i].head->prefetched = 1;
+    readerAfter();
+}
+
+/*
+ * Whether obj is a prefetched entry being served for the first time. Only
+ * reads the head it is about to send unless the mark is there to clear.
+ */
+int cache_take_prefetched(const cache_obj *obj) {
+    return obj->head->prefetched && __sync_bool_compare_and_swap(&obj->head->prefetched, 1, 0);
+}
+
+void cache_release(cache_obj *obj) {
+    if (obj->borrowed) {
+        l1_return(l1_get());
+        return;
+    }
+    payload_put(obj->head);
+    payload_put(obj->body);
+}
+
+/* Empties slot i; caller holds the write lock */
+static void cache_drop(int i) {
+    cache_entry *e = &cache.entries[i];
+
+    if (!(cache.meta[i].flags & CACHE_VALID))
+        return;
+    if (!(cache.meta[i].flags & CACHE_SEGMENT)) {
+        index_remove(i);
+        l1_evict(i);
+    }
+    if (--e->body->keyCnt == 0)
+        cache.used -= e->body->size;
+    cache.used -= e->head->size;
+    cache.logical -= cache.meta[i].length;
+    parts[cache.meta[i].part].used -= cache.meta[i].length;
+    parts[cache.meta[i].part].objects--;
+    if (cache.meta[i].flags & CACHE_SEGMENT)
+        cache.segments--;
+    else if (strstr(e->key, VARY_SEP)) {
+        vary_rec *v = vary_find(e->key, primary_len(e->key));
+        if (v)
+            v->variants--;
+    }
+    Free(e->key);
+    payload_put(e->head);
+    payload_put(e->body);
+    memset(e, 0, sizeof(*e));
+    cache.meta[i].flags = 0;
+    cache.cache_num--;
+}
+
+/*
+ * Places a head and body under key, making room as needed, and returns the
+ * slot. Caller holds the write lock and has checked that length fits the
+ * partition.
+ */
+static int cache_insert(const char *key, unsigned long keyHash, int part, const char *head, size_t hdrLen,
+                        const http_meta *meta, const char *data, size_t bodyLen, uint16_t flags) {
+    unsigned long hash = cache_hash(data, bodyLen);
+    cache_payload *body = NULL;
+    size_t length = hdrLen + bodyLen;
+    int victim, i;
+
+    for (i = 0; i < CACHE_OBJS_COUNT; i++) {
+        cache_payload *p = cache.entries[i].body;
+        if (cache.meta[i].flags == flags && cache.meta[i].bodyHash == hash &&
+            p->size == bodyLen && memcmp(p->data, data, bodyLen) == 0) {
+            body = p;
+            payload_get(body);
+            cache.dedupHits++;
+            break;
+        }
+    }
+    if (!body)
+        body = payload_new(data, bodyLen, hash);
+
+    /* Make room in the partition, then in the cache; a shared body costs nothing extra */
+    while (parts[part].used + length > parts[part].max && (victim = cache_lru(part)) >= 0)
+        cache_drop(victim);
+    while (cache.cache_num == CACHE_OBJS_COUNT ||
+           (cache.cache_num > 0 && cache.used + hdrLen + (body->keyCnt ? 0 : bodyLen) > cache_budget()))
+        cache_drop(cache_victim(part, length));
+
+    i = cache_eviction();
+    cache.entries[i].key = strdup(key);
+    cache.entries[i].head = head_new(head, hdrLen, meta);
+    cache.entries[i].body = body;
+    if (body->keyCnt++ == 0)
+        cache.used += bodyLen;
+    cache.meta[i].hash = keyHash;
+    cache.meta[i].bodyHash = hash;
+    cache.meta[i].length = length;
+    cache.meta[i].flags = flags;
+    cache.meta[i].part = part;
+    if (!(flags & CACHE_SEGMENT))
+        index_add(i);
+    parts[part].used += length;
+    parts[part].objects++;
+    cache.cache_num++;
+    cache.used += hdrLen;
+    cache.logical += length;
+    cache_LRU(i);
+    return i;
+}
+
+/* Drops the oldest variants of key's canonical key beyond VARY_MAX_VARIANTS - 1 */
+static void vary_trim(const char *key, vary_rec *v) {
+    size_t len = primary_len(key) + strlen(VARY_SEP);
+
+    while (v->variants >= VARY_MAX_VARIANTS) {
+        uint32_t min = UINT32_MAX;
+        int oldest = -1;
+        for (int i = 0; i < CACHE_OBJS_COUNT; i++) {
+            if ((cache.meta[i].flags & (CACHE_VALID | CACHE_SEGMENT)) == CACHE_VALID &&
+                cache.meta[i].LRU < min && !strncmp(cache.entries[i].key, key, len)) {
+                min = cache.meta[i].LRU;
+                oldest = i;
+            }
+        }
+        if (oldest < 0)
+            break;
+        cache_drop(oldest);
+    }
+}
+
+/*
+ * Stores a complete response (head and body) of size bytes under key, and
+ * publishes it to the tier shared with other processes if there is one.
+ * meta is the head's, or NULL to parse it here.
+ */
+void cache_uri(const char *key, const http_meta *meta, const char *buf, size_t size) {
+    cache_uri_local(key, meta, buf, size);
+    if (shm_cache_enabled())
+        shm_cache_put(key, buf, size);
+}
+
+static void cache_uri_local(const char *key, const http_meta *meta, const char *buf, size_t size) {
+    size_t hdrLen = http_head_length(buf, size);
+    size_t rawLen = size - hdrLen, bodyLen = rawLen;
+    const char *data = buf + hdrLen;
+    char *zbuf = NULL;
+    const char *ctype;
+    uint16_t flags = CACHE_VALID;
+    http_meta parsed;
+
+    if (meta == NULL) {
+        http_meta_parse(&parsed, buf, hdrLen);
+        meta = &parsed;
+    }
+    ctype = meta->content_type[0] ? meta->content_type : "none";
+    if (compressBodies && compressible(meta, rawLen) &&
+        (bodyLen = gzip_deflate(data, rawLen, &zbuf)) > 0) {
+        data = zbuf;
+        flags |= CACHE_GZIP;
+    } else {
+        bodyLen = rawLen;
+    }
+
+    unsigned long keyHash = cache_hash(key, strlen(key));
+    int part = part_of(key), i;
+
+    if (hdrLen + bodyLen > parts[part].max) {
+        if (zbuf)
+            Free(zbuf);
+        return;
+    }
+
+    writePre();
+    if ((i = cache_find(key, keyHash)) != -1)
+        cache_drop(i);  // Also out of every front cache
+    for (i = 0; i < CACHE_OBJS_COUNT; i++) {
+        if (is_segment(i, key, keyHash))
+            cache_drop(i);  // Superseded by the whole object
+    }
+    vary_rec *v = NULL;
+    if (strstr(key, VARY_SEP) && (v = vary_find(key, primary_len(key))) != NULL)
+        vary_trim(key, v);
+    cache_insert(key, keyHash, part, buf, hdrLen, meta, data, bodyLen, flags);
+    if (v)
+        v->variants++;
+    ctype_account(ctype, rawLen, bodyLen);
+    writeAfter();
+
+    mrc_access(keyHash, hdrLen + bodyLen);
+    if (zbuf)
+        Free(zbuf);
+}
+
+/*
+ * Stores a complete response to a request with reqHeaders, fetched under
+ * key as given by cache_variant_key, if meta (parsed from the head when
+ * NULL) admits it. A response with Vary goes under its variant key, Vary:
+ * * is not cached, and a key whose responses stop varying goes back to
+ * being stored whole. reqHeaders is NULL for a background fetch with no
+ * client request behind it; a response with Vary then only records the
+ * Vary list, since no request says which variant it is.
+ */
+void cache_store(const char *key, const char *reqHeaders, const http_meta *meta, const char *buf, size_t size) {
+    char variant[MAXLINE];
+    http_meta parsed;
+    vary_rec *v;
+
+    if (meta == NULL) {
+        if (http_meta_parse(&parsed, buf, http_head_length(buf, size)) < 0)
+            return;
+        meta = &parsed;
+    }
+    if (!http_meta_cacheable(meta, reqHeaders) || strlen(key) >= sizeof(variant))
+        return;
+    strcpy(variant, key);
+    variant[primary_len(key)] = '\0';
+
+    if (meta->vary[0] == '\0') {
+        if (strstr(key, VARY_SEP)) {
+            writePre();
+            if ((v = vary_find(variant, strlen(variant))) != NULL)
+                v->names[0] = '\0';
+            writeAfter();
+            shm_vary_put(variant, "");
+        }
+        cache_uri(variant, meta, buf, size);
+        return;
+    }
+    writePre();
+    vary_set(variant, meta->vary);  // Normalized by http_meta_header
+    writeAfter();
+    shm_vary_put(variant, meta->vary);
+    if (reqHeaders && vary_append(variant, sizeof(variant), meta->vary, reqHeaders) == 0)
+        cache_uri(variant, meta, buf, size);
+}
+
+/*
+ * Finds a segment of key holding the byte range first-last (see
+ * http_range_resolve, which this applies against the object's length) and
+ * fills obj with references to it as cache_lookup does. On a hit the range
+ * is resolved in place and *start and *total give the segment's offset and
+ * the object's length. Returns 1 on a hit and 0 on a miss.
+ */
+int cache_segment_lookup(const char *key, long *first, long *last, cache_obj *obj, long *start, long *total) {
+    unsigned long hash = cache_hash(key, strlen(key));
+    int found = 0;
+
+    readerPre();
+    for (int i = 0; i < CACHE_OBJS_COUNT && !found; i++) {
+        cache_entry *e = &cache.entries[i];
+        long f = *first, l = *last;
+
+        if (!is_segment(i, key, hash) || !http_range_resolve(&f, &l, e->segTotal) ||
+            f < e->segStart || l >= e->segStart + (long)e->body->size)
+            continue;
+        *first = f;
+        *last = l;
+        *start = e->segStart;
+        *total = e->segTotal;
+        obj->head = e->head;
+        obj->body = e->body;
+        obj->gzip = 0;
+        obj->borrowed = 0;
+        payload_get(obj->head);
+        payload_get(obj->body);
+        cache_LRU(i);
+        found = 1;
+    }
+    readerAfter();
+    if (found)
+        __sync_fetch_and_add(&cache.segHits, 1);
+    return found;
+}
+
+/*
+ * Stores a 206 response (single byte range, known total length) with meta
+ * (parsed from the head when NULL), to a request with reqHeaders, as a
+ * segment of key. Segments of a different representation, going by ETag
+ * and length, are dropped; those the new range overlaps or touches are
+ * merged into it as long as the result stays within MAX_OBJECT_SIZE and
+ * the partition. A merge that covers the whole object is stored as a 200
+ * response instead.
+ */
+void cache_segment_uri(const char *key, const char *reqHeaders, const http_meta *meta, const char *buf,
+                       size_t size) {
+    size_t hdrLen = http_head_length(buf, size), bodyLen = size - hdrLen;
+    char *merged, *whole = NULL;
+    http_meta parsed, promoted;
+    long first, last, total, start, end;
+    unsigned long keyHash = cache_hash(key, strlen(key));
+    int part = part_of(key), grown, i;
+    size_t wholeLen = 0;
+
+    if (meta == NULL) {
+        if (http_meta_parse(&parsed, buf, hdrLen) < 0)
+            return;
+        meta = &parsed;
+    }
+    first = meta->range_first;
+    last = meta->range_last;
+    total = meta->range_total;
+    if (first < 0 || last < first || last >= total || (size_t)(last - first + 1) != bodyLen)
+        return;  // Unknown total ("*") or inconsistent
+    if (hdrLen + bodyLen > parts[part].max)
+        return;
+    if ((meta->flags & (HM_NO_STORE | HM_NO_CACHE | HM_PRIVATE | HM_SET_COOKIE | HM_VARY_ANY)) ||
+        !http_meta_shareable(meta, reqHeaders))
+        return;
+    if (!strstr(key, VARY_SEP) && meta->vary[0])
+        return;  // Which variant this is only shows once the full response is stored
+
+    writePre();
+    if (cache_find(key, keyHash) != -1) {  // Whole object already cached
+        writeAfter();
+        return;
+    }
+
+    /* Widen [start, end) over every segment it reaches */
+    start = first;
+    end = last + 1;
+    do {
+        grown = 0;
+        for (i = 0; i < CACHE_OBJS_COUNT; i++) {
+            cache_entry *e = &cache.entries[i];
+            long s, t;
+
+            if (!is_segment(i, key, keyHash))
+                continue;
+            if (e->segTotal != total || strcmp(e->head->meta->etag, meta->etag)) {
+                cache_drop(i);  // Another version of the object
+                continue;
+            }
+            s = e->segStart;
+            t = s + e->body->size;
+            if (s > end || t < start || (s >= start && t <= end))
+                continue;
+            if ((t > end ? t : end) - (s < start ? s : start) > MAX_OBJECT_SIZE)
+                continue;
+            start = s < start ? s : start;
+            end = t > end ? t : end;
+            grown = 1;
+        }
+    } while (grown);
+
+    /*
+     * A merge the partition cannot hold keeps the segments it would have
+     * replaced and adds just the new range. (A promoted head is no longer
+     * than the segment's: its Content-Length line replaces Content-Range.)
+     */
+    if (hdrLen + (end - start) > parts[part].max) {
+        start = first;
+        end = last + 1;
+    }
+
+    /* Assemble the merged range; the new bytes win */
+    merged = Malloc(end - start);
+    for (i = 0; i < CACHE_OBJS_COUNT; i++) {
+        cache_entry *e = &cache.entries[i];
+        if (is_segment(i, key, keyHash) && e->segStart >= start &&
+            e->segStart + (long)e->body->size <= end) {
+            memcpy(merged + (e->segStart - start), e->body->data, e->body->size);
+            cache_drop(i);
+        }
+    }
+    memcpy(merged + (first - start), buf + hdrLen, bodyLen);
+
+    if (start == 0 && end == total) {
+        static const char *drop[] = { "Content-Range", "Content-Length", NULL };
+        char extra[64], *head;
+        size_t len;
+
+        sprintf(extra, "Content-Length: %ld\r\n", total);
+        len = http_rewrite_head(buf, hdrLen, "HTTP/1.0 200 OK", drop, extra, &head);
+        whole = Malloc(len + total);
+        memcpy(whole, head, len);
+        memcpy(whole + len, merged, total);
+        wholeLen = len + total;
+        free(head);
+        promoted = *meta;
+        promoted.status = 200;
+        promoted.content_length = total;
+        promoted.range_first = promoted.range_last = promoted.range_total = -1;
+    } else {
+        i = cache_insert(key, keyHash, part, buf, hdrLen, meta, merged, end - start,
+                         CACHE_VALID | CACHE_SEGMENT);
+        cache.entries[i].segStart = start;
+        cache.entries[i].segTotal = total;
+        cache.segments++;
+    }
+    writeAfter();
+
+    if (whole) {
+        cache_uri(key, &promoted, whole, wholeLen);
+        Free(whole);
+    }
+    Free(merged);
+}
+
+/* Returns the first empty slot, or the least recently used one */
+static int cache_eviction() {
+    uint32_t min = UINT32_MAX;
+    int minindex = 0;
+    for (int i = 0; i < CACHE_OBJS_COUNT; i++) {
+        if (!(cache.meta[i].flags & CACHE_VALID))
+            return i;
+        if (cache.meta[i].LRU < min) {
+            min = cache.meta[i].LRU;
+            minindex = i;
+        }
+    }
+    return minindex;
+}
+
+/*
+ * Least recently used valid slot in partition part, or among PART_ANY or
+ * PART_BORROWERS; -1 if there is none.
+ */
+static int cache_lru(int part) {
+    uint32_t min = UINT32_MAX;
+    int minindex = -1;
+    for (int i = 0; i < CACHE_OBJS_COUNT; i++) {
+        cache_meta *m = &cache.meta[i];
+        if (!(m->flags & CACHE_VALID) || m->LRU >= min)
+            continue;
+        if (part == PART_ANY || m->part == part ||
+            (part == PART_BORROWERS && parts[m->part].used > parts[m->part].min)) {
+            min = m->LRU;
+            minindex = i;
+        }
+    }
+    return minindex;
+}
+
+/*
+ * Slot to evict so that partition part can grow by size bytes: its own
+ * oldest entry once it is past its guaranteed minimum, otherwise the oldest
+ * entry of a partition that is borrowing space beyond its minimum.
+ */
+static int cache_victim(int part, size_t size) {
+    int victim = -1;
+
+    if (parts[part].used + size > parts[part].min)
+        victim = cache_lru(part);
+    if (victim < 0)
+        victim = cache_lru(PART_BORROWERS);
+    if (victim < 0)
+        victim = cache_lru(PART_ANY);
+    return victim;
+}
+
+/* Stamps slot index as most recently used; safe under the read lock */
+static void cache_LRU(int index) {
+    cache.meta[index].LRU = __sync_add_and_fetch(&cache.clock, 1);
+}
+
+/*
+ * Streaming fills. While a response is being relayed from the origin it is
+ * registered here under its key, so a second client asking for the same
+ * object streams the bytes that have already arrived and then waits for
+ * more, instead of fetching it again. The fill buffer is allocated at
+ * MAX_OBJECT_SIZE up front and bytes below len never change, so readers
+ * copy out of it without holding the lock.
+ *
+ * Readers only start streaming once the head shows a Content-Length that
+ * fits; responses of unknown length are handed over once complete. A fill
+ * that aborts (origin error, short body, object too large) wakes its
+ * readers: those that have sent nothing fall back to the origin, the rest
+ * can only drop their client connection.
+ */
+static cache_fill *fill_find(const char *key) {
+    for (cache_fill *f = fills; f; f = f->next) {
+        if (!strcmp(f->key, key))
+            return f;
+    }
+    return NULL;
+}
+
+static void fill_put(cache_fill *f) {
+    if (__sync_sub_and_fetch(&f->refCnt, 1) == 0) {
+        pthread_mutex_destroy(&f->lock);
+        pthread_cond_destroy(&f->more);
+        Free(f->key);
+        Free(f->reqHeaders);
+        Free(f->buf);
+        Free(f);
+    }
+}
+
+/*
+ * Registers a fill for key, fetched for a request with reqHeaders (may be
+ * NULL); NULL if one is already in progress.
+ */
+cache_fill *cache_fill_start(const char *key, const char *reqHeaders) {
+    cache_fill *f = NULL;
+
+    P(&fills_mutex);
+    if (fill_find(key) == NULL) {
+        f = Calloc(1, sizeof(cache_fill));
+        f->key = strdup(key);
+        f->reqHeaders = reqHeaders ? strdup(reqHeaders) : NULL;
+        f->buf = Malloc(MAX_OBJECT_SIZE);
+        f->state = FILL_ACTIVE;
+        f->refCnt = 1;
+        pthread_mutex_init(&f->lock, NULL);
+        pthread_cond_init(&f->more, NULL);
+        f->next = fills;
+        fills = f;
+        fillStats.started++;
+    }
+    V(&fills_mutex);
+    return f;
+}
+
+/* Returns a reference to the fill in progress for key, or NULL */
+cache_fill *cache_fill_attach(const char *key) {
+    cache_fill *f;
+
+    P(&fills_mutex);
+    if ((f = fill_find(key)) != NULL) {
+        __sync_fetch_and_add(&f->refCnt, 1);
+        fillStats.attached++;
+    }
+    V(&fills_mutex);
+    return f;
+}
+
+void cache_fill_release(cache_fill *f) {
+    fill_put(f);
+}
+
+/* Notes the head and what readers may do with it; caller holds f->lock */
+static void fill_set_head(cache_fill *f, size_t headLen) {
+    f->headLen = headLen;
+    f->unshared = f->meta.vary[0] || !http_meta_cacheable(&f->meta, f->reqHeaders);
+    if (f->meta.content_length >= 0 && !(f->meta.flags & HM_CHUNKED)) {
+        f->expected = headLen + f->meta.content_length;
+        if (f->expected > MAX_OBJECT_SIZE)
+            f->state = FILL_ABORTED;
+    }
+}
+
+/* Parses the head once it is complete, for fillers that did not (see cache_fill_head) */
+static void fill_parse_head(cache_fill *f) {
+    size_t h = http_head_length(f->buf, f->len);
+
+    if (h == f->len && (h < 4 || memcmp(f->buf + h - 4, "\r\n\r\n", 4)))
+        return;  // No blank line yet
+    http_meta_parse(&f->meta, f->buf, h);
+    fill_set_head(f, h);
+}
+
+/*
+ * Hands over the head's metadata, as parsed by a filler that reads the
+ * response with hstream.c, so the fill does not parse it again. Call it
+ * before appending the bytes past the head.
+ */
+void cache_fill_head(cache_fill *f, const http_meta *meta, size_t headLen) {
+    pthread_mutex_lock(&f->lock);
+    if (f->headLen == 0) {
+        f->meta = *meta;
+        fill_set_head(f, headLen);
+        pthread_cond_broadcast(&f->more);
+    }
+    pthread_mutex_unlock(&f->lock);
+}
+
+/* Appends n bytes; a fill that outgrows MAX_OBJECT_SIZE is aborted */
+void cache_fill_append(cache_fill *f, const char *buf, size_t n) {
+    pthread_mutex_lock(&f->lock);
+    if (f->state == FILL_ACTIVE) {
+        if (f->len + n > MAX_OBJECT_SIZE) {
+            f->state = FILL_ABORTED;
+        } else {
+            memcpy(f->buf + f->len, buf, n);
+            f->len += n;
+            if (f->headLen == 0)
+                fill_parse_head(f);
+        }
+        pthread_cond_broadcast(&f->more);
+    }
+    pthread_mutex_unlock(&f->lock);
+}
+
+static void fill_unlink(cache_fill *f) {
+    P(&fills_mutex);
+    for (cache_fill **pp = &fills; *pp; pp = &(*pp)->next) {
+        if (*pp == f) {
+            *pp = f->next;
+            break;
+        }
+    }
+    V(&fills_mutex);
+}
+
+/*
+ * Ends the fill. If ok and the response is complete it is inserted into the
+ * cache before the fill is unlinked and readers are told, so a request
+ * always finds it in one place or the other. An aborted fill is unlinked
+ * at once, so the next request starts a fresh one.
+ */
+void cache_fill_end(cache_fill *f, int ok) {
+    pthread_mutex_lock(&f->lock);
+    if (f->state == FILL_ACTIVE && ok && f->headLen && (!f->expected || f->len == f->expected))
+        f->state = FILL_DONE;
+    else
+        f->state = FILL_ABORTED;
+    pthread_mutex_unlock(&f->lock);
+
+    if (f->state == FILL_DONE) {
+        cache_store(f->key, f->reqHeaders, &f->meta, f->buf, f->len);  // No more appends: buf is stable
+        fill_unlink(f);
+    } else {
+        fill_unlink(f);
+        __sync_fetch_and_add(&fillStats.aborted, 1);
+    }
+
+    pthread_mutex_lock(&f->lock);
+    pthread_cond_broadcast(&f->more);
+    pthread_mutex_unlock(&f->lock);
+    fill_put(f);
+}
+
+/* Wakes readers waiting in cache_fill_stream, so they ask go_on again */
+void cache_fill_wake(cache_fill *f) {
+    pthread_mutex_lock(&f->lock);
+    f->wakes++;
+    pthread_cond_broadcast(&f->more);
+    pthread_mutex_unlock(&f->lock);
+}
+
+/*
+ * Streams the fill to connfd as it grows. Before each wait and write it
+ * calls go_on(arg), if given, and stops once that returns 0; it also asks
+ * each time the fill grows, even when a response of unknown length has
+ * nothing to write yet, so a reader's deadline follows the fill's
+ * progress and not just its own writes. Returns the
+ * number of bytes written, or -(bytes written) - 1 if the fill was
+ * aborted. A response with Vary may not suit this reader's request, and
+ * one that may not be cached may not be shared with it, so either is
+ * treated as an abort before the first byte.
+ */
+long cache_fill_stream(cache_fill *f, int connfd, int (*go_on)(void *arg), void *arg) {
+    size_t sent = 0, seen = 0, avail;
+    unsigned wakes;
+    int state, known;
+
+    while (1) {
+        if (go_on && !go_on(arg))
+            return sent;  // Out of time; the client has been cut off
+        pthread_mutex_lock(&f->lock);
+        wakes = f->wakes;
+        while (f->state == FILL_ACTIVE && !f->unshared && f->wakes == wakes && f->len == seen)
+            pthread_cond_wait(&f->more, &f->lock);
+        state = f->unshared ? FILL_ABORTED : f->state;
+        known = f->expected != 0;
+        avail = seen = f->len;
+        pthread_mutex_unlock(&f->lock);
+
+        if (state == FILL_ABORTED)
+            return -(long)sent - 1;
+        if (!known && state != FILL_DONE)
+            continue;  // Unknown length: handed over once complete
+        if (avail > sent) {
+            if (rio_writen(connfd, f->buf + sent, avail - sent) < 0)
+                return sent;  // Our client went away; nothing to fall back to
+            sent = avail;
+        }
+        if (state == FILL_DONE && sent == avail)
+            return sent;
+    }
+}
+
+void cache_report(FILE *fp) {
+    long l1Lookups = 0, l1Hits = 0;
+
+    P(&l1_mutex);
+    for (l1_cache *c = l1_list; c; c = c->next) {
+        l1Lookups += c->lookups;
+        l1Hits += c->hits;
+    }
+    V(&l1_mutex);
+    fprintf(fp, "cache.fills_started %ld\n", fillStats.started);
+    fprintf(fp, "cache.fills_attached %ld\n", fillStats.attached);
+    fprintf(fp, "cache.fills_aborted %ld\n", fillStats.aborted);
+    fprintf(fp, "cache.l1_lookups %ld\n", l1Lookups);
+    fprintf(fp, "cache.l1_hits %ld\n", l1Hits);
+    for (int p = 0; p < nparts; p++) {
+        long l1PartHits = 0;
+        P(&l1_mutex);
+        for (l1_cache *c = l1_list; c; c = c->next)
+            l1PartHits += c->partHits[p];
+        V(&l1_mutex);
+        long lookups = parts[p].lookups + l1PartHits, hits = parts[p].hits + l1PartHits;
+        fprintf(fp, "cache.part %s min=%zu max=%zu used=%zu objects=%d hit_ratio=%.3f\n",
+                parts[p].name, parts[p].min, parts[p].max, parts[p].used, parts[p].objects,
+                lookups ? (double)hits / lookups : 0.0);
+    }
+
+    readerPre();
+    fprintf(fp, "cache.objects %d\n", cache.cache_num);
+    fprintf(fp, "cache.lookups %ld\n", cache.lookups);
+    fprintf(fp, "cache.hits %ld\n", cache.hits);
+    fprintf(fp, "cache.bytes_used %zu\n", cache.used);
+    fprintf(fp, "cache.bytes_logical %zu\n", cache.logical);
+    fprintf(fp, "cache.dedup_hits %ld\n", cache.dedupHits);
+    fprintf(fp, "cache.dedup_saved_bytes %zu\n", cache.logical - cache.used);
+    fprintf(fp, "cache.segments %d\n", cache.segments);
+    int varying = 0;
+    for (int i = 0; i < VARY_SLOTS; i++)
+        varying += varies[i].key && varies[i].names[0];
+    fprintf(fp, "cache.vary_keys %d\n", varying);
+    fprintf(fp, "cache.segment_hits %ld\n", cache.segHits);
+    for (int i = 0; i < CTYPE_STATS && ctype_stats[i].objects > 0; i++)
+        fprintf(fp, "cache.ctype %s objects=%ld raw=%zu stored=%zu ratio=%.2f\n",
+                ctype_stats[i].type, ctype_stats[i].objects, ctype_stats[i].raw, ctype_stats[i].stored,
+                ctype_stats[i].stored ? (double)ctype_stats[i].raw / ctype_stats[i].stored : 1.0);
+    readerAfter();
+}
@@ -0,0 +1,69 @@
+/*
+ * cache.h - shared web object cache
+ */
+#ifndef __CACHE_H__
+#define __CACHE_H__
+
+#include <stdio.h>
+#include <stdint.h>
+#include <semaphore.h>
+#include "http.h"
+
+/* Recommended max cache and object sizes */
+#define MAX_CACHE_SIZE 1024000
+#define MAX_OBJECT_SIZE 102400
+
+#define CACHE_OBJS_COUNT 1024
+
+/* Refcounted byte string: a response head, or a body shared between keys */
+typedef struct {
+    unsigned long hash;  // FNV-1a of the data
+    size_t size;
+    int refCnt;          // Cache keys plus in-flight readers holding it
+    int keyCnt;          // Cache keys alone, under the cache write lock
+    http_meta *meta;     // A head's, parsed once before it is stored; NULL for a body
+    int prefetched;      // A head's, from a prefetch and not yet served; see cache_take_prefetched
+    char data[];
+} cache_payload;
+
+/* A cached response as handed to readers; both parts are referenced */
+typedef struct {
+    cache_payload *head;
+    cache_payload *body;
+    int gzip;            // Body is stored gzip-encoded
+    int borrowed;        // References owned by the thread's front cache
+} cache_obj;
+
+/* A response being relayed from the origin, see cache_fill_start */
+typedef struct cache_fill cache_fill;
+
+void cache_init();
+void cache_set_compression(int on);
+int cache_load_partitions(const char *filename);
+int cache_lookup(const char *key, cache_obj *obj);
+int cache_contains(const char *key);
+size_t cache_bytes_used();
+void cache_for_each_key(void (*fn)(const char *key, void *arg), void *arg);
+void cache_release(cache_obj *obj);
+void cache_mark_prefetched(const char *key);
+int cache_take_prefetched(const cache_obj *obj);
+void cache_thread_done();
+void cache_uri(const char *key, const http_meta *meta, const char *buf, size_t size);
+int cache_variant_key(char *key, size_t size, const char *reqHeaders);
+void cache_store(const char *key, const char *reqHeaders, const http_meta *meta, const char *buf, size_t size);
+int cache_segment_lookup(const char *key, long *first, long *last, cache_obj *obj, long *start, long *total);
+void cache_segment_uri(const char *key, const char *reqHeaders, const http_meta *meta, const char *buf, size_t size);
+
+cache_fill *cache_fill_start(const char *key, const char *reqHeaders);
+void cache_fill_head(cache_fill *f, const http_meta *meta, size_t headLen);
+void cache_fill_append(cache_fill *f, const char *buf, size_t n);
+void cache_fill_end(cache_fill *f, int ok);
+cache_fill *cache_fill_attach(const char *key);
+long cache_fill_stream(cache_fill *f, int connfd, int (*go_on)(void *arg), void *arg);
+void cache_fill_wake(cache_fill *f);
+void cache_fill_release(cache_fill *f);
+void cache_report(FILE *fp);
+
+unsigned long cache_hash(const char *buf, size_t size);
+
+#endif /* __CACHE_H__ */
@@ -0,0 +1,231 @@
+/*
+ * canon.c - canonical cache keys
+ *
+ * Two requests for the same resource should map to the same cache entry no
+ * matter how the client spelled the URL. A key is built as
+ *
+ *     http://<lowercase host>[:<port unless 80>]<path>[?<query>]
+ *
+ * where the path has its percent-encoding normalized (unreserved characters
+ * decoded, remaining escapes upper-cased) and its dot segments removed as in
+ * RFC 3986 section 5.2.4, and the fragment is dropped.
+ *
+ * An optional rules file adjusts the query per origin, one rule per line:
+ *
+ *     # host         action   parameters
+ *     example.com    ignore   utm_source,utm_medium,fbclid
+ *     example.com    sort
+ *     *              ignore   utm_*
+ *
+ * "ignore" drops the listed parameters (a trailing '*' matches a prefix),
+ * "sort" orders the remaining parameters. Host "*" applies to every origin.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include "canon.h"
+
+#define MAX_RULES 64
+#define MAX_RULE_PARAMS 16
+#define MAX_QUERY_PARAMS 64
+
+typedef struct {
+    char host[256];
+    int sort;
+    int nparams;
+    char params[MAX_RULE_PARAMS][64];
+} canon_rule;
+
+static canon_rule rules[MAX_RULES];
+static int nrules;
+
+int canon_load_rules(const char *filename) {
+    char line[1024], host[256], action[16], list[768];
+    FILE *fp;
+
+    if ((fp = fopen(filename, "r")) == NULL)
+        return -1;
+
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        char *hash = strchr(line, '#');
+        if (hash)
+            *hash = '\0';
+        list[0] = '\0';
+        if (sscanf(line, "%255s %15s %767s", host, action, list) < 2)
+            continue;
+        if (nrules == MAX_RULES) {
+            fprintf(stderr, "canon: more than %d rules in %s\n", MAX_RULES, filename);
+            break;
+        }
+
+        canon_rule *r = &rules[nrules];
+        memset(r, 0, sizeof(*r));
+        for (int i = 0; host[i]; i++)
+            r->host[i] = tolower((unsigned char)host[i]);
+        if (!strcasecmp(action, "sort")) {
+            r->sort = 1;
+        } else if (!strcasecmp(action, "ignore")) {
+            for (char *p = strtok(list, ","); p && r->nparams < MAX_RULE_PARAMS; p = strtok(NULL, ","))
+                snprintf(r->params[r->nparams++], sizeof(r->params[0]), "%s", p);
+        } else {
+            fprintf(stderr, "canon: unknown action '%s' for %s\n", action, host);
+            continue;
+        }
+        nrules++;
+    }
+    fclose(fp);
+    return nrules;
+}
+
+static int rule_applies(canon_rule *r, const char *host) {
+    return !strcmp(r->host, "*") || !strcmp(r->host, host);
+}
+
+/* Whether query parameter param (name[=value], len bytes) is ignored for host */
+static int param_ignored(const char *host, const char *param, size_t len) {
+    const char *eq = memchr(param, '=', len);
+    size_t namelen = eq ? (size_t)(eq - param) : len;
+
+    for (int i = 0; i < nrules; i++) {
+        if (!rule_applies(&rules[i], host))
+            continue;
+        for (int j = 0; j < rules[i].nparams; j++) {
+            const char *pat = rules[i].params[j];
+            size_t patlen = strlen(pat);
+            if (patlen > 0 && pat[patlen - 1] == '*') {
+                if (namelen >= patlen - 1 && !strncmp(param, pat, patlen - 1))
+                    return 1;
+            } else if (namelen == patlen && !strncmp(param, pat, patlen)) {
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
+
+static int query_sorted(const char *host) {
+    for (int i = 0; i < nrules; i++) {
+        if (rules[i].sort && rule_applies(&rules[i], host))
+            return 1;
+    }
+    return 0;
+}
+
+static int hexval(int c) {
+    if (isdigit(c))
+        return c - '0';
+    c = tolower(c);
+    return (c >= 'a' && c <= 'f') ? c - 'a' + 10 : -1;
+}
+
+static int unreserved(int c) {
+    return isalnum(c) || c == '-' || c == '.' || c == '_' || c == '~';
+}
+
+/*
+ * Copies len bytes of src to dst normalizing percent-encoding; returns the
+ * number of bytes written. dst must have room for len bytes.
+ */
+static size_t normalize_pct(char *dst, const char *src, size_t len) {
+    size_t n = 0;
+
+    for (size_t i = 0; i < len; i++) {
+        int hi, lo;
+        if (src[i] == '%' && i + 2 < len &&
+            (hi = hexval((unsigned char)src[i + 1])) >= 0 &&
+            (lo = hexval((unsigned char)src[i + 2])) >= 0) {
+            int c = hi * 16 + lo;
+            if (unreserved(c)) {
+                dst[n++] = c;
+            } else {
+                dst[n++] = '%';
+                dst[n++] = toupper((unsigned char)src[i + 1]);
+                dst[n++] = toupper((unsigned char)src[i + 2]);
+            }
+            i += 2;
+        } else {
+            dst[n++] = src[i];
+        }
+    }
+    return n;
+}
+
+/* RFC 3986 remove_dot_segments, in place on a NUL-terminated path */
+static void remove_dot_segments(char *path) {
+    char *in = path, *out = path;
+
+    while (*in) {
+        if (!strncmp(in, "../", 3)) {
+            in += 3;
+        } else if (!strncmp(in, "./", 2) || !strncmp(in, "/./", 3)) {
+            in += 2;
+        } else if (!strcmp(in, "/.")) {
+            in[1] = '\0';              /* "/." -> "/" */
+        } else if (!strncmp(in, "/../", 4) || !strcmp(in, "/..")) {
+            if (in[3] == '/') {
+                in += 3;                /* "/../" -> "/" */
+            } else {
+                in += 2;                /* "/.." -> "/" */
+                *in = '/';
+            }
+            while (out > path && *--out != '/')
+                ;                       /* Drop the last output segment */
+        } else if (!strcmp(in, ".") || !strcmp(in, "..")) {
+            break;
+        } else {
+            do {
+                *out++ = *in++;
+            } while (*in && *in != '/');
+        }
+    }
+    *out = '\0';
+}
+
+static int param_cmp(const void *a, const void *b) {
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+int canon_key(char *key, size_t size, const char *hostname, int port, const char *path) {
+    char host[256], portstr[16] = "", *buf, *query = NULL;
+    char *params[MAX_QUERY_PARAMS], *save;
+    int nparams = 0, rc = -1;
+    size_t len, n;
+
+    for (n = 0; hostname[n] && n < sizeof(host) - 1; n++)
+        host[n] = tolower((unsigned char)hostname[n]);
+    host[n] = '\0';
+    if (port != 80)
+        sprintf(portstr, ":%d", port);
+
+    len = strcspn(path, "#");
+    buf = malloc(len + 2);
+    n = normalize_pct(buf, path, len);
+    buf[n] = '\0';
+
+    if ((query = strchr(buf, '?')) != NULL)
+        *query++ = '\0';
+    remove_dot_segments(buf);
+
+    if (query) {
+        for (char *p = strtok_r(query, "&", &save); p; p = strtok_r(NULL, "&", &save)) {
+            if (param_ignored(host, p, strlen(p)))
+                continue;
+            if (nparams == MAX_QUERY_PARAMS)
+                goto out;
+            params[nparams++] = p;
+        }
+        if (query_sorted(host))
+            qsort(params, nparams, sizeof(char *), param_cmp);
+    }
+
+    n = snprintf(key, size, "http://%s%s%s%s", host, portstr, buf[0] == '/' ? "" : "/", buf);
+    for (int i = 0; i < nparams && n < size; i++)
+        n += snprintf(key + n, size - n, "%c%s", i ? '&' : '?', params[i]);
+    if (n < size)
+        rc = n;
+out:
+    free(buf);
+    return rc;
+}
@@ -0,0 +1,18 @@
+/*
+ * canon.h - canonical cache keys built from parse_uri output
+ */
+#ifndef __CANON_H__
+#define __CANON_H__
+
+#include <stddef.h>
+
+/* Loads per-origin query rules; returns the rule count or -1 on error */
+int canon_load_rules(const char *filename);
+
+/*
+ * Writes the canonical key for hostname:port/path into key. Returns the
+ * key length, or -1 if it does not fit in size bytes.
+ */
+int canon_key(char *key, size_t size, const char *hostname, int port, const char *path);
+
+#endif /* __CANON_H__ */
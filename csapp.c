@@ -792,20 +792,43 @@ ssize_t rio_writen(int fd, void *usrbuf, size_t n)
 }
 /* $end rio_writen */
 
-
-/* 
- * rio_read - This is a wrapper for the Unix read() function that
- *    transfers min(n, rio_cnt) bytes from an internal buffer to a user
- *    buffer, where n is the number of bytes requested by the user and
- *    rio_cnt is the number of unread bytes in the internal buffer. On
- *    entry, rio_read() refills the internal buffer via a call to
- *    read() if the internal buffer is empty.
+/*
+ * rio_writev - Robustly write every byte of iov[0..iovcnt-1] (unbuffered)
+ *     in as few system calls as the kernel allows; iov is advanced past
+ *     what was written
  */
-/* $begin rio_read */
-static ssize_t rio_read(rio_t *rp, char *usrbuf, size_t n)
+ssize_t rio_writev(int fd, struct iovec *iov, int iovcnt)
 {
-    int cnt;
+    ssize_t total = 0, nwritten;
+
+    while (iovcnt > 0) {
+	if ((nwritten = writev(fd, iov, iovcnt)) < 0) {
+	    if (errno == EINTR)  /* Interrupted by sig handler return */
+		nwritten = 0;    /* and call writev() again */
+	    else
+		return -1;       /* errno set by writev() */
+	}
+	total += nwritten;
+	while (iovcnt > 0 && (size_t)nwritten >= iov->iov_len) {
+	    nwritten -= iov->iov_len;
+	    iov++;
+	    iovcnt--;
+	}
+	if (iovcnt > 0) {
+	    iov->iov_base = (char *)iov->iov_base + nwritten;
+	    iov->iov_len -= nwritten;
+	}
+    }
+    return total;
+}
 
+
+/*
+ * rio_fill - Refill the internal buffer if it is empty. Returns the
+ *    number of unread bytes, 0 on EOF or -1 on error.
+ */
+static ssize_t rio_fill(rio_t *rp)
+{
     while (rp->rio_cnt <= 0) {  /* Refill if buf is empty */
 	rp->rio_cnt = read(rp->rio_fd, rp->rio_buf, 
 			   sizeof(rp->rio_buf));
@@ -818,6 +841,25 @@ static ssize_t rio_read(rio_t *rp, char *usrbuf, size_t n)
 	else 
 	    rp->rio_bufptr = rp->rio_buf; /* Reset buffer ptr */
     }
+    return rp->rio_cnt;
+}
+
+/* 
+ * rio_read - This is a wrapper for the Unix read() function that
+ *    transfers min(n, rio_cnt) bytes from an internal buffer to a user
+ *    buffer, where n is the number of bytes requested by the user and
+ *    rio_cnt is the number of unread bytes in the internal buffer. On
+ *    entry, rio_read() refills the internal buffer via a call to
+ *    read() if the internal buffer is empty.
+ */
+/* $begin rio_read */
+static ssize_t rio_read(rio_t *rp, char *usrbuf, size_t n)
+{
+    int cnt;
+    ssize_t rc;
+
+    if ((rc = rio_fill(rp)) <= 0)
+	return rc;
 
     /* Copy min(n, rp->rio_cnt) bytes from internal buf to user buf */
     cnt = n;          
@@ -864,35 +906,81 @@ ssize_t rio_readnb(rio_t *rp, void *usrbuf, size_t n)
 }
 /* $end rio_readnb */
 
+/*
+ * rio_readsomeb - Read whatever is available, up to n bytes (buffered):
+ *     at most one read() when the internal buffer is empty
+ */
+ssize_t rio_readsomeb(rio_t *rp, void *usrbuf, size_t n)
+{
+    return rio_read(rp, usrbuf, n);
+}
+
 /* 
  * rio_readlineb - Robustly read a text line (buffered)
  */
 /* $begin rio_readlineb */
 ssize_t rio_readlineb(rio_t *rp, void *usrbuf, size_t maxlen) 
 {
-    int n, rc;
-    char c, *bufp = usrbuf;
-
-    for (n = 1; n < maxlen; n++) { 
-        if ((rc = rio_read(rp, &c, 1)) == 1) {
-	    *bufp++ = c;
-	    if (c == '\n') {
-                n++;
-     		break;
-            }
-	} else if (rc == 0) {
-	    if (n == 1)
+    size_t n = 0, cnt;
+    ssize_t rc;
+    char *bufp = usrbuf, *nl;
+
+    /* Copy whole runs of the internal buf, up to and including a newline */
+    while (n + 1 < maxlen) {
+	if ((rc = rio_fill(rp)) < 0)
+	    return -1;	  /* Error */
+	else if (rc == 0) {
+	    if (n == 0)
 		return 0; /* EOF, no data read */
 	    else
 		break;    /* EOF, some data was read */
-	} else
-	    return -1;	  /* Error */
+	}
+	cnt = maxlen - 1 - n;
+	if (rp->rio_cnt < cnt)
+	    cnt = rp->rio_cnt;
+	if ((nl = memchr(rp->rio_bufptr, '\n', cnt)) != NULL)
+	    cnt = nl - rp->rio_bufptr + 1;
+	memcpy(bufp, rp->rio_bufptr, cnt);
+	rp->rio_bufptr += cnt;
+	rp->rio_cnt -= cnt;
+	bufp += cnt;
+	n += cnt;
+	if (nl != NULL)
+	    break;
     }
     *bufp = 0;
-    return n-1;
+    return n;
 }
 /* $end rio_readlineb */
 
+/*
+ * rio_peekb - Point *bufp at the unread bytes of the internal buffer,
+ *    refilling it first if it is empty, without copying or consuming
+ *    them. Returns their count, 0 on EOF or -1 on error. They stay
+ *    valid until the next read from rp.
+ */
+ssize_t rio_peekb(rio_t *rp, char **bufp)
+{
+    ssize_t rc;
+
+    if ((rc = rio_fill(rp)) > 0)
+	*bufp = rp->rio_bufptr;
+    return rc;
+}
+
+/*
+ * rio_consumeb - Mark the first n peeked bytes as read
+ */
+void rio_consumeb(rio_t *rp, size_t n)
+{
+    if (rp->rio_cnt <= 0)
+	return;
+    if (n > (size_t)rp->rio_cnt)
+	n = rp->rio_cnt;
+    rp->rio_bufptr += n;
+    rp->rio_cnt -= n;
+}
+
 /**********************************
  * Wrappers for robust I/O routines
  **********************************/
@@ -0,0 +1,269 @@
+/*
+ * digest.c - Bloom-filter digests of cache keys exchanged with siblings
+ *
+ * A proxy summarizes the keys it caches in a Bloom filter, rebuilt each
+ * time it is served at DIGEST_PATH, and every DIGEST_INTERVAL seconds
+ * pulls the same from each of its siblings. On a local miss the siblings' filters are probed before
+ * the origin is tried; a filter never misses a key that was cached when
+ * it was built, and says yes to an absent key with about the configured
+ * false-hit rate. Staleness adds to that, which is what the observed
+ * false hits in the report measure. Under -P the digest covers the tier
+ * shared between worker processes as well as this process's own.
+ *
+ * The filter has m bits and k probes per key, derived by double hashing
+ * from the FNV hash used everywhere else in the cache.
+ */
+#include <math.h>
+#include "csapp.h"
+#include "cache.h"
+#include "digest.h"
+#include "fastconn.h"
+
+#define DIGEST_PEERS 16
+#define DIGEST_INTERVAL 10   /* Seconds between rebuilds and pulls */
+#define DIGEST_MAX_BITS (8 * 1024 * 1024)  /* Largest sibling filter taken, 1 MB */
+
+typedef struct {
+    char host[MAXLINE];
+    char port[16];
+    unsigned char *bits;     /* NULL until fetched */
+    size_t m;
+    int k;
+    int keys;
+    time_t fetched;
+    long lookups, hits, falseHits, fetchFailed;
+} digest_peer;
+
+static struct {
+    size_t m;                /* Bits in our filter */
+    int k;
+    double rate;             /* Configured false-hit rate */
+    int connectMs;           /* Limits on connecting to a sibling */
+    int readMs;              /* and on each read from it */
+    unsigned char *bits;     /* Our current digest */
+    int keys;
+    digest_peer peers[DIGEST_PEERS];
+    int npeers;
+    pthread_mutex_t lock;    /* Protects all of the above */
+} dg;
+
+static unsigned long probe_step(unsigned long h) {
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdUL;
+    h ^= h >> 33;
+    return h | 1;
+}
+
+static void bloom_add(unsigned char *bits, size_t m, int k, const char *key) {
+    unsigned long h = cache_hash(key, strlen(key)), step = probe_step(h);
+
+    for (int i = 0; i < k; i++, h += step)
+        bits[(h % m) / 8] |= 1 << (h % m % 8);
+}
+
+static int bloom_has(const unsigned char *bits, size_t m, int k, const char *key) {
+    unsigned long h = cache_hash(key, strlen(key)), step = probe_step(h);
+
+    for (int i = 0; i < k; i++, h += step) {
+        if (!(bits[(h % m) / 8] & (1 << (h % m % 8))))
+            return 0;
+    }
+    return 1;
+}
+
+/* Expected false-hit rate of a filter of m bits and k probes holding n keys */
+static double bloom_rate(size_t m, int k, int n) {
+    return pow(1 - exp(-(double)k * n / m), k);
+}
+
+static void add_key(const char *key, void *arg) {
+    bloom_add(arg, dg.m, dg.k, key);
+    dg.keys++;
+}
+
+static void digest_rebuild() {
+    unsigned char *bits = Calloc(dg.m / 8, 1);
+
+    pthread_mutex_lock(&dg.lock);
+    dg.keys = 0;
+    cache_for_each_key(add_key, bits);
+    Free(dg.bits);
+    dg.bits = bits;
+    pthread_mutex_unlock(&dg.lock);
+}
+
+/*
+ * Pulls a sibling's digest; returns 0 or -1. A sibling that stops sending
+ * fails it after readMs, and one claiming a filter over DIGEST_MAX_BITS
+ * is refused.
+ */
+static int digest_fetch(digest_peer *p) {
+    char buf[MAXLINE];
+    size_t m = 0, len = 0;
+    int k = 0, keys = 0, status = 0, fd;
+    struct timeval tv = { dg.readMs / 1000, dg.readMs % 1000 * 1000 };
+    unsigned char *bits;
+    rio_t rio;
+
+    if ((fd = fc_connect(p->host, p->port, dg.connectMs)) < 0)
+        return -1;
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));  // All zero: no limit
+    sprintf(buf, "GET %s HTTP/1.0\r\n\r\n", DIGEST_PATH);
+    rio_readinitb(&rio, fd);
+    if (rio_writen(fd, buf, strlen(buf)) < 0 || rio_readlineb(&rio, buf, MAXLINE) <= 0 ||
+        sscanf(buf, "HTTP/%*d.%*d %d", &status) != 1 || status != 200) {
+        Close(fd);
+        return -1;
+    }
+    while (rio_readlineb(&rio, buf, MAXLINE) > 0 && strcmp(buf, "\r\n")) {
+        sscanf(buf, "X-Digest-Bits: %zu", &m);
+        sscanf(buf, "X-Digest-Hashes: %d", &k);
+        sscanf(buf, "X-Digest-Keys: %d", &keys);
+    }
+    len = m / 8;
+    if (m == 0 || m % 8 || m > DIGEST_MAX_BITS || k < 1 || k > 32 || (bits = malloc(len)) == NULL) {
+        Close(fd);
+        return -1;
+    }
+    if (rio_readnb(&rio, bits, len) != (ssize_t)len) {
+        free(bits);
+        Close(fd);
+        return -1;
+    }
+    Close(fd);
+
+    pthread_mutex_lock(&dg.lock);
+    free(p->bits);
+    p->bits = bits;
+    p->m = m;
+    p->k = k;
+    p->keys = keys;
+    p->fetched = time(NULL);
+    pthread_mutex_unlock(&dg.lock);
+    return 0;
+}
+
+static void *digest_thread(void *vargp) {
+    Pthread_detach(pthread_self());
+    while (1) {
+        digest_rebuild();
+        for (int i = 0; i < dg.npeers; i++) {
+            if (digest_fetch(&dg.peers[i]) < 0)
+                __sync_fetch_and_add(&dg.peers[i].fetchFailed, 1);
+        }
+        sleep(DIGEST_INTERVAL);
+    }
+    return NULL;
+}
+
+int digest_init(const char *filename, double falseHitRate, int connectMs, int readMs) {
+    char line[MAXLINE];
+    pthread_t tid;
+    FILE *fp;
+
+    if (falseHitRate <= 0 || falseHitRate >= 1 || (fp = fopen(filename, "r")) == NULL)
+        return -1;
+    while (fgets(line, sizeof(line), fp) != NULL && dg.npeers < DIGEST_PEERS) {
+        digest_peer *p = &dg.peers[dg.npeers];
+        line[strcspn(line, "#")] = '\0';
+        if (sscanf(line, " %[^: \t\n]:%15s", p->host, p->port) == 2)
+            dg.npeers++;
+    }
+    fclose(fp);
+
+    /* Optimal size and probe count for a full cache */
+    double n = CACHE_OBJS_COUNT;
+    dg.rate = falseHitRate;
+    dg.connectMs = connectMs;
+    dg.readMs = readMs;
+    dg.m = (size_t)ceil(-n * log(falseHitRate) / (M_LN2 * M_LN2));
+    dg.m = (dg.m + 63) / 64 * 64;
+    dg.k = (int)round(dg.m / n * M_LN2);
+    dg.k = dg.k < 1 ? 1 : dg.k > 32 ? 32 : dg.k;
+    dg.bits = Calloc(dg.m / 8, 1);
+    pthread_mutex_init(&dg.lock, NULL);
+    Pthread_create(&tid, NULL, digest_thread, NULL);
+    return dg.npeers;
+}
+
+int digest_enabled() {
+    return dg.m > 0;
+}
+
+int digest_lookup(const char *key, char *host, char *port) {
+    int found = 0;
+
+    if (!digest_enabled())
+        return 0;
+    pthread_mutex_lock(&dg.lock);
+    for (int i = 0; i < dg.npeers && !found; i++) {
+        digest_peer *p = &dg.peers[i];
+        if (p->bits && bloom_has(p->bits, p->m, p->k, key)) {
+            strcpy(host, p->host);
+            strcpy(port, p->port);
+            p->lookups++;
+            found = 1;
+        }
+    }
+    pthread_mutex_unlock(&dg.lock);
+    return found;
+}
+
+void digest_result(const char *host, const char *port, int hit) {
+    pthread_mutex_lock(&dg.lock);
+    for (int i = 0; i < dg.npeers; i++) {
+        digest_peer *p = &dg.peers[i];
+        if (!strcmp(p->host, host) && !strcmp(p->port, port)) {
+            if (hit)
+                p->hits++;
+            else
+                p->falseHits++;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&dg.lock);
+}
+
+void digest_serve(int connfd) {
+    char hdr[MAXLINE];
+    unsigned char *bits;
+    size_t len = dg.m / 8;
+
+    if (!digest_enabled()) {
+        sprintf(hdr, "HTTP/1.0 404 Not Found\r\nContent-Length: 0\r\n\r\n");
+        rio_writen(connfd, hdr, strlen(hdr));  // Lowercase: a vanished client must not exit the proxy
+        return;
+    }
+    digest_rebuild();  /* Cheap next to the exchange, and never stale */
+    bits = Malloc(len);
+    pthread_mutex_lock(&dg.lock);
+    memcpy(bits, dg.bits, len);
+    sprintf(hdr, "HTTP/1.0 200 OK\r\nContent-Type: application/octet-stream\r\n"
+            "X-Digest-Bits: %zu\r\nX-Digest-Hashes: %d\r\nX-Digest-Keys: %d\r\nContent-Length: %zu\r\n\r\n",
+            dg.m, dg.k, dg.keys, len);
+    pthread_mutex_unlock(&dg.lock);
+    if (rio_writen(connfd, hdr, strlen(hdr)) == (ssize_t)strlen(hdr))
+        rio_writen(connfd, bits, len);
+    Free(bits);
+}
+
+void digest_report(FILE *fp) {
+    time_t now = time(NULL);
+
+    if (!digest_enabled())
+        return;
+    pthread_mutex_lock(&dg.lock);
+    fprintf(fp, "digest.bits %zu\n", dg.m);
+    fprintf(fp, "digest.hashes %d\n", dg.k);
+    fprintf(fp, "digest.keys %d\n", dg.keys);
+    fprintf(fp, "digest.false_hit_target %.4f\n", dg.rate);
+    fprintf(fp, "digest.false_hit_expected %.4f\n", bloom_rate(dg.m, dg.k, dg.keys));
+    for (int i = 0; i < dg.npeers; i++) {
+        digest_peer *p = &dg.peers[i];
+        fprintf(fp, "digest.peer %s:%s age=%lds keys=%d lookups=%ld hits=%ld false_hits=%ld "
+                "false_hit_ratio=%.3f fetch_failed=%ld\n",
+                p->host, p->port, p->bits ? (long)(now - p->fetched) : -1L, p->keys, p->lookups, p->hits,
+                p->falseHits, p->lookups ? (double)p->falseHits / p->lookups : 0.0, p->fetchFailed);
+    }
+    pthread_mutex_unlock(&dg.lock);
+}
@@ -0,0 +1,37 @@
+/*
+ * digest.h - Bloom-filter digests of cache keys exchanged with siblings
+ */
+#ifndef __DIGEST_H__
+#define __DIGEST_H__
+
+#include <stdio.h>
+
+/* Origin-form path under which a proxy serves its own digest */
+#define DIGEST_PATH "/proxy-digest"
+
+/*
+ * Reads sibling proxies (host:port per line) from filename and starts a
+ * thread that rebuilds our digest and fetches theirs periodically. The
+ * filter is sized for CACHE_OBJS_COUNT keys at the given false-hit rate.
+ * Siblings are connected to within connectMs, and each read from them
+ * waits at most readMs (0 for no limit). Returns the number of siblings,
+ * or -1 on error.
+ */
+int digest_init(const char *filename, double falseHitRate, int connectMs, int readMs);
+int digest_enabled();
+
+/*
+ * If a sibling's digest probably holds key, copies its address into host
+ * and port and returns 1.
+ */
+int digest_lookup(const char *key, char *host, char *port);
+
+/* Records whether the sibling chosen by digest_lookup actually had it */
+void digest_result(const char *host, const char *port, int hit);
+
+/* Writes our digest as an HTTP response */
+void digest_serve(int connfd);
+
+void digest_report(FILE *fp);
+
+#endif /* __DIGEST_H__ */
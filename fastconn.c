@@ -0,0 +1,347 @@
+/*
+ * fastconn.c - origin connection establishment
+ *
+ * open_clientfd tries an origin's addresses one at a time with a blocking
+ * connect, so one unreachable address costs a whole SYN timeout before
+ * the next is even tried. Here, as in RFC 8305 (Happy Eyeballs v2), the
+ * addresses are ordered alternating between families, starting with the
+ * one that last worked; nonblocking attempts start 250 ms apart, or as
+ * soon as the previous one fails, and the first to complete wins. Each
+ * attempt also gives up after its share of the timeout, so a blackholed
+ * address holds a socket for only that long.
+ *
+ * Each origin connected to recently keeps its resolved addresses for a
+ * while, saving the lookup, and the address that last worked. A repeat
+ * connection to that address asks for TCP Fast Open: once the kernel has
+ * the origin's cookie, connect returns at once and the request goes out
+ * on the SYN. Connect times go into a log2 histogram per origin.
+ */
+#include <netinet/tcp.h>
+#include <poll.h>
+#include "csapp.h"
+#include "fastconn.h"
+
+#define FC_ORIGINS 64         // Origins remembered
+#define FC_ADDRS 8            // Addresses kept per origin
+#define FC_DNS_TTL 30         // Seconds resolved addresses are reused
+#define FC_ATTEMPT_DELAY 250  // Milliseconds between starting attempts
+#define FC_MIN_ATTEMPT 1000   // Shortest per-attempt deadline, milliseconds
+#define FC_BUCKETS 25         // Histogram bucket i counts [2^i, 2^(i+1)) microseconds
+
+typedef struct {
+    struct sockaddr_storage sa;
+    socklen_t len;
+} fc_addr;
+
+typedef struct {
+    char host[256], port[16];  // Empty host if the slot is free
+    fc_addr addrs[FC_ADDRS];
+    int naddrs;
+    time_t resolved;
+    fc_addr last;  // The address that last connected
+    int has_last;
+    time_t used;
+    long hist[FC_BUCKETS];
+    long connects, tfo, fallbacks, failed, timeouts;
+} fc_origin;
+
+static struct {
+    pthread_mutex_t lock;  // Protects everything here
+    fc_origin origins[FC_ORIGINS];
+    long attempts, attempt_timeouts;
+} fc = { PTHREAD_MUTEX_INITIALIZER };
+
+/* In flight */
+typedef struct {
+    int fd;
+    int idx;          // Into the ordered addresses
+    double deadline;  // Milliseconds, 0 for none
+} fc_attempt;
+
+static double now_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+static int addr_eq(const fc_addr *a, const fc_addr *b) {
+    return a->len == b->len && !memcmp(&a->sa, &b->sa, a->len);
+}
+
+/* The record for host:port, or with create a fresh one in the least recently used slot; caller holds the lock */
+static fc_origin *origin_find(const char *host, const char *port, int create) {
+    fc_origin *victim = &fc.origins[0];
+
+    for (int i = 0; i < FC_ORIGINS; i++) {
+        fc_origin *o = &fc.origins[i];
+        if (o->host[0] && !strcmp(o->host, host) && !strcmp(o->port, port))
+            return o;
+        if (o->used < victim->used)
+            victim = o;
+    }
+    if (!create)
+        return NULL;
+    memset(victim, 0, sizeof(*victim));
+    snprintf(victim->host, sizeof(victim->host), "%s", host);
+    snprintf(victim->port, sizeof(victim->port), "%s", port);
+    return victim;
+}
+
+static int resolve(const char *host, const char *port, fc_addr *addrs) {
+    struct addrinfo hints, *list, *p;
+    int n = 0;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_NUMERICSERV | AI_ADDRCONFIG;
+    if (getaddrinfo(host, port, &hints, &list) != 0)
+        return 0;
+    for (p = list; p && n < FC_ADDRS; p = p->ai_next) {
+        memcpy(&addrs[n].sa, p->ai_addr, p->ai_addrlen);
+        addrs[n++].len = p->ai_addrlen;
+    }
+    freeaddrinfo(list);
+    return n;
+}
+
+/*
+ * Orders addrs for the race: the last good address first, then
+ * alternating between its family and the other, each in resolver order.
+ */
+static void order(fc_addr *addrs, int n, const fc_addr *last) {
+    fc_addr first[FC_ADDRS], other[FC_ADDRS];
+    int nf = 0, no = 0, lead = 0;
+
+    for (int i = 0; last && i < n; i++)
+        if (addr_eq(&addrs[i], last))
+            lead = i;
+    for (int i = 0; i < n; i++) {
+        int k = (i + lead) % n;  // Rotated so the lead comes first
+        if (addrs[k].sa.ss_family == addrs[lead].sa.ss_family)
+            first[nf++] = addrs[k];
+        else
+            other[no++] = addrs[k];
+    }
+    for (int i = 0, f = 0, o = 0; i < n; i++)
+        addrs[i] = (o >= no || (f < nf && i % 2 == 0)) ? first[f++] : other[o++];
+}
+
+/*
+ * Starts a nonblocking connect to a. Returns the socket, with *done set
+ * if it connected (or, with Fast Open, deferred the handshake to the
+ * first write) at once, or -1.
+ */
+static int attempt_start(const fc_addr *a, int tfo, int *done) {
+    int fd, one = 1;
+
+    *done = 0;
+    if ((fd = socket(a->sa.ss_family, SOCK_STREAM | SOCK_NONBLOCK, 0)) < 0)
+        return -1;
+    if (tfo)
+        setsockopt(fd, IPPROTO_TCP, TCP_FASTOPEN_CONNECT, &one, sizeof(one));  // Ignored where unsupported
+    if (connect(fd, (struct sockaddr *)&a->sa, a->len) == 0) {
+        *done = 1;
+    } else if (errno != EINPROGRESS) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/*
+ * Races connects to addrs[0..n) as described above, until end (0 for no
+ * limit). Returns the winning socket with *won its index, or -1.
+ */
+static int race(const fc_addr *addrs, int n, double end, int tfo_first, int *won, int *tfo) {
+    fc_attempt live[FC_ADDRS];
+    struct pollfd pfds[FC_ADDRS];
+    int nlive = 0, next = 0, fd = -1, err = ECONNREFUSED, done;
+    double share = end ? (end - now_ms()) / n : 0, next_start = 0, t, wait;
+
+    if (share && share < FC_MIN_ATTEMPT)
+        share = FC_MIN_ATTEMPT;
+    while (fd < 0) {
+        t = now_ms();
+        if (end && t >= end) {
+            err = ETIMEDOUT;
+            break;
+        }
+        if (next < n && (nlive == 0 || t >= next_start)) {
+            int s = attempt_start(&addrs[next], tfo_first && next == 0, &done);
+            __sync_fetch_and_add(&fc.attempts, 1);
+            if (s >= 0 && done) {
+                fd = s;
+                *won = next;
+                *tfo = tfo_first && next == 0;
+            } else if (s >= 0) {
+                live[nlive].fd = s;
+                live[nlive].idx = next;
+                live[nlive++].deadline = share ? t + share : 0;
+            } else {
+                err = errno;
+            }
+            next++;
+            next_start = t + FC_ATTEMPT_DELAY;
+            continue;
+        }
+        if (nlive == 0)
+            break;
+
+        /* Sleep until an attempt completes or the next deadline of any kind */
+        wait = next < n ? next_start - t : -1;
+        if (end && (wait < 0 || end - t < wait))
+            wait = end - t;
+        for (int i = 0; i < nlive; i++) {
+            pfds[i].fd = live[i].fd;
+            pfds[i].events = POLLOUT;
+            if (live[i].deadline && (wait < 0 || live[i].deadline - t < wait))
+                wait = live[i].deadline - t;
+        }
+        if (poll(pfds, nlive, wait < 0 ? -1 : (int)wait + 1) < 0 && errno != EINTR)
+            break;
+
+        t = now_ms();
+        for (int i = 0; i < nlive; i++) {
+            int soerr = 0, expired = live[i].deadline && t >= live[i].deadline;
+            socklen_t len = sizeof(soerr);
+
+            if (fd < 0 && (pfds[i].revents & (POLLOUT | POLLERR | POLLHUP))) {
+                getsockopt(live[i].fd, SOL_SOCKET, SO_ERROR, &soerr, &len);
+                if (soerr == 0) {
+                    fd = live[i].fd;
+                    *won = live[i].idx;
+                    *tfo = 0;
+                    continue;
+                }
+                err = soerr;
+                next_start = t;  // A failure starts the next attempt at once
+            } else if (fd < 0 && expired) {
+                __sync_fetch_and_add(&fc.attempt_timeouts, 1);
+                err = ETIMEDOUT;
+                next_start = t;
+            } else if (fd < 0) {
+                continue;
+            }
+            close(live[i].fd);
+            live[i].fd = -1;
+        }
+        int kept = 0;
+        for (int i = 0; i < nlive; i++)  // Drop the closed ones
+            if (live[i].fd >= 0)
+                live[kept++] = live[i];
+        nlive = kept;
+    }
+    for (int i = 0; i < nlive; i++)
+        if (live[i].fd != fd)
+            close(live[i].fd);
+    if (fd < 0)
+        errno = err;
+    return fd;
+}
+
+int fc_connect(const char *host, const char *port, int timeout_ms) {
+    fc_addr addrs[FC_ADDRS], last;
+    double start = now_ms(), end = timeout_ms > 0 ? start + timeout_ms : 0;
+    int n = 0, has_last = 0, won = 0, tfo = 0, fd, flags, saved;
+    fc_origin *o;
+
+    pthread_mutex_lock(&fc.lock);
+    if ((o = origin_find(host, port, 0)) != NULL && time(NULL) - o->resolved < FC_DNS_TTL) {
+        n = o->naddrs;
+        memcpy(addrs, o->addrs, n * sizeof(fc_addr));
+    }
+    if (o && (has_last = o->has_last))
+        last = o->last;
+    pthread_mutex_unlock(&fc.lock);
+
+    if (n == 0 && (n = resolve(host, port, addrs)) == 0) {
+        errno = EHOSTUNREACH;
+        return -1;
+    }
+    order(addrs, n, has_last ? &last : NULL);
+    /* Fast Open only to the address that worked last, where the kernel may hold a cookie */
+    fd = race(addrs, n, end, has_last && addr_eq(&addrs[0], &last), &won, &tfo);
+    saved = errno;
+
+    pthread_mutex_lock(&fc.lock);
+    o = origin_find(host, port, 1);
+    o->used = time(NULL);
+    if (o->resolved == 0 || o->used - o->resolved >= FC_DNS_TTL) {
+        o->naddrs = n;
+        memcpy(o->addrs, addrs, n * sizeof(fc_addr));
+        o->resolved = o->used;
+    }
+    if (fd >= 0) {
+        long us = (long)((now_ms() - start) * 1000);
+        int b = 0;
+
+        while (b < FC_BUCKETS - 1 && us >= 2L << b)
+            b++;
+        o->connects++;
+        if (tfo)
+            o->tfo++;  // Handshake deferred: nothing to time
+        else
+            o->hist[b]++;
+        if (won > 0)
+            o->fallbacks++;
+        o->last = addrs[won];
+        o->has_last = 1;
+    } else {
+        o->failed++;
+        if (saved == ETIMEDOUT)
+            o->timeouts++;
+    }
+    pthread_mutex_unlock(&fc.lock);
+
+    if (fd >= 0 && (flags = fcntl(fd, F_GETFL)) >= 0)
+        fcntl(fd, F_SETFL, flags & ~O_NONBLOCK);  // The proxy reads and writes blocking
+    errno = saved;
+    return fd;
+}
+
+/* Forgets the addresses and the working one, so the next connect starts over */
+void fc_failed(const char *host, const char *port) {
+    fc_origin *o;
+
+    pthread_mutex_lock(&fc.lock);
+    if ((o = origin_find(host, port, 0)) != NULL) {
+        o->has_last = 0;
+        o->resolved = 0;
+        o->failed++;
+    }
+    pthread_mutex_unlock(&fc.lock);
+}
+
+/* Upper bound in microseconds of the bucket holding quantile q */
+static long quantile(const long *hist, long count, double q) {
+    long seen = 0;
+
+    for (int b = 0; b < FC_BUCKETS; b++)
+        if ((seen += hist[b]) >= q * count)
+            return 2L << b;
+    return 2L << (FC_BUCKETS - 1);
+}
+
+void fc_report(FILE *fp) {
+    pthread_mutex_lock(&fc.lock);
+    fprintf(fp, "fastconn.attempts %ld\n", fc.attempts);
+    fprintf(fp, "fastconn.attempt_timeouts %ld\n", fc.attempt_timeouts);
+    for (int i = 0; i < FC_ORIGINS; i++) {
+        fc_origin *o = &fc.origins[i];
+        long timed = o->connects - o->tfo;
+
+        if (!o->host[0])
+            continue;
+        fprintf(fp, "fastconn.origin %s:%s connects=%ld tfo=%ld fallbacks=%ld failed=%ld timeouts=%ld", o->host,
+                o->port, o->connects, o->tfo, o->fallbacks, o->failed, o->timeouts);
+        if (timed > 0) {
+            fprintf(fp, " p50_us=%ld p90_us=%ld p99_us=%ld hist_us=", quantile(o->hist, timed, 0.5),
+                    quantile(o->hist, timed, 0.9), quantile(o->hist, timed, 0.99));
+            for (int b = 0, sep = 0; b < FC_BUCKETS; b++)
+                if (o->hist[b])
+                    fprintf(fp, "%s%ld:%ld", sep++ ? "," : "", 1L << b, o->hist[b]);
+        }
+        fputc('\n', fp);
+    }
+    pthread_mutex_unlock(&fc.lock);
+}
@@ -0,0 +1,21 @@
+/*
+ * fastconn.h - origin connection establishment
+ */
+#ifndef __FASTCONN_H__
+#define __FASTCONN_H__
+
+#include <stdio.h>
+
+/*
+ * Connects to host:port within timeout_ms (0 for no limit), racing its
+ * addresses. Returns a blocking socket, or -1 with errno set (ETIMEDOUT
+ * if the time ran out).
+ */
+int fc_connect(const char *host, const char *port, int timeout_ms);
+
+/* Notes that a connection fc_connect returned for host:port got no response */
+void fc_failed(const char *host, const char *port);
+
+void fc_report(FILE *fp);
+
+#endif /* __FASTCONN_H__ */
@@ -0,0 +1,105 @@
+#!/usr/bin/python3
+
+# gen_hdrhash.py - Generates hdrhash.c and hdrhash.h, a perfect hash of
+#                  the header names in hdrnames.txt.
+#
+# usage: gen_hdrhash.py hdrnames.txt <output prefix>
+#
+# The hash looks only at the length and three case-folded bytes of a
+# name (first, middle, last), mixed with multipliers this script searches
+# for until every listed name lands in its own slot. A lookup is then one
+# hash, one length check and one strncasecmp.
+
+import sys
+
+MASK32 = 0xffffffff
+
+
+def fold(c):
+    return ord(c) | 0x20
+
+
+def slot(name, k, bits):
+    n = len(name)
+    h = (n * k[0]) ^ (fold(name[0]) * k[1]) ^ (fold(name[n // 2]) * k[2]) ^ (fold(name[n - 1]) * k[3])
+    return ((h * k[4]) & MASK32) >> (32 - bits)
+
+
+def search(names):
+    state = 0x9e3779b9
+    for bits in range(6, 12):
+        for attempt in range(200000):
+            k = []
+            for i in range(5):
+                state = (state * 1103515245 + 12345) & MASK32
+                k.append(state | 1)
+            slots = set(slot(n, k, bits) for n in names)
+            if len(slots) == len(names):
+                return k, bits
+    sys.exit("gen_hdrhash.py: no perfect hash found")
+
+
+def ident(name):
+    return "HDR_" + name.upper().replace("-", "_")
+
+
+def main():
+    if len(sys.argv) != 3:
+        sys.exit("usage: gen_hdrhash.py hdrnames.txt <output prefix>")
+    entries = []
+    for line in open(sys.argv[1]):
+        fields = line.split("#")[0].split()
+        if fields:
+            entries.append((fields[0], "hop" in fields[1:]))
+    names = [e[0] for e in entries]
+    if len(set(n.lower() for n in names)) != len(names):
+        sys.exit("gen_hdrhash.py: duplicate header name")
+    k, bits = search(names)
+    prefix = sys.argv[2]
+
+    with open(prefix + ".h", "w") as h:
+        h.write("/*\n * hdrhash.h - perfect hash of well-known header names\n *\n"
+                " * Generated by gen_hdrhash.py from hdrnames.txt; do not edit.\n */\n")
+        h.write("#ifndef __HDRHASH_H__\n#define __HDRHASH_H__\n\n#include <stddef.h>\n\n")
+        h.write("enum hdr_id {\n    HDR_UNKNOWN,\n")
+        for n in names:
+            h.write("    %s,\n" % ident(n))
+        h.write("    HDR_COUNT\n};\n\n")
+        h.write("#define HDR_F_HOP 0x1  // Hop-by-hop: not forwarded\n\n")
+        h.write("enum hdr_id hdr_lookup(const char *name, size_t len);\n")
+        h.write("const char *hdr_name(enum hdr_id id);\n")
+        h.write("int hdr_flags(enum hdr_id id);\n\n")
+        h.write("#endif /* __HDRHASH_H__ */\n")
+
+    table = [0] * (1 << bits)
+    for i, n in enumerate(names):
+        table[slot(n, k, bits)] = i + 1
+    with open(prefix + ".c", "w") as c:
+        c.write("/*\n * hdrhash.c - perfect hash of well-known header names\n *\n"
+                " * Generated by gen_hdrhash.py from hdrnames.txt; do not edit.\n */\n")
+        c.write("#include <stdint.h>\n#include <strings.h>\n#include \"hdrhash.h\"\n\n")
+        c.write("static const struct {\n    const char *name;\n    unsigned char len;\n"
+                "    unsigned char flags;\n} names[HDR_COUNT] = {\n    { \"\", 0, 0 },\n")
+        for n, hop in entries:
+            c.write("    { \"%s\", %d, %s },\n" % (n, len(n), "HDR_F_HOP" if hop else "0"))
+        c.write("};\n\n")
+        c.write("/* Slot -> enum hdr_id; HDR_UNKNOWN for empty slots */\n")
+        c.write("static const unsigned char slots[%d] = {\n" % len(table))
+        for i in range(0, len(table), 16):
+            c.write("    " + ", ".join("%d" % v for v in table[i:i + 16]) + ",\n")
+        c.write("};\n\n")
+        c.write("/* Classifies a header name, ignoring case; HDR_UNKNOWN if it is not listed */\n")
+        c.write("enum hdr_id hdr_lookup(const char *name, size_t len) {\n")
+        c.write("    uint32_t h;\n    int id;\n\n")
+        c.write("    if (len == 0 || len > 255)\n        return HDR_UNKNOWN;\n")
+        c.write("    h = ((uint32_t)len * %#xu) ^ ((uint32_t)(name[0] | 0x20) * %#xu) ^\n"
+                "        ((uint32_t)(name[len / 2] | 0x20) * %#xu) ^ ((uint32_t)(name[len - 1] | 0x20) * %#xu);\n"
+                % tuple(k[:4]))
+        c.write("    id = slots[(h * %#xu) >> %d];\n" % (k[4], 32 - bits))
+        c.write("    if (id == HDR_UNKNOWN || names[id].len != len || strncasecmp(name, names[id].name, len))\n"
+                "        return HDR_UNKNOWN;\n    return id;\n}\n\n")
+        c.write("const char *hdr_name(enum hdr_id id) {\n    return names[id].name;\n}\n\n")
+        c.write("int hdr_flags(enum hdr_id id) {\n    return names[id].flags;\n}\n")
+
+
+main()
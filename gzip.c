@@ -0,0 +1,89 @@
+/*
+ * gzip.c - gzip encoding of cached bodies
+ *
+ * Bodies are compressed once, at the fastest zlib level, when they enter
+ * the cache. Clients that accept gzip are sent the stored bytes directly;
+ * for the rest the body is inflated a chunk at a time straight onto the
+ * socket, so no uncompressed copy is ever materialized.
+ */
+#include <stdint.h>
+#include <zlib.h>
+#include "csapp.h"
+#include "gzip.h"
+
+#define GZIP_WINDOW (15 + 16)  /* Max window, gzip wrapper */
+
+size_t gzip_deflate(const char *src, size_t size, char **dst) {
+    z_stream zs;
+    size_t bound, len = 0;
+
+    memset(&zs, 0, sizeof(zs));
+    if (deflateInit2(&zs, Z_BEST_SPEED, Z_DEFLATED, GZIP_WINDOW, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+        return 0;
+
+    bound = deflateBound(&zs, size);
+    *dst = Malloc(bound);
+    zs.next_in = (Bytef *)src;
+    zs.avail_in = size;
+    zs.next_out = (Bytef *)*dst;
+    zs.avail_out = bound;
+    if (deflate(&zs, Z_FINISH) == Z_STREAM_END && zs.total_out < size)
+        len = zs.total_out;
+    deflateEnd(&zs);
+
+    if (len == 0) {
+        Free(*dst);
+        *dst = NULL;
+    }
+    return len;
+}
+
+int gzip_inflate_to_fd(int fd, const char *src, size_t size) {
+    return gzip_inflate_range_to_fd(fd, src, size, 0, SIZE_MAX);
+}
+
+int gzip_inflate_range_to_fd(int fd, const char *src, size_t size, size_t first, size_t count) {
+    char out[MAXBUF];
+    z_stream zs;
+    size_t pos = 0, end = count > SIZE_MAX - first ? SIZE_MAX : first + count;
+    int rc;
+
+    memset(&zs, 0, sizeof(zs));
+    if (inflateInit2(&zs, GZIP_WINDOW) != Z_OK)
+        return -1;
+
+    zs.next_in = (Bytef *)src;
+    zs.avail_in = size;
+    do {
+        zs.next_out = (Bytef *)out;
+        zs.avail_out = sizeof(out);
+        rc = inflate(&zs, Z_NO_FLUSH);
+        if (rc != Z_OK && rc != Z_STREAM_END)
+            break;
+
+        /* Write the part of this chunk inside [first, end) */
+        size_t n = sizeof(out) - zs.avail_out;
+        size_t lo = pos < first ? first - pos : 0;
+        size_t hi = pos + n > end ? (end > pos ? end - pos : 0) : n;
+        pos += n;
+        if (hi > lo && rio_writen(fd, out + lo, hi - lo) < 0) {
+            rc = Z_ERRNO;
+            break;
+        }
+        if (pos >= end) {
+            rc = Z_STREAM_END;
+            break;
+        }
+    } while (rc != Z_STREAM_END);
+    inflateEnd(&zs);
+
+    return rc == Z_STREAM_END ? 0 : -1;
+}
+
+size_t gzip_inflated_size(const char *src, size_t size) {
+    const unsigned char *p = (const unsigned char *)src + size - 4;
+
+    if (size < 18)  /* Header plus trailer */
+        return 0;
+    return p[0] | p[1] << 8 | p[2] << 16 | (size_t)p[3] << 24;
+}
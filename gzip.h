@@ -0,0 +1,25 @@
+/*
+ * gzip.h - gzip encoding of cached bodies (zlib)
+ */
+#ifndef __GZIP_H__
+#define __GZIP_H__
+
+#include <stddef.h>
+
+/*
+ * Compresses size bytes of src into a Malloc'd gzip member stored in *dst.
+ * Returns the compressed length, or 0 if compression failed or would not
+ * make the data smaller.
+ */
+size_t gzip_deflate(const char *src, size_t size, char **dst);
+
+/* Decompresses a gzip member to fd as it goes; returns 0 or -1 on error */
+int gzip_inflate_to_fd(int fd, const char *src, size_t size);
+
+/* Like gzip_inflate_to_fd, but writes only count bytes from offset first */
+int gzip_inflate_range_to_fd(int fd, const char *src, size_t size, size_t first, size_t count);
+
+/* Uncompressed length of a gzip member, from its trailer */
+size_t gzip_inflated_size(const char *src, size_t size);
+
+#endif /* __GZIP_H__ */
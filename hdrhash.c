@@ -0,0 +1,106 @@
+/*
+ * hdrhash.c - perfect hash of well-known header names
+ *
+ * Generated by gen_hdrhash.py from hdrnames.txt; do not edit.
+ */
+#include <stdint.h>
+#include <strings.h>
+#include "hdrhash.h"
+
+static const struct {
+    const char *name;
+    unsigned char len;
+    unsigned char flags;
+} names[HDR_COUNT] = {
+    { "", 0, 0 },
+    { "Accept", 6, 0 },
+    { "Accept-Charset", 14, 0 },
+    { "Accept-Encoding", 15, 0 },
+    { "Accept-Language", 15, 0 },
+    { "Accept-Ranges", 13, 0 },
+    { "Age", 3, 0 },
+    { "Allow", 5, 0 },
+    { "Authorization", 13, 0 },
+    { "Cache-Control", 13, 0 },
+    { "Connection", 10, HDR_F_HOP },
+    { "Content-Disposition", 19, 0 },
+    { "Content-Encoding", 16, 0 },
+    { "Content-Language", 16, 0 },
+    { "Content-Length", 14, 0 },
+    { "Content-Location", 16, 0 },
+    { "Content-Range", 13, 0 },
+    { "Content-Type", 12, 0 },
+    { "Cookie", 6, 0 },
+    { "Date", 4, 0 },
+    { "ETag", 4, 0 },
+    { "Expect", 6, 0 },
+    { "Expires", 7, 0 },
+    { "Forwarded", 9, 0 },
+    { "From", 4, 0 },
+    { "Host", 4, 0 },
+    { "If-Match", 8, 0 },
+    { "If-Modified-Since", 17, 0 },
+    { "If-None-Match", 13, 0 },
+    { "If-Range", 8, 0 },
+    { "If-Unmodified-Since", 19, 0 },
+    { "Keep-Alive", 10, HDR_F_HOP },
+    { "Last-Modified", 13, 0 },
+    { "Location", 8, 0 },
+    { "Max-Forwards", 12, 0 },
+    { "Origin", 6, 0 },
+    { "Pragma", 6, 0 },
+    { "Proxy-Authenticate", 18, HDR_F_HOP },
+    { "Proxy-Authorization", 19, HDR_F_HOP },
+    { "Proxy-Connection", 16, HDR_F_HOP },
+    { "Range", 5, 0 },
+    { "Referer", 7, 0 },
+    { "Retry-After", 11, 0 },
+    { "Server", 6, 0 },
+    { "Set-Cookie", 10, 0 },
+    { "TE", 2, HDR_F_HOP },
+    { "Trailer", 7, HDR_F_HOP },
+    { "Transfer-Encoding", 17, HDR_F_HOP },
+    { "Upgrade", 7, HDR_F_HOP },
+    { "User-Agent", 10, 0 },
+    { "Vary", 4, 0 },
+    { "Via", 3, 0 },
+    { "WWW-Authenticate", 16, 0 },
+    { "Warning", 7, 0 },
+    { "X-Forwarded-For", 15, 0 },
+    { "X-Proxy-Peer", 12, 0 },
+};
+
+/* Slot -> enum hdr_id; HDR_UNKNOWN for empty slots */
+static const unsigned char slots[128] = {
+    0, 9, 0, 0, 0, 42, 0, 46, 0, 0, 36, 0, 0, 0, 43, 55,
+    0, 41, 38, 0, 0, 0, 0, 0, 48, 39, 0, 18, 15, 0, 0, 0,
+    0, 6, 0, 0, 29, 0, 0, 3, 13, 11, 7, 0, 26, 35, 0, 53,
+    2, 45, 0, 0, 0, 1, 0, 50, 31, 21, 4, 33, 0, 24, 23, 0,
+    5, 14, 0, 19, 0, 28, 0, 37, 0, 0, 0, 0, 0, 54, 0, 16,
+    0, 0, 0, 44, 12, 52, 0, 49, 0, 8, 40, 0, 0, 27, 0, 47,
+    25, 51, 0, 17, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 20, 22, 0, 0, 10, 0, 0, 30, 0, 0, 0, 34, 0, 32, 0,
+};
+
+/* Classifies a header name, ignoring case; HDR_UNKNOWN if it is not listed */
+enum hdr_id hdr_lookup(const char *name, size_t len) {
+    uint32_t h;
+    int id;
+
+    if (len == 0 || len > 255)
+        return HDR_UNKNOWN;
+    h = ((uint32_t)len * 0x8f2ae53u) ^ ((uint32_t)(name[0] | 0x20) * 0x65dd6523u) ^
+        ((uint32_t)(name[len / 2] | 0x20) * 0xf026ea21u) ^ ((uint32_t)(name[len - 1] | 0x20) * 0x50a79fd9u);
+    id = slots[(h * 0x24e95d9fu) >> 25];
+    if (id == HDR_UNKNOWN || names[id].len != len || strncasecmp(name, names[id].name, len))
+        return HDR_UNKNOWN;
+    return id;
+}
+
+const char *hdr_name(enum hdr_id id) {
+    return names[id].name;
+}
+
+int hdr_flags(enum hdr_id id) {
+    return names[id].flags;
+}
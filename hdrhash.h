@@ -0,0 +1,77 @@
+/*
+ * hdrhash.h - perfect hash of well-known header names
+ *
+ * Generated by gen_hdrhash.py from hdrnames.txt; do not edit.
+ */
+#ifndef __HDRHASH_H__
+#define __HDRHASH_H__
+
+#include <stddef.h>
+
+enum hdr_id {
+    HDR_UNKNOWN,
+    HDR_ACCEPT,
+    HDR_ACCEPT_CHARSET,
+    HDR_ACCEPT_ENCODING,
+    HDR_ACCEPT_LANGUAGE,
+    HDR_ACCEPT_RANGES,
+    HDR_AGE,
+    HDR_ALLOW,
+    HDR_AUTHORIZATION,
+    HDR_CACHE_CONTROL,
+    HDR_CONNECTION,
+    HDR_CONTENT_DISPOSITION,
+    HDR_CONTENT_ENCODING,
+    HDR_CONTENT_LANGUAGE,
+    HDR_CONTENT_LENGTH,
+    HDR_CONTENT_LOCATION,
+    HDR_CONTENT_RANGE,
+    HDR_CONTENT_TYPE,
+    HDR_COOKIE,
+    HDR_DATE,
+    HDR_ETAG,
+    HDR_EXPECT,
+    HDR_EXPIRES,
+    HDR_FORWARDED,
+    HDR_FROM,
+    HDR_HOST,
+    HDR_IF_MATCH,
+    HDR_IF_MODIFIED_SINCE,
+    HDR_IF_NONE_MATCH,
+    HDR_IF_RANGE,
+    HDR_IF_UNMODIFIED_SINCE,
+    HDR_KEEP_ALIVE,
+    HDR_LAST_MODIFIED,
+    HDR_LOCATION,
+    HDR_MAX_FORWARDS,
+    HDR_ORIGIN,
+    HDR_PRAGMA,
+    HDR_PROXY_AUTHENTICATE,
+    HDR_PROXY_AUTHORIZATION,
+    HDR_PROXY_CONNECTION,
+    HDR_RANGE,
+    HDR_REFERER,
+    HDR_RETRY_AFTER,
+    HDR_SERVER,
+    HDR_SET_COOKIE,
+    HDR_TE,
+    HDR_TRAILER,
+    HDR_TRANSFER_ENCODING,
+    HDR_UPGRADE,
+    HDR_USER_AGENT,
+    HDR_VARY,
+    HDR_VIA,
+    HDR_WWW_AUTHENTICATE,
+    HDR_WARNING,
+    HDR_X_FORWARDED_FOR,
+    HDR_X_PROXY_PEER,
+    HDR_COUNT
+};
+
+#define HDR_F_HOP 0x1  // Hop-by-hop: not forwarded
+
+enum hdr_id hdr_lookup(const char *name, size_t len);
+const char *hdr_name(enum hdr_id id);
+int hdr_flags(enum hdr_id id);
+
+#endif /* __HDRHASH_H__ */
@@ -0,0 +1,246 @@
+/*
+ * hparse.c - vectorized parser for HTTP/1.x request heads
+ *
+ * Parsing runs in two passes. The first marks every LF and ':' of the
+ * block in one bit per byte, 64 bytes at a time, with AVX2 or SSE4.2 where
+ * the CPU has them and a plain loop otherwise. The second walks only the
+ * marked positions to find the line ends and header colons, and splits the
+ * request line at its spaces. The result is offsets into the caller's
+ * buffer; nothing is copied.
+ */
+#define _GNU_SOURCE  // memrchr
+#include <string.h>
+#include <strings.h>
+#include <pthread.h>
+#include "hparse.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HP_X86 1
+#endif
+
+#define BLOCK 64
+#define NBLOCKS (HP_MAX_HEAD / BLOCK)
+
+/* Sets marks[b] bit i for each LF or ':' at buf[b * 64 + i], i < len */
+typedef void (*mark_fn)(const char *buf, size_t len, uint64_t *marks);
+
+/*
+ * Runs block over every whole 64 bytes of buf, then over the tail copied
+ * into a zeroed block so it can be read in full.
+ */
+#define MARK_BLOCKS(buf, len, marks, block) do {            \
+        size_t full = (len) / BLOCK * BLOCK;                \
+        for (size_t b = 0; b < full; b += BLOCK)            \
+            (marks)[b / BLOCK] = block((buf) + b);          \
+        if (full < (len)) {                                 \
+            char tail[BLOCK] = {0};                         \
+            memcpy(tail, (buf) + full, (len) - full);       \
+            (marks)[full / BLOCK] = block(tail);            \
+        }                                                   \
+    } while (0)
+
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+/* High bit of each byte of w that is zero, exactly (no borrow between bytes) */
+static inline uint64_t zero_bytes(uint64_t w) {
+    const uint64_t low7 = 0x7f7f7f7f7f7f7f7fULL;
+    return ~(((w & low7) + low7) | w | low7);
+}
+
+/* Eight bytes at a time in ordinary registers */
+static inline uint64_t block_scalar(const char *p) {
+    uint64_t m = 0;
+    for (int i = 0; i < BLOCK; i += 8) {
+        uint64_t w, hit;
+        memcpy(&w, p + i, 8);
+        hit = zero_bytes(w ^ 0x0a0a0a0a0a0a0a0aULL) | zero_bytes(w ^ 0x3a3a3a3a3a3a3a3aULL);
+        m |= ((hit >> 7) * 0x0102040810204080ULL) >> 56 << i;  // Gather the high bits
+    }
+    return m;
+}
+#else
+static inline uint64_t block_scalar(const char *p) {
+    uint64_t m = 0;
+    for (int i = 0; i < BLOCK; i++)
+        m |= (uint64_t)(p[i] == '\n' || p[i] == ':') << i;
+    return m;
+}
+#endif
+
+static void mark_scalar(const char *buf, size_t len, uint64_t *marks) {
+    MARK_BLOCKS(buf, len, marks, block_scalar);
+}
+
+#ifdef HP_X86
+/* PCMPESTRM matches each byte against the whole set at once */
+__attribute__((target("sse4.2")))
+static inline uint64_t block_sse42(const char *p) {
+    const __m128i set = _mm_setr_epi8('\n', ':', 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0);
+    uint64_t m = 0;
+    for (int i = 0; i < BLOCK; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(p + i));
+        __m128i r = _mm_cmpestrm(set, 2, v, 16, _SIDD_UBYTE_OPS | _SIDD_CMP_EQUAL_ANY | _SIDD_BIT_MASK);
+        m |= (uint64_t)(uint16_t)_mm_cvtsi128_si32(r) << i;
+    }
+    return m;
+}
+
+__attribute__((target("sse4.2")))
+static void mark_sse42(const char *buf, size_t len, uint64_t *marks) {
+    MARK_BLOCKS(buf, len, marks, block_sse42);
+}
+
+__attribute__((target("avx2")))
+static inline uint64_t block_avx2(const char *p) {
+    const __m256i lf = _mm256_set1_epi8('\n'), colon = _mm256_set1_epi8(':');
+    __m256i lo = _mm256_loadu_si256((const __m256i *)p);
+    __m256i hi = _mm256_loadu_si256((const __m256i *)(p + 32));
+    uint32_t mlo = _mm256_movemask_epi8(_mm256_or_si256(_mm256_cmpeq_epi8(lo, lf), _mm256_cmpeq_epi8(lo, colon)));
+    uint32_t mhi = _mm256_movemask_epi8(_mm256_or_si256(_mm256_cmpeq_epi8(hi, lf), _mm256_cmpeq_epi8(hi, colon)));
+    return (uint64_t)mhi << 32 | mlo;
+}
+
+__attribute__((target("avx2")))
+static void mark_avx2(const char *buf, size_t len, uint64_t *marks) {
+    MARK_BLOCKS(buf, len, marks, block_avx2);
+}
+#endif
+
+static const struct {
+    const char *name;
+    mark_fn fn;
+} kernels[] = {
+#ifdef HP_X86
+    { "avx2", mark_avx2 },
+    { "sse4.2", mark_sse42 },
+#endif
+    { "scalar", mark_scalar },
+};
+#define NKERNELS ((int)(sizeof(kernels) / sizeof(kernels[0])))
+
+static int kernel = -1;  // Index into kernels
+static pthread_once_t kernel_once = PTHREAD_ONCE_INIT;
+
+static int supported(int k) {
+#ifdef HP_X86
+    if (kernels[k].fn == mark_avx2)
+        return __builtin_cpu_supports("avx2");
+    if (kernels[k].fn == mark_sse42)
+        return __builtin_cpu_supports("sse4.2");
+#endif
+    return 1;
+}
+
+/* Picks the widest kernel this CPU runs */
+static void kernel_select() {
+#ifdef HP_X86
+    __builtin_cpu_init();
+#endif
+    for (kernel = 0; !supported(kernel); kernel++)
+        ;
+}
+
+/* First structural byte at or after pos, or len if none */
+static size_t next_mark(const uint64_t *marks, size_t len, size_t pos) {
+    size_t b = pos / BLOCK;
+    uint64_t m;
+
+    if (pos >= len)
+        return len;
+    m = marks[b] & (~0ULL << (pos % BLOCK));
+    while (m == 0) {
+        if (++b * BLOCK >= len)
+            return len;
+        m = marks[b];
+    }
+    pos = b * BLOCK + __builtin_ctzll(m);
+    return pos < len ? pos : len;
+}
+
+static hp_span span(size_t start, size_t end) {
+    hp_span s = { start, end - start };
+    return s;
+}
+
+/*
+ * Parses the request head at the start of buf. Returns its length through
+ * the blank line, 0 if the head is not complete within len bytes, or -1 if
+ * it is malformed or longer than HP_MAX_HEAD.
+ */
+long hp_parse_request(const char *buf, size_t len, hp_request *req) {
+    uint64_t marks[NBLOCKS];
+    size_t scan = len < HP_MAX_HEAD ? len : HP_MAX_HEAD;
+    size_t pos, eol;
+    const char *sp1, *sp2;
+
+    pthread_once(&kernel_once, kernel_select);
+    kernels[kernel].fn(buf, scan, marks);
+
+    /* Request line: method SP target SP version CRLF; only the version has no spaces */
+    eol = 0;
+    while ((eol = next_mark(marks, scan, eol)) < scan && buf[eol] != '\n')
+        eol++;
+    if (eol == scan)
+        return scan < HP_MAX_HEAD ? 0 : -1;
+    sp1 = memchr(buf, ' ', eol);
+    sp2 = memrchr(buf, ' ', eol);
+    if (sp1 == NULL || sp1 == buf || sp2 - sp1 < 2)
+        return -1;
+    req->method = span(0, sp1 - buf);
+    req->target = span(sp1 + 1 - buf, sp2 - buf);
+    req->version = span(sp2 + 1 - buf, buf[eol - 1] == '\r' ? eol - 1 : eol);
+
+    /* Header fields, up to the blank line */
+    req->nheaders = 0;
+    for (pos = eol + 1;; pos = eol + 1) {
+        size_t colon = scan, start, end;
+
+        eol = pos;
+        while ((eol = next_mark(marks, scan, eol)) < scan && buf[eol] != '\n') {
+            if (buf[eol] == ':' && colon == scan)
+                colon = eol;
+            eol++;
+        }
+        if (eol == scan)
+            return scan < HP_MAX_HEAD ? 0 : -1;
+        if (eol == pos || (eol == pos + 1 && buf[pos] == '\r'))
+            return eol + 1;
+        if (colon == scan || colon == pos || buf[pos] == ' ' || buf[pos] == '\t' ||
+            req->nheaders == HP_MAX_HEADERS)
+            return -1;  // Including obsolete line folding
+        if (buf[colon - 1] == ' ' || buf[colon - 1] == '\t')
+            return -1;  // No whitespace before the colon (RFC 7230 3.2.4)
+
+        start = colon + 1;
+        end = eol;
+        while (start < end && (buf[start] == ' ' || buf[start] == '\t'))
+            start++;
+        while (end > start && (buf[end - 1] == '\r' || buf[end - 1] == ' ' || buf[end - 1] == '\t'))
+            end--;
+        req->headers[req->nheaders].name = span(pos, colon);
+        req->headers[req->nheaders].value = span(start, end);
+        req->nheaders++;
+    }
+}
+
+/* Whether the span of buf is s, ignoring case */
+int hp_span_is(const char *buf, hp_span span, const char *s) {
+    return strlen(s) == span.len && !strncasecmp(buf + span.off, s, span.len);
+}
+
+/* Forces the named kernel, for benchmarks. Returns -1 if this CPU lacks it */
+int hp_use(const char *name) {
+    pthread_once(&kernel_once, kernel_select);
+    for (int k = 0; k < NKERNELS; k++) {
+        if (!strcmp(kernels[k].name, name) && supported(k)) {
+            kernel = k;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+const char *hp_kernel() {
+    pthread_once(&kernel_once, kernel_select);
+    return kernels[kernel].name;
+}
@@ -0,0 +1,39 @@
+/*
+ * hparse.h - vectorized parser for HTTP/1.x request heads
+ */
+#ifndef __HPARSE_H__
+#define __HPARSE_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define HP_MAX_HEAD 8192    // Longest request head accepted, in bytes
+#define HP_MAX_HEADERS 64   // Most header fields in one request
+
+/* Bytes [off, off + len) of the parsed buffer */
+typedef struct {
+    uint32_t off;
+    uint32_t len;
+} hp_span;
+
+typedef struct {
+    hp_span name;
+    hp_span value;  // Without surrounding whitespace or the CRLF
+} hp_header;
+
+typedef struct {
+    hp_span method;
+    hp_span target;
+    hp_span version;
+    int nheaders;
+    hp_header headers[HP_MAX_HEADERS];
+} hp_request;
+
+#define HP_AT(buf, span) ((buf) + (span).off)
+
+long hp_parse_request(const char *buf, size_t len, hp_request *req);
+int hp_span_is(const char *buf, hp_span span, const char *s);
+int hp_use(const char *kernel);
+const char *hp_kernel(void);
+
+#endif /* __HPARSE_H__ */
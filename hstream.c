@@ -0,0 +1,342 @@
+/*
+ * hstream.c - resumable HTTP/1.x message parser
+ *
+ * Bytes are fed in whatever pieces they arrive in; the parser keeps its
+ * place between calls and reports the start line, each header, the body
+ * and the end of the message through callbacks. Only a line that is split
+ * across feeds is copied, into a buffer the limits bound; body bytes are
+ * passed through in place. The body ends by Content-Length, by chunked
+ * framing or, for a response with neither, at end of input.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include "hstream.h"
+
+enum {
+    S_START,       // Start line
+    S_HEADER,      // Header lines, up to the blank line
+    S_LENGTH,      // Body of Content-Length bytes
+    S_CLOSE,       // Body up to end of input
+    S_CHUNK_SIZE,  // Chunk-size line
+    S_CHUNK_DATA,
+    S_CHUNK_END,   // CRLF after the chunk data
+    S_TRAILER,     // Trailer lines, up to the blank line
+    S_DONE,
+    S_ERROR
+};
+
+#define DEFAULT_MAX_LINE 8192
+#define DEFAULT_MAX_HEAD 65536
+#define DEFAULT_MAX_HEADERS 100
+
+void hs_init(hs_parser *p, int type, const hs_callbacks *cb, void *arg, const hs_limits *limits) {
+    static const hs_callbacks none;
+
+    memset(p, 0, sizeof(*p));
+    p->type = type;
+    p->cb = cb ? cb : &none;
+    p->arg = arg;
+    if (limits)
+        p->limits = *limits;
+    if (p->limits.max_line == 0)
+        p->limits.max_line = DEFAULT_MAX_LINE;
+    if (p->limits.max_head == 0)
+        p->limits.max_head = DEFAULT_MAX_HEAD;
+    if (p->limits.max_headers == 0)
+        p->limits.max_headers = DEFAULT_MAX_HEADERS;
+    p->content_length = -1;
+}
+
+void hs_free(hs_parser *p) {
+    free(p->line);
+    p->line = NULL;
+    p->line_cap = 0;
+}
+
+/* Whether a complete message has been parsed */
+int hs_done(const hs_parser *p) {
+    return p->state == S_DONE;
+}
+
+const char *hs_strerror(int error) {
+    switch (error) {
+    case HS_E_SYNTAX:
+        return "malformed message";
+    case HS_E_LIMIT:
+        return "head too large";
+    case HS_E_CALLBACK:
+        return "stopped by callback";
+    case HS_E_EOF:
+        return "truncated message";
+    }
+    return "no error";
+}
+
+static int fail(hs_parser *p, int error) {
+    p->error = error;
+    p->state = S_ERROR;
+    return -1;
+}
+
+/* Resets per-message state for the next message on the connection */
+static void next_message(hs_parser *p) {
+    p->status = 0;
+    p->content_length = -1;
+    p->chunked = 0;
+    p->head_len = 0;
+    p->nheaders = 0;
+    p->line_len = 0;
+    p->remaining = 0;
+}
+
+/*
+ * Takes the next line from data[*pos..len). Returns 1 with *line and *n
+ * set (without the CRLF) once one is complete, 0 if data ran out first,
+ * or -1 if it is over the line limit. In-head lines count toward the
+ * head limit too.
+ */
+static int take_line(hs_parser *p, const char *data, size_t len, size_t *pos, const char **line, size_t *n,
+                     int in_head) {
+    const char *start = data + *pos;
+    const char *nl = memchr(start, '\n', len - *pos);
+    size_t take = nl ? (size_t)(nl - start) + 1 : len - *pos;
+
+    if (p->line_len + take > p->limits.max_line + 2 ||
+        (in_head && p->head_len + take > p->limits.max_head))
+        return -1;
+    if (in_head)
+        p->head_len += take;
+    *pos += take;
+
+    if (nl && p->line_len == 0) {  // Whole line in this feed: no copy
+        *line = start;
+        *n = take;
+    } else {
+        if (p->line_len + take > p->line_cap) {
+            size_t cap = p->limits.max_line + 2;
+            char *grown = realloc(p->line, cap);
+            if (grown == NULL)
+                return -1;
+            p->line = grown;
+            p->line_cap = cap;
+        }
+        memcpy(p->line + p->line_len, start, take);
+        p->line_len += take;
+        if (!nl)
+            return 0;
+        *line = p->line;
+        *n = p->line_len;
+        p->line_len = 0;
+    }
+    (*n)--;  // LF
+    if (*n > 0 && (*line)[*n - 1] == '\r')
+        (*n)--;
+    return 1;
+}
+
+static int start_line(hs_parser *p, const char *line, size_t n) {
+    const char *sp1 = memchr(line, ' ', n), *sp2;
+
+    if (sp1 == NULL || sp1 == line)
+        return fail(p, HS_E_SYNTAX);
+    sp2 = memchr(sp1 + 1, ' ', line + n - sp1 - 1);
+    if (p->type == HS_REQUEST) {
+        if (sp2 == NULL || sp2 == sp1 + 1 || sp2 + 1 == line + n)
+            return fail(p, HS_E_SYNTAX);
+    } else {
+        const char *code = sp1 + 1;
+        if (sp2 == NULL)
+            sp2 = line + n;  // The reason phrase may be left out
+        if (sp2 - code != 3 || code[0] < '1' || code[0] > '5' || code[1] < '0' || code[1] > '9' ||
+            code[2] < '0' || code[2] > '9')
+            return fail(p, HS_E_SYNTAX);
+        p->status = (code[0] - '0') * 100 + (code[1] - '0') * 10 + (code[2] - '0');
+    }
+    if (p->cb->start) {
+        const char *c = sp2 < line + n ? sp2 + 1 : sp2;
+        if (p->cb->start(p, line, sp1 - line, sp1 + 1, sp2 - sp1 - 1, c, line + n - c))
+            return fail(p, HS_E_CALLBACK);
+    }
+    return 0;
+}
+
+static int header_line(hs_parser *p, const char *line, size_t n) {
+    const char *colon = memchr(line, ':', n), *v, *end = line + n;
+
+    if (colon == NULL || colon == line || line[0] == ' ' || line[0] == '\t')
+        return fail(p, HS_E_SYNTAX);  // Including obsolete line folding
+    if (colon[-1] == ' ' || colon[-1] == '\t')
+        return fail(p, HS_E_SYNTAX);  // No whitespace before the colon (RFC 7230 3.2.4)
+    if (++p->nheaders > p->limits.max_headers)
+        return fail(p, HS_E_LIMIT);
+    for (v = colon + 1; v < end && (*v == ' ' || *v == '\t'); v++)
+        ;
+    while (end > v && (end[-1] == ' ' || end[-1] == '\t'))
+        end--;
+
+    if (colon - line == 14 && !strncasecmp(line, "Content-Length", 14)) {
+        char *stop;
+        long long cl = strtoll(v, &stop, 10);
+        if (stop != end || cl < 0 || (p->content_length >= 0 && cl != p->content_length))
+            return fail(p, HS_E_SYNTAX);
+        p->content_length = cl;
+    } else if (colon - line == 17 && !strncasecmp(line, "Transfer-Encoding", 17)) {
+        /* Chunked only counts as the last coding applied */
+        p->chunked = end - v >= 7 && !strncasecmp(end - 7, "chunked", 7);
+    }
+    if (p->cb->header && p->cb->header(p, line, colon - line, v, end - v))
+        return fail(p, HS_E_CALLBACK);
+    return 0;
+}
+
+static int message_end(hs_parser *p) {
+    p->state = S_DONE;
+    if (p->cb->end && p->cb->end(p))
+        return fail(p, HS_E_CALLBACK);
+    return 0;
+}
+
+/* Picks how the body is framed once the head is complete */
+static int head_end(hs_parser *p) {
+    if (p->cb->headers_done && p->cb->headers_done(p))
+        return fail(p, HS_E_CALLBACK);
+    if (p->type == HS_RESPONSE &&
+        (p->no_body || p->status < 200 || p->status == 204 || p->status == 304))
+        return message_end(p);
+    if (p->chunked) {
+        p->state = S_CHUNK_SIZE;
+        return 0;
+    }
+    if (p->content_length > 0) {
+        p->state = S_LENGTH;
+        p->remaining = p->content_length;
+        return 0;
+    }
+    if (p->content_length < 0 && p->type == HS_RESPONSE) {
+        p->state = S_CLOSE;
+        return 0;
+    }
+    return message_end(p);
+}
+
+static int chunk_size(hs_parser *p, const char *line, size_t n) {
+    long long size = 0;
+    size_t i;
+
+    for (i = 0; i < n; i++) {
+        int c = line[i], d;
+        if (c >= '0' && c <= '9')
+            d = c - '0';
+        else if ((c | 0x20) >= 'a' && (c | 0x20) <= 'f')
+            d = (c | 0x20) - 'a' + 10;
+        else
+            break;
+        if (size > (1LL << 55))
+            return fail(p, HS_E_SYNTAX);
+        size = size * 16 + d;
+    }
+    if (i == 0 || (i < n && line[i] != ';' && line[i] != ' ' && line[i] != '\t'))
+        return fail(p, HS_E_SYNTAX);  // Extensions after ';' are ignored
+    p->remaining = size;
+    p->state = size > 0 ? S_CHUNK_DATA : S_TRAILER;
+    return 0;
+}
+
+/* Hands the next min(remaining, available) body bytes to the body callback */
+static int body_bytes(hs_parser *p, const char *data, size_t len, size_t *pos) {
+    size_t n = len - *pos;
+
+    if (p->state != S_CLOSE && (long long)n > p->remaining)
+        n = p->remaining;
+    if (n > 0 && p->cb->body && p->cb->body(p, data + *pos, n))
+        return fail(p, HS_E_CALLBACK);
+    *pos += n;
+    p->remaining -= n;
+    return 0;
+}
+
+/*
+ * Parses data[0..len). Returns the bytes consumed, which is less than len
+ * only when a message ended inside data (see hs_done), or -1 with
+ * p->error set. Feeding after a message ended starts the next one.
+ */
+ssize_t hs_feed(hs_parser *p, const char *data, size_t len) {
+    size_t pos = 0, n;
+    const char *line;
+    int rc;
+
+    if (p->state == S_ERROR)
+        return -1;
+    if (p->state == S_DONE) {
+        next_message(p);
+        p->state = S_START;
+    }
+
+    while (pos < len && p->state != S_DONE) {
+        switch (p->state) {
+        case S_START:
+        case S_HEADER:
+        case S_TRAILER:
+            if ((rc = take_line(p, data, len, &pos, &line, &n, p->state != S_TRAILER)) < 0)
+                return fail(p, HS_E_LIMIT);
+            if (rc == 0)
+                break;
+            if (p->state == S_START) {
+                if (n == 0 && p->head_len <= 2) {  // Stray CRLF between messages
+                    p->head_len = 0;
+                    break;
+                }
+                if (start_line(p, line, n) < 0)
+                    return -1;
+                p->state = S_HEADER;
+            } else if (n == 0) {
+                if ((p->state == S_HEADER ? head_end(p) : message_end(p)) < 0)
+                    return -1;
+            } else if (p->state == S_HEADER && header_line(p, line, n) < 0) {
+                return -1;
+            }
+            break;
+        case S_CHUNK_SIZE:
+            if ((rc = take_line(p, data, len, &pos, &line, &n, 0)) < 0)
+                return fail(p, HS_E_LIMIT);
+            if (rc == 1 && chunk_size(p, line, n) < 0)
+                return -1;
+            break;
+        case S_LENGTH:
+        case S_CLOSE:
+        case S_CHUNK_DATA:
+            if (body_bytes(p, data, len, &pos) < 0)
+                return -1;
+            if (p->state == S_LENGTH && p->remaining == 0 && message_end(p) < 0)
+                return -1;
+            if (p->state == S_CHUNK_DATA && p->remaining == 0)
+                p->state = S_CHUNK_END;
+            break;
+        case S_CHUNK_END:
+            if ((rc = take_line(p, data, len, &pos, &line, &n, 0)) < 0)
+                return fail(p, HS_E_LIMIT);
+            if (rc == 1 && n != 0)
+                return fail(p, HS_E_SYNTAX);
+            if (rc == 1)
+                p->state = S_CHUNK_SIZE;
+            break;
+        }
+    }
+    return pos;
+}
+
+/*
+ * Tells the parser the input has ended. Returns 0 if that completes the
+ * message (a body read to end of input) or falls between messages, and
+ * -1 with HS_E_EOF if it cuts one short.
+ */
+int hs_finish(hs_parser *p) {
+    if (p->state == S_ERROR)
+        return -1;
+    if (p->state == S_CLOSE)
+        return message_end(p);
+    if (p->state == S_DONE || (p->state == S_START && p->line_len == 0 && p->head_len == 0))
+        return 0;
+    return fail(p, HS_E_EOF);
+}
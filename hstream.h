@@ -0,0 +1,69 @@
+/*
+ * hstream.h - resumable HTTP/1.x message parser
+ */
+#ifndef __HSTREAM_H__
+#define __HSTREAM_H__
+
+#include <stddef.h>
+#include <sys/types.h>
+
+#define HS_REQUEST 0
+#define HS_RESPONSE 1
+
+/* Errors, in hs_parser.error */
+#define HS_E_SYNTAX 1    // Malformed start line, header or chunk size
+#define HS_E_LIMIT 2     // A line or the head is over its limit
+#define HS_E_CALLBACK 3  // A callback returned nonzero
+#define HS_E_EOF 4       // Input ended inside a message
+
+/* Bounds on a message head; a zero field takes the default */
+typedef struct {
+    size_t max_line;  // Start line, header line or chunk-size line (8 KB)
+    size_t max_head;  // Start line through the blank line (64 KB)
+    int max_headers;  // Header fields (100)
+} hs_limits;
+
+typedef struct hs_parser hs_parser;
+
+/*
+ * Called as each part of a message is parsed; any may be NULL. Pointers
+ * are valid only for the call. A nonzero return stops the parser with
+ * HS_E_CALLBACK. The start line comes split in three: method, target and
+ * version for a request; version, status code and reason for a response.
+ */
+typedef struct {
+    int (*start)(hs_parser *p, const char *a, size_t alen, const char *b, size_t blen,
+                 const char *c, size_t clen);
+    int (*header)(hs_parser *p, const char *name, size_t nlen, const char *value, size_t vlen);
+    int (*headers_done)(hs_parser *p);
+    int (*body)(hs_parser *p, const char *data, size_t len);  // Chunked framing removed
+    int (*end)(hs_parser *p);
+} hs_callbacks;
+
+struct hs_parser {
+    int type;         // HS_REQUEST or HS_RESPONSE
+    int state;
+    int error;        // HS_E_*, once hs_feed has returned -1
+    int status;       // Response status code, once the start line is in
+    int no_body;      // Set by the caller for responses to HEAD
+    long long content_length;  // -1 if absent
+    int chunked;
+    const hs_callbacks *cb;
+    void *arg;        // For the callbacks
+    hs_limits limits;
+    char *line;       // Line split across feeds
+    size_t line_len;
+    size_t line_cap;
+    size_t head_len;  // Head bytes so far
+    int nheaders;
+    long long remaining;  // Body or chunk bytes still to come
+};
+
+void hs_init(hs_parser *p, int type, const hs_callbacks *cb, void *arg, const hs_limits *limits);
+void hs_free(hs_parser *p);
+ssize_t hs_feed(hs_parser *p, const char *data, size_t len);
+int hs_finish(hs_parser *p);
+int hs_done(const hs_parser *p);
+const char *hs_strerror(int error);
+
+#endif /* __HSTREAM_H__ */
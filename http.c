@@ -0,0 +1,474 @@
+/*
+ * http.c - helpers for HTTP/1.x message heads held in memory
+ *
+ * A head is the status (or request) line and header lines up to and
+ * including the blank line, as relayed byte for byte; it is not
+ * NUL-terminated.
+ */
+#define _DEFAULT_SOURCE  // timegm
+#define _XOPEN_SOURCE 700  // strptime
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <ctype.h>
+#include <string.h>
+#include <strings.h>
+#include "http.h"
+#include "hdrhash.h"
+
+/* Length of the head including its blank line, or size if there is none */
+size_t http_head_length(const char *buf, size_t size) {
+    for (size_t i = 0; i + 4 <= size; i++) {
+        if (buf[i] == '\r' && !memcmp(buf + i, "\r\n\r\n", 4))
+            return i + 4;
+    }
+    return size;
+}
+
+/*
+ * Copies the value of header name from head into val (at most size bytes,
+ * NUL-terminated). Returns 1 if the header is present.
+ */
+int http_header_value(const char *head, size_t len, const char *name, char *val, size_t size) {
+    size_t nameLen = strlen(name);
+    const char *end = head + len, *line = head;
+
+    while (line < end) {
+        const char *eol = memchr(line, '\n', end - line);
+        if (eol == NULL)
+            eol = end;
+        if ((size_t)(eol - line) > nameLen && line[nameLen] == ':' && !strncasecmp(line, name, nameLen)) {
+            const char *v = line + nameLen + 1;
+            size_t n = 0;
+            while (v < eol && (*v == ' ' || *v == '\t'))
+                v++;
+            while (v < eol && *v != '\r' && n < size - 1)
+                val[n++] = *v++;
+            val[n] = '\0';
+            return 1;
+        }
+        line = eol + 1;
+    }
+    return 0;
+}
+
+/* Status code of a response head, or 0 if the status line is malformed */
+int http_status(const char *head, size_t len) {
+    char line[64];
+    int status;
+    size_t n = len < sizeof(line) - 1 ? len : sizeof(line) - 1;
+
+    memcpy(line, head, n);
+    line[n] = '\0';
+    if (sscanf(line, "HTTP/%*d.%*d %d", &status) != 1)
+        return 0;
+    return status;
+}
+
+/*
+ * Parses a Range value holding a single byte range: "bytes=a-b", "bytes=a-"
+ * (*last set to -1) or the suffix "bytes=-n" (*first set to -1, *last to
+ * n). Returns 0 for anything else, multiple ranges included.
+ */
+int http_parse_range(const char *val, long *first, long *last) {
+    char rest;
+    int n;
+
+    if (strncasecmp(val, "bytes=", 6) || strchr(val, ','))
+        return 0;
+    val += 6;
+    if (sscanf(val, " -%ld %c", last, &rest) == 1) {
+        *first = -1;
+        return *last > 0;
+    }
+    if ((n = sscanf(val, " %ld-%ld %c", first, last, &rest)) == 2)
+        return *first >= 0 && *last >= *first;
+    if (n == 1 && strchr(val, '-') && sscanf(val, " %*d- %c", &rest) != 1) {
+        *last = -1;
+        return *first >= 0;
+    }
+    return 0;
+}
+
+/*
+ * Resolves a range from http_parse_range against an object of total bytes
+ * into inclusive offsets. Returns 0 if it is not satisfiable.
+ */
+int http_range_resolve(long *first, long *last, long total) {
+    if (*first == -1) {
+        *first = *last < total ? total - *last : 0;
+        *last = total - 1;
+    } else if (*last == -1 || *last >= total) {
+        *last = total - 1;
+    }
+    return *first < total && *first <= *last;
+}
+
+/* Seconds since the epoch of an HTTP-date (IMF-fixdate), or -1 */
+static time_t http_date(const char *val) {
+    struct tm tm;
+    const char *end;
+
+    memset(&tm, 0, sizeof(tm));
+    if ((end = strptime(val, "%a, %d %b %Y %H:%M:%S GMT", &tm)) == NULL || *end != '\0')
+        return -1;
+    return timegm(&tm);
+}
+
+/*
+ * Whether an If-Range validator still holds for the response with m: an
+ * empty validator always does, an entity tag must match a strong ETag and
+ * a date must equal Last-Modified exactly.
+ */
+int http_if_range_match(const http_meta *m, const char *validator) {
+    if (*validator == '\0')
+        return 1;
+    if (*validator == '"' || !strncmp(validator, "W/", 2))
+        return *validator == '"' && !strcmp(m->etag, validator);
+    return m->last_modified != -1 && http_date(validator) == m->last_modified;
+}
+
+/* Whether the comma-separated entity tag list has one weakly matching etag */
+static int etag_listed(const char *list, const char *etag) {
+    size_t len;
+
+    if (!strncmp(etag, "W/", 2))
+        etag += 2;
+    len = strlen(etag);
+    while (*list) {
+        list += strspn(list, " \t,");
+        if (*list == '*')
+            return 1;
+        if (!strncmp(list, "W/", 2))
+            list += 2;
+        size_t n = strcspn(list, " \t,");
+        if (n == len && !strncmp(list, etag, len))
+            return 1;
+        list += n;
+    }
+    return 0;
+}
+
+/*
+ * Whether a client holding If-None-Match inm or If-Modified-Since ims
+ * (either may be empty) already has the response with m, so that 304 may
+ * be sent. If-None-Match wins when both are present.
+ */
+int http_not_modified(const http_meta *m, const char *inm, const char *ims) {
+    time_t since;
+
+    if (*inm)
+        return m->etag[0] && etag_listed(inm, m->etag);
+    if (*ims == '\0' || m->last_modified == -1 || (since = http_date(ims)) == -1)
+        return 0;
+    return m->last_modified <= since;
+}
+
+/* Whether a comma-separated list of tokens, such as a Connection value, names the n bytes of name */
+int http_list_has(const char *list, const char *name, size_t n) {
+    while (*list) {
+        size_t len;
+
+        list += strspn(list, " \t,");
+        len = strcspn(list, " \t,");
+        if (len == n && !strncasecmp(list, name, n))
+            return 1;
+        list += len;
+    }
+    return 0;
+}
+
+/*
+ * Whether an Accept-Encoding list admits coding: listed by name with a
+ * nonzero q-value, or not named and covered by a "*" with one.
+ */
+int http_accepts(const char *list, const char *coding) {
+    size_t clen = strlen(coding);
+    double own = -1, any = -1;
+
+    while (*list) {
+        const char *tok, *end, *p;
+        size_t n;
+        double q = 1;
+
+        list += strspn(list, " \t,");
+        tok = list;
+        n = strcspn(tok, " \t,;");
+        end = tok + strcspn(tok, ",");
+        for (p = tok + n; (p = memchr(p, ';', end - p)) != NULL;) {
+            p += 1 + strspn(p + 1, " \t");
+            if ((*p == 'q' || *p == 'Q') && p[1] == '=')
+                q = strtod(p + 2, NULL);
+        }
+        if (n == clen && !strncasecmp(tok, coding, n))
+            own = q;
+        else if (n == 1 && *tok == '*')
+            any = q;
+        list = end;
+    }
+    return own >= 0 ? own > 0 : any > 0;
+}
+
+/*
+ * Writes etag ("x" or W/"x") with suffix added inside the quotes, the tag
+ * of another representation of the same response. Returns -1 if etag is
+ * malformed or the result does not fit in size bytes.
+ */
+int http_etag_suffix(const char *etag, const char *suffix, char *out, size_t size) {
+    size_t len = strlen(etag);
+    int n;
+
+    if (len < 2 || etag[len - 1] != '"' || strchr(etag, '"') == etag + len - 1)
+        return -1;
+    n = snprintf(out, size, "%.*s%s\"", (int)(len - 1), etag, suffix);
+    return n < 0 || (size_t)n >= size ? -1 : 0;
+}
+
+static int token_cmp(const void *a, const void *b) {
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+/*
+ * Normalizes a comma-separated header value for comparison: tokens are
+ * trimmed, lowercased, sorted and joined by single commas. Returns -1 if
+ * the result does not fit in size bytes.
+ */
+int http_normalize_list(const char *in, char *out, size_t size) {
+    char buf[1024], *tokens[64], *save, *tok;
+    size_t len = 0;
+    int n = 0;
+
+    if (strlen(in) >= sizeof(buf))
+        return -1;
+    for (int i = 0; (buf[i] = tolower((unsigned char)in[i])) != '\0'; i++)
+        ;
+    for (tok = strtok_r(buf, ",", &save); tok && n < 64; tok = strtok_r(NULL, ",", &save)) {
+        char *end = tok + strlen(tok);
+        while (*tok == ' ' || *tok == '\t')
+            tok++;
+        while (end > tok && (end[-1] == ' ' || end[-1] == '\t'))
+            *--end = '\0';
+        if (*tok)
+            tokens[n++] = tok;
+    }
+    qsort(tokens, n, sizeof(tokens[0]), token_cmp);
+
+    out[0] = '\0';
+    for (int i = 0; i < n; i++) {
+        size_t tlen = strlen(tokens[i]);
+        if (len + tlen + 2 > size)
+            return -1;
+        if (i > 0)
+            out[len++] = ',';
+        memcpy(out + len, tokens[i], tlen + 1);
+        len += tlen;
+    }
+    return 0;
+}
+
+/*
+ * Copies head into a malloc'd *out, replacing the first line with status
+ * (when not NULL), leaving out the headers named in drop (NULL-terminated,
+ * may be NULL) and adding the CRLF-terminated lines in extra before the
+ * blank line. Returns the length of the new head.
+ */
+size_t http_rewrite_head(const char *head, size_t len, const char *status,
+                         const char **drop, const char *extra, char **out) {
+    const char *line = head, *end = head + len;
+    char *p;
+
+    *out = p = malloc(len + (status ? strlen(status) : 0) + (extra ? strlen(extra) : 0) + 3);
+    for (int first = 1; line < end; first = 0) {
+        const char *eol = memchr(line, '\n', end - line);
+        size_t n = eol ? (size_t)(eol - line) + 1 : (size_t)(end - line);
+        int keep = 1;
+
+        if (n <= 2 && (line[0] == '\r' || line[0] == '\n'))
+            break;  // Blank line ends the head
+        if (first && status) {
+            p += sprintf(p, "%s\r\n", status);
+            keep = 0;
+        }
+        for (int i = 0; keep && drop && drop[i]; i++) {
+            size_t dlen = strlen(drop[i]);
+            if (n > dlen && line[dlen] == ':' && !strncasecmp(line, drop[i], dlen))
+                keep = 0;
+        }
+        if (keep) {
+            memcpy(p, line, n);
+            p += n;
+        }
+        line += n;
+    }
+    if (extra)
+        p += sprintf(p, "%s", extra);
+    p += sprintf(p, "\r\n");
+    return p - *out;
+}
+
+/*
+ * Response metadata. The relay fills an http_meta one header at a time as
+ * the head streams past (http_meta_header); a head already in memory is
+ * parsed with http_meta_parse. Either way each header is looked at once,
+ * and the cache admission check and the log read the struct.
+ */
+void http_meta_init(http_meta *m) {
+    memset(m, 0, sizeof(*m));
+    m->content_length = -1;
+    m->max_age = -1;
+    m->expires = -1;
+    m->last_modified = -1;
+    m->range_first = m->range_last = m->range_total = -1;
+}
+
+/* Copies value[0..vlen) NUL-terminated into buf, truncated to size */
+static char *meta_value(const char *value, size_t vlen, char *buf, size_t size) {
+    if (vlen >= size)
+        vlen = size - 1;
+    memcpy(buf, value, vlen);
+    buf[vlen] = '\0';
+    return buf;
+}
+
+static void meta_cache_control(http_meta *m, char *val) {
+    char *save, *tok;
+    long smax = -1;
+
+    for (tok = strtok_r(val, ",", &save); tok; tok = strtok_r(NULL, ",", &save)) {
+        tok += strspn(tok, " \t");
+        if (!strncasecmp(tok, "no-store", 8))
+            m->flags |= HM_NO_STORE;
+        else if (!strncasecmp(tok, "no-cache", 8))
+            m->flags |= HM_NO_CACHE;
+        else if (!strncasecmp(tok, "private", 7))
+            m->flags |= HM_PRIVATE;
+        else if (!strncasecmp(tok, "public", 6) || !strncasecmp(tok, "must-revalidate", 15))
+            m->flags |= HM_AUTH_OK;
+        else if (!strncasecmp(tok, "max-age=", 8) && m->max_age < 0)
+            m->max_age = strtol(tok + 8, NULL, 10);
+        else if (!strncasecmp(tok, "s-maxage=", 9))
+            smax = strtol(tok + 9, NULL, 10);
+    }
+    if (smax >= 0) {
+        m->max_age = smax;  // A shared cache goes by s-maxage
+        m->flags |= HM_AUTH_OK;
+    }
+}
+
+/* Records one response header; name and value as hstream.c reports them */
+void http_meta_header(http_meta *m, const char *name, size_t nlen, const char *value, size_t vlen) {
+    char val[1024], list[sizeof(m->vary) * 2 + 2];
+    char *end;
+
+    switch (hdr_lookup(name, nlen)) {
+    case HDR_CONTENT_LENGTH:
+        m->content_length = strtoll(meta_value(value, vlen, val, sizeof(val)), &end, 10);
+        if (*end != '\0' || m->content_length < 0)
+            m->content_length = -1;
+        break;
+    case HDR_TRANSFER_ENCODING:
+        if (vlen >= 7 && !strncasecmp(value + vlen - 7, "chunked", 7))
+            m->flags |= HM_CHUNKED;
+        else
+            m->flags &= ~HM_CHUNKED;
+        break;
+    case HDR_CACHE_CONTROL:
+    case HDR_PRAGMA:  // Pragma: no-cache, from HTTP/1.0 origins
+        meta_cache_control(m, meta_value(value, vlen, val, sizeof(val)));
+        break;
+    case HDR_EXPIRES:
+        if ((m->expires = http_date(meta_value(value, vlen, val, sizeof(val)))) == -1)
+            m->expires = 0;  // An invalid date means already expired
+        break;
+    case HDR_LAST_MODIFIED:
+        m->last_modified = http_date(meta_value(value, vlen, val, sizeof(val)));
+        break;
+    case HDR_ETAG:
+        meta_value(value, vlen, m->etag, sizeof(m->etag));
+        break;
+    case HDR_VARY:
+        /* Repeated Vary headers add up */
+        snprintf(list, sizeof(list), "%s%s%.*s", m->vary, m->vary[0] ? "," : "",
+                 (int)(vlen < sizeof(m->vary) ? vlen : sizeof(m->vary)), value);
+        if (memchr(value, '*', vlen) || vlen >= sizeof(m->vary) ||
+            http_normalize_list(list, m->vary, sizeof(m->vary)) < 0)
+            m->flags |= HM_VARY_ANY;
+        break;
+    case HDR_SET_COOKIE:
+        m->flags |= HM_SET_COOKIE;
+        break;
+    case HDR_CONTENT_TYPE:
+        meta_value(value, vlen, m->content_type, sizeof(m->content_type));
+        m->content_type[strcspn(m->content_type, "; \t")] = '\0';
+        for (end = m->content_type; *end; end++)
+            *end = tolower((unsigned char)*end);
+        break;
+    case HDR_CONTENT_ENCODING:
+        meta_value(value, vlen, m->content_encoding, sizeof(m->content_encoding));
+        break;
+    case HDR_CONTENT_RANGE:
+        if (sscanf(meta_value(value, vlen, val, sizeof(val)), "bytes %ld-%ld/%ld",
+                   &m->range_first, &m->range_last, &m->range_total) != 3)
+            m->range_first = m->range_last = m->range_total = -1;  // Unknown total ("*") or malformed
+        break;
+    default:
+        break;
+    }
+}
+
+/* Parses the status and headers of the response head into m. Returns 0, or -1 if there is no status line */
+int http_meta_parse(http_meta *m, const char *head, size_t len) {
+    const char *line, *eol, *end = head + len;
+
+    http_meta_init(m);
+    if ((m->status = http_status(head, len)) <= 0)
+        return -1;
+    for (line = head; line < end; line = eol + 1) {
+        const char *colon, *v, *vend;
+
+        if ((eol = memchr(line, '\n', end - line)) == NULL)
+            eol = end;
+        if (line == head || (colon = memchr(line, ':', eol - line)) == NULL)
+            continue;
+        for (v = colon + 1; v < eol && (*v == ' ' || *v == '\t'); v++)
+            ;
+        for (vend = eol; vend > v && (vend[-1] == '\r' || vend[-1] == ' ' || vend[-1] == '\t'); vend--)
+            ;
+        http_meta_header(m, line, colon - line, v, vend - v);
+    }
+    return 0;
+}
+
+/*
+ * Whether a response with m to a request with reqHeaders (may be NULL) may
+ * be kept for other clients at all: the answer to a request with
+ * Authorization only if the origin says so (RFC 7234, section 3.2).
+ */
+int http_meta_shareable(const http_meta *m, const char *reqHeaders) {
+    char val[8];
+
+    return (m->flags & HM_AUTH_OK) || reqHeaders == NULL ||
+           !http_header_value(reqHeaders, strlen(reqHeaders), "Authorization", val, sizeof(val));
+}
+
+/*
+ * Whether a complete response with m, to a request with reqHeaders (may be
+ * NULL), may go into a shared cache: a status that is cacheable by
+ * default, nothing that makes it private to one client, and not already
+ * stale (we never revalidate).
+ */
+int http_meta_cacheable(const http_meta *m, const char *reqHeaders) {
+    switch (m->status) {
+    case 200: case 203: case 204: case 300: case 301: case 404: case 405: case 410: case 414: case 501:
+        break;
+    default:
+        return 0;
+    }
+    if (m->flags & (HM_NO_STORE | HM_NO_CACHE | HM_PRIVATE | HM_SET_COOKIE | HM_VARY_ANY))
+        return 0;
+    if (m->max_age == 0)
+        return 0;
+    if (!http_meta_shareable(m, reqHeaders))
+        return 0;
+    return m->max_age > 0 || m->expires == -1 || m->expires > time(NULL);
+}
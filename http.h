@@ -0,0 +1,55 @@
+/*
+ * http.h - helpers for HTTP/1.x message heads held in memory
+ */
+#ifndef __HTTP_H__
+#define __HTTP_H__
+
+#include <stddef.h>
+#include <time.h>
+
+/* Flags of http_meta */
+#define HM_CHUNKED 0x01     // Transfer-Encoding ends in chunked
+#define HM_NO_STORE 0x02    // Cache-Control: no-store
+#define HM_NO_CACHE 0x04    // Cache-Control: no-cache (we cannot revalidate)
+#define HM_PRIVATE 0x08     // Cache-Control: private
+#define HM_SET_COOKIE 0x10  // Set-Cookie present
+#define HM_VARY_ANY 0x20    // Vary: *, or a Vary list too long to key on
+#define HM_AUTH_OK 0x40     // Cache-Control: public, s-maxage or must-revalidate
+
+/* What the proxy needs from a response head, parsed once */
+typedef struct {
+    int status;
+    unsigned flags;
+    long long content_length;  // -1 if absent
+    long max_age;              // s-maxage, else max-age; -1 if absent
+    time_t expires;            // -1 if absent, 0 if not a valid date
+    time_t last_modified;      // -1 if absent or not a valid date
+    char etag[128];            // "" if absent
+    char vary[128];            // As http_normalize_list leaves it; "" if absent
+    char content_type[64];     // Media type, lowercased, without parameters; "" if absent
+    char content_encoding[32]; // "" if absent
+    long range_first;          // Content-Range: bytes first-last/total; all -1 if absent or
+    long range_last;           // not of that form
+    long range_total;
+} http_meta;
+
+size_t http_head_length(const char *buf, size_t size);
+int http_header_value(const char *head, size_t len, const char *name, char *val, size_t size);
+int http_status(const char *head, size_t len);
+int http_parse_range(const char *val, long *first, long *last);
+int http_range_resolve(long *first, long *last, long total);
+int http_not_modified(const http_meta *m, const char *inm, const char *ims);
+int http_if_range_match(const http_meta *m, const char *validator);
+int http_normalize_list(const char *in, char *out, size_t size);
+int http_list_has(const char *list, const char *name, size_t n);
+int http_accepts(const char *list, const char *coding);
+int http_etag_suffix(const char *etag, const char *suffix, char *out, size_t size);
+size_t http_rewrite_head(const char *head, size_t len, const char *status,
+                         const char **drop, const char *extra, char **out);
+void http_meta_init(http_meta *m);
+void http_meta_header(http_meta *m, const char *name, size_t nlen, const char *value, size_t vlen);
+int http_meta_parse(http_meta *m, const char *head, size_t len);
+int http_meta_shareable(const http_meta *m, const char *reqHeaders);
+int http_meta_cacheable(const http_meta *m, const char *reqHeaders);
+
+#endif /* __HTTP_H__ */
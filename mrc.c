@@ -0,0 +1,166 @@
+/*
+ * mrc.c - online miss-ratio curve estimation
+ *
+ * SHARDS-style spatial sampling: a key is tracked iff its hash falls below
+ * rate * MRC_MODULUS, so every reference to a sampled key is seen and the
+ * sampled stream behaves like a scaled-down copy of the real one. For each
+ * sampled reference we compute the byte reuse distance, i.e. the total size
+ * of the distinct sampled objects referenced since the previous reference
+ * to the same key, and scale it by 1/rate. An LRU cache of C bytes hits
+ * exactly the references whose distance is below C, so the histogram of
+ * distances gives the miss ratio for every cache size at once.
+ *
+ * Distances come from a Fenwick tree indexed by logical access time that
+ * holds each tracked key's size at its most recent access time. Times are
+ * renumbered (and the oldest keys forgotten) when the window fills up.
+ * Only sampled references take the lock, so at the default 1% rate the
+ * cost on the request path is one multiply and compare per lookup.
+ */
+#include "csapp.h"
+#include "mrc.h"
+
+#define MRC_MODULUS (1UL << 24)
+#define MRC_MAX_KEYS 8192                 /* Tracked sampled keys */
+#define MRC_TABLE (2 * MRC_MAX_KEYS)      /* Open-addressing slots */
+#define MRC_WINDOW (4 * MRC_MAX_KEYS)     /* Access times before renumbering */
+#define MRC_BUCKETS 96                    /* Quarter-octaves from 1 KB */
+#define MRC_MIN_DIST 1024
+
+typedef struct {
+    unsigned long hash;     /* 0 for a free slot */
+    unsigned int time;      /* Time of the last reference */
+    size_t size;
+} mrc_key;
+
+static struct {
+    unsigned long threshold;  /* Keys with sample value below this are tracked */
+    double rate;
+    mrc_key keys[MRC_TABLE];
+    int nkeys;
+    long long tree[MRC_WINDOW + 1];  /* Fenwick tree of sizes by time */
+    unsigned int clock;
+    long refs;                /* Sampled references */
+    long cold;                /* ... to keys not seen before */
+    long hist[MRC_BUCKETS];   /* ... by scaled reuse distance */
+    sem_t mutex;
+} mrc;
+
+void mrc_init(double rate) {
+    memset(&mrc, 0, sizeof(mrc));
+    mrc.rate = rate;
+    mrc.threshold = rate * MRC_MODULUS;
+    Sem_init(&mrc.mutex, 0, 1);
+}
+
+/* Sample value of a key, independent of the cache's use of its hash */
+static unsigned long sample_value(unsigned long hash) {
+    return (hash * 0x9E3779B97F4A7C15UL) >> 40;
+}
+
+static void tree_add(unsigned int t, long long delta) {
+    for (; t <= MRC_WINDOW; t += t & -t)
+        mrc.tree[t] += delta;
+}
+
+static long long tree_sum(unsigned int t) {
+    long long sum = 0;
+    for (; t > 0; t -= t & -t)
+        sum += mrc.tree[t];
+    return sum;
+}
+
+static mrc_key *key_slot(unsigned long hash) {
+    unsigned int i = hash % MRC_TABLE;
+    while (mrc.keys[i].hash != 0 && mrc.keys[i].hash != hash)
+        i = (i + 1) % MRC_TABLE;
+    return &mrc.keys[i];
+}
+
+static int time_cmp(const void *a, const void *b) {
+    unsigned int ta = ((const mrc_key *)a)->time, tb = ((const mrc_key *)b)->time;
+    return ta < tb ? -1 : ta > tb;
+}
+
+/* Keeps the keep most recently used keys, renumbering their times from 1 */
+static void mrc_compact(int keep) {
+    mrc_key *live = Malloc(mrc.nkeys * sizeof(mrc_key));
+    int n = 0;
+
+    for (int i = 0; i < MRC_TABLE; i++) {
+        if (mrc.keys[i].hash != 0)
+            live[n++] = mrc.keys[i];
+    }
+    qsort(live, n, sizeof(mrc_key), time_cmp);
+
+    memset(mrc.keys, 0, sizeof(mrc.keys));
+    memset(mrc.tree, 0, sizeof(mrc.tree));
+    mrc.clock = 0;
+    mrc.nkeys = 0;
+    for (int i = n > keep ? n - keep : 0; i < n; i++) {
+        mrc_key *k = key_slot(live[i].hash);
+        *k = live[i];
+        k->time = ++mrc.clock;
+        tree_add(k->time, k->size);
+        mrc.nkeys++;
+    }
+    Free(live);
+}
+
+static int bucket(double dist) {
+    int b = 0;
+    if (dist >= MRC_MIN_DIST)
+        b = 4 * log2(dist / MRC_MIN_DIST) + 1;
+    return b < MRC_BUCKETS ? b : MRC_BUCKETS - 1;
+}
+
+/* Smallest distance that falls in bucket b */
+static double bucket_low(int b) {
+    return b == 0 ? 0 : MRC_MIN_DIST * pow(2, (b - 1) / 4.0);
+}
+
+void mrc_access(unsigned long keyHash, size_t size) {
+    if (keyHash == 0 || sample_value(keyHash) >= mrc.threshold)
+        return;
+
+    P(&mrc.mutex);
+    if (mrc.clock == MRC_WINDOW)
+        mrc_compact(MRC_MAX_KEYS);
+
+    mrc_key *k = key_slot(keyHash);
+    mrc.refs++;
+    if (k->hash == 0) {
+        mrc.cold++;
+        if (mrc.nkeys == MRC_MAX_KEYS) {
+            mrc_compact(MRC_MAX_KEYS * 3 / 4);
+            k = key_slot(keyHash);
+        }
+        k->hash = keyHash;
+        mrc.nkeys++;
+    } else {
+        long long dist = tree_sum(mrc.clock) - tree_sum(k->time);
+        mrc.hist[bucket(dist / mrc.rate)]++;
+        tree_add(k->time, -(long long)k->size);
+    }
+    k->time = ++mrc.clock;
+    k->size = size;
+    tree_add(k->time, size);
+    V(&mrc.mutex);
+}
+
+void mrc_report(FILE *fp, size_t cacheSize) {
+    P(&mrc.mutex);
+    fprintf(fp, "mrc.sample_rate %g\n", mrc.rate);
+    fprintf(fp, "mrc.sampled_refs %ld\n", mrc.refs);
+    fprintf(fp, "mrc.sampled_keys %d\n", mrc.nkeys);
+    if (mrc.refs > 0) {
+        for (size_t size = cacheSize / 8; size <= cacheSize * 16; size *= 2) {
+            long misses = mrc.cold;
+            for (int b = 0; b < MRC_BUCKETS; b++) {
+                if (bucket_low(b) >= size)
+                    misses += mrc.hist[b];
+            }
+            fprintf(fp, "mrc.miss_ratio %zu %.4f\n", size, (double)misses / mrc.refs);
+        }
+    }
+    V(&mrc.mutex);
+}
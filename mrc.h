@@ -0,0 +1,18 @@
+/*
+ * mrc.h - online miss-ratio curve estimation
+ */
+#ifndef __MRC_H__
+#define __MRC_H__
+
+#include <stdio.h>
+
+/* Samples a fraction rate of keys; 0 turns estimation off */
+void mrc_init(double rate);
+
+/* Records a reference to the key with keyHash whose object is size bytes */
+void mrc_access(unsigned long keyHash, size_t size);
+
+/* Prints estimated miss ratios for cache sizes around cacheSize */
+void mrc_report(FILE *fp, size_t cacheSize);
+
+#endif /* __MRC_H__ */
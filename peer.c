@@ -0,0 +1,228 @@
+/*
+ * peer.c - consistent-hash ownership of cache keys across sibling proxies
+ *
+ * Every proxy in a tier reads the same list of nodes and places each on a
+ * hash ring at PEER_VNODES points. A key belongs to the first node at or
+ * after its hash, so each object has exactly one owner and is cached only
+ * there; the others forward their misses to it. Adding or removing a node
+ * only moves the keys on the arcs it gains or loses.
+ *
+ * The list is re-read when its file changes, so nodes can be added or
+ * retired without restarts. A node that cannot be reached is left out of
+ * the ring for PEER_RETRY seconds, its keys falling to their next owner.
+ */
+#include <sys/stat.h>
+#include "csapp.h"
+#include "cache.h"
+#include "peer.h"
+
+#define PEER_MAX 32
+#define PEER_VNODES 64
+#define PEER_RETRY 5    /* Seconds a failed node stays out of the ring */
+
+typedef struct {
+    char host[MAXLINE];
+    char port[16];
+    int self;
+    time_t downUntil;   /* Out of the ring until then */
+    long forwarded;     /* Misses we sent it */
+    long failed;
+} peer_node;
+
+typedef struct {
+    unsigned long point;
+    int node;
+} ring_point;
+
+static struct {
+    char file[MAXLINE];
+    char listenPort[16];
+    time_t mtime;
+    time_t checked;
+    peer_node nodes[PEER_MAX];
+    int n;
+    ring_point ring[PEER_MAX * PEER_VNODES];
+    int points;
+    time_t nextRetry;           /* Earliest downUntil among failed nodes */
+    long servedForPeers;
+    pthread_mutex_t lock;       /* Protects all of the above */
+} peers;
+
+/* Spreads FNV hashes of similar strings over the ring (splitmix64 finalizer) */
+static unsigned long mix(unsigned long h) {
+    h ^= h >> 30;
+    h *= 0xbf58476d1ce4e5b9UL;
+    h ^= h >> 27;
+    h *= 0x94d049bb133111ebUL;
+    return h ^ (h >> 31);
+}
+
+static int by_point(const void *a, const void *b) {
+    const ring_point *x = a, *y = b;
+    return (x->point > y->point) - (x->point < y->point);
+}
+
+/* Places every node that is up on the ring; caller holds the lock */
+static void ring_build(time_t now) {
+    char name[MAXLINE + 32];
+
+    peers.points = 0;
+    peers.nextRetry = 0;
+    for (int i = 0; i < peers.n; i++) {
+        peer_node *p = &peers.nodes[i];
+        if (p->downUntil > now) {
+            if (peers.nextRetry == 0 || p->downUntil < peers.nextRetry)
+                peers.nextRetry = p->downUntil;
+            continue;
+        }
+        for (int v = 0; v < PEER_VNODES; v++) {
+            int len = snprintf(name, sizeof(name), "%s:%s#%d", p->host, p->port, v);
+            peers.ring[peers.points].point = mix(cache_hash(name, len));
+            peers.ring[peers.points].node = i;
+            peers.points++;
+        }
+    }
+    qsort(peers.ring, peers.points, sizeof(ring_point), by_point);
+}
+
+static int is_local(const char *host) {
+    char name[256];
+
+    if (!strcmp(host, "localhost") || !strncmp(host, "127.", 4))
+        return 1;
+    return gethostname(name, sizeof(name)) == 0 && !strcasecmp(host, name);
+}
+
+/* (Re)reads the node list; caller holds the lock */
+static int peers_load() {
+    char line[MAXLINE];
+    peer_node *nodes;  /* PEER_MAX of them is too big for a worker's stack */
+    int n = 0, self = 0;
+    FILE *fp;
+
+    if ((fp = fopen(peers.file, "r")) == NULL)
+        return -1;
+    nodes = Malloc(PEER_MAX * sizeof(peer_node));
+    while (fgets(line, sizeof(line), fp) != NULL && n < PEER_MAX) {
+        peer_node *p = &nodes[n];
+
+        line[strcspn(line, "#")] = '\0';
+        memset(p, 0, sizeof(*p));
+        if (sscanf(line, " %[^: \t\n]:%15s", p->host, p->port) != 2)
+            continue;
+        p->self = !strcmp(p->port, peers.listenPort) && is_local(p->host);
+        self += p->self;
+        for (int i = 0; i < peers.n; i++) {  /* Keep counters across reloads */
+            if (!strcmp(peers.nodes[i].host, p->host) && !strcmp(peers.nodes[i].port, p->port)) {
+                p->forwarded = peers.nodes[i].forwarded;
+                p->failed = peers.nodes[i].failed;
+            }
+        }
+        n++;
+    }
+    fclose(fp);
+    if (self != 1) {
+        fprintf(stderr, "%s must list this proxy (port %s) exactly once\n", peers.file, peers.listenPort);
+        Free(nodes);
+        return -1;
+    }
+    memcpy(peers.nodes, nodes, n * sizeof(peer_node));
+    Free(nodes);
+    peers.n = n;
+    ring_build(time(NULL));
+    return n;
+}
+
+int peer_init(const char *filename, const char *listenPort) {
+    struct stat st;
+
+    pthread_mutex_init(&peers.lock, NULL);
+    snprintf(peers.file, sizeof(peers.file), "%s", filename);
+    snprintf(peers.listenPort, sizeof(peers.listenPort), "%s", listenPort);
+    if (stat(filename, &st) < 0)
+        return -1;
+    peers.mtime = st.st_mtime;
+    peers.checked = time(NULL);
+    return peers_load();
+}
+
+int peer_enabled() {
+    return peers.n > 0;
+}
+
+int peer_owner(const char *key, char *host, char *port) {
+    unsigned long h = mix(cache_hash(key, strlen(key)));
+    time_t now = time(NULL);
+    struct stat st;
+    int lo, hi, owner = -1;
+
+    if (!peer_enabled())
+        return 0;
+    pthread_mutex_lock(&peers.lock);
+    if (now != peers.checked) {  /* At most once a second */
+        peers.checked = now;
+        if (stat(peers.file, &st) == 0 && st.st_mtime != peers.mtime) {
+            peers.mtime = st.st_mtime;
+            peers_load();
+        }
+    }
+    if (peers.nextRetry && now >= peers.nextRetry)
+        ring_build(now);
+
+    /* First point at or after h, wrapping around */
+    lo = 0;
+    hi = peers.points;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (peers.ring[mid].point < h)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    if (peers.points > 0)
+        owner = peers.ring[lo == peers.points ? 0 : lo].node;
+    if (owner >= 0 && !peers.nodes[owner].self) {
+        strcpy(host, peers.nodes[owner].host);
+        strcpy(port, peers.nodes[owner].port);
+        peers.nodes[owner].forwarded++;
+    } else {
+        owner = -1;
+    }
+    pthread_mutex_unlock(&peers.lock);
+    return owner >= 0;
+}
+
+void peer_failed(const char *host, const char *port) {
+    time_t now = time(NULL);
+
+    pthread_mutex_lock(&peers.lock);
+    for (int i = 0; i < peers.n; i++) {
+        peer_node *p = &peers.nodes[i];
+        if (!strcmp(p->host, host) && !strcmp(p->port, port)) {
+            p->failed++;
+            p->downUntil = now + PEER_RETRY;
+            ring_build(now);
+            break;
+        }
+    }
+    pthread_mutex_unlock(&peers.lock);
+}
+
+void peer_served() {
+    __sync_fetch_and_add(&peers.servedForPeers, 1);
+}
+
+void peer_report(FILE *fp) {
+    time_t now = time(NULL);
+
+    if (!peer_enabled())
+        return;
+    pthread_mutex_lock(&peers.lock);
+    for (int i = 0; i < peers.n; i++) {
+        peer_node *p = &peers.nodes[i];
+        fprintf(fp, "peer.node %s:%s%s state=%s forwarded=%ld failed=%ld\n", p->host, p->port,
+                p->self ? " (self)" : "", p->downUntil > now ? "down" : "up", p->forwarded, p->failed);
+    }
+    fprintf(fp, "peer.served_for_peers %ld\n", peers.servedForPeers);
+    pthread_mutex_unlock(&peers.lock);
+}
@@ -0,0 +1,34 @@
+/*
+ * peer.h - consistent-hash ownership of cache keys across sibling proxies
+ */
+#ifndef __PEER_H__
+#define __PEER_H__
+
+#include <stdio.h>
+
+/* Request header marking a request forwarded by a sibling */
+#define PEER_HOP_HDR "X-Proxy-Peer"
+
+/*
+ * Loads the tier from filename, one host:port per line, ourselves among
+ * them (the entry on listenPort naming this host). Returns the number of
+ * nodes, or -1 on error.
+ */
+int peer_init(const char *filename, const char *listenPort);
+int peer_enabled();
+
+/*
+ * If another node owns key, copies its address into host and port (each
+ * at least MAXLINE bytes) and returns 1; returns 0 if we own it.
+ */
+int peer_owner(const char *key, char *host, char *port);
+
+/* Takes a node out of the ring for a while after a failed forward */
+void peer_failed(const char *host, const char *port);
+
+/* Counts a request forwarded to us by a sibling */
+void peer_served();
+
+void peer_report(FILE *fp);
+
+#endif /* __PEER_H__ */
@@ -0,0 +1,255 @@
+/*
+ * prefetch.c - background fetches of subresources linked from HTML pages
+ *
+ * When an HTML page comes back from the origin, the src= attributes and
+ * the href= attributes that point at stylesheets, scripts, images or fonts
+ * name exactly what the browser will ask for next. Same-origin ones are
+ * queued here and fetched into the cache by a few worker threads, so the
+ * follow-up requests hit. The queue is bounded and simply drops links
+ * when full; a token bucket caps the bandwidth prefetching may use.
+ *
+ * Entries fetched this way are marked in the cache (cache_mark_prefetched),
+ * so the report can say how many of them were later asked for by a client
+ * without cache hits looking anything up here.
+ */
+#include "csapp.h"
+#include "cache.h"
+#include "canon.h"
+#include "prefetch.h"
+
+#define PREFETCH_QUEUE 64
+#define PREFETCH_PER_PAGE 32
+
+typedef struct {
+    char hostname[MAXLINE];
+    int port;
+    char path[MAXLINE];
+    char key[MAXLINE];
+} prefetch_job;
+
+static struct {
+    int workers;
+    long rate;                   /* Bytes per second, 0 for no limit */
+    prefetch_fetch_fn fetch;
+
+    prefetch_job queue[PREFETCH_QUEUE];
+    int head, count;
+    pthread_mutex_t lock;        /* Protects the queue, bucket and counts */
+    pthread_cond_t nonempty;
+
+    double tokens;               /* Bytes that may be fetched now */
+    struct timespec refilled;
+
+    long queued, dropped, done, failed, bytes, hits;
+} pf;
+
+static const char *subresource_ext[] = {
+    ".css", ".js", ".png", ".jpg", ".jpeg", ".gif", ".svg", ".ico", ".webp",
+    ".woff", ".woff2", ".ttf", NULL
+};
+
+/* Adds tokens for the time elapsed since the last refill; caller holds the lock */
+static void bucket_refill() {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    pf.tokens += pf.rate * ((now.tv_sec - pf.refilled.tv_sec) + (now.tv_nsec - pf.refilled.tv_nsec) / 1e9);
+    if (pf.tokens > pf.rate)
+        pf.tokens = pf.rate;  /* At most a second's worth of burst */
+    pf.refilled = now;
+}
+
+static void *prefetch_worker(void *vargp) {
+    prefetch_job job;
+    long n;
+
+    Pthread_detach(pthread_self());
+    while (1) {
+        pthread_mutex_lock(&pf.lock);
+        while (pf.count == 0)
+            pthread_cond_wait(&pf.nonempty, &pf.lock);
+        job = pf.queue[pf.head];
+        pf.head = (pf.head + 1) % PREFETCH_QUEUE;
+        pf.count--;
+
+        /* Wait out any debt from earlier fetches */
+        while (pf.rate > 0 && (bucket_refill(), pf.tokens < 0)) {
+            struct timespec ts = { 0, 0 };
+            double wait = -pf.tokens / pf.rate;
+            ts.tv_sec = (time_t)wait;
+            ts.tv_nsec = (long)((wait - ts.tv_sec) * 1e9);
+            pthread_mutex_unlock(&pf.lock);
+            nanosleep(&ts, NULL);
+            pthread_mutex_lock(&pf.lock);
+        }
+        pthread_mutex_unlock(&pf.lock);
+
+        n = pf.fetch(job.hostname, job.port, job.path, job.key);
+
+        pthread_mutex_lock(&pf.lock);
+        if (n < 0) {
+            pf.failed++;
+        } else if (n > 0) {
+            pf.done++;
+            pf.bytes += n;
+            pf.tokens -= n;
+        }
+        pthread_mutex_unlock(&pf.lock);
+        if (n > 0)
+            cache_mark_prefetched(job.key);
+    }
+    return NULL;
+}
+
+void prefetch_init(int workers, long rate, prefetch_fetch_fn fetch) {
+    pthread_t tid;
+
+    pf.workers = workers;
+    pf.rate = rate;
+    pf.fetch = fetch;
+    pf.tokens = rate;
+    clock_gettime(CLOCK_MONOTONIC, &pf.refilled);
+    pthread_mutex_init(&pf.lock, NULL);
+    pthread_cond_init(&pf.nonempty, NULL);
+    for (int i = 0; i < workers; i++)
+        Pthread_create(&tid, NULL, prefetch_worker, NULL);
+}
+
+int prefetch_enabled() {
+    return pf.workers > 0;
+}
+
+static void enqueue(const char *hostname, int port, const char *path, const char *key) {
+    pthread_mutex_lock(&pf.lock);
+    for (int i = 0; i < pf.count; i++) {
+        if (!strcmp(pf.queue[(pf.head + i) % PREFETCH_QUEUE].key, key)) {
+            pthread_mutex_unlock(&pf.lock);
+            return;
+        }
+    }
+    if (pf.count == PREFETCH_QUEUE) {
+        pf.dropped++;
+    } else {
+        prefetch_job *j = &pf.queue[(pf.head + pf.count) % PREFETCH_QUEUE];
+        strcpy(j->hostname, hostname);
+        j->port = port;
+        strcpy(j->path, path);
+        strcpy(j->key, key);
+        pf.count++;
+        pf.queued++;
+        pthread_cond_signal(&pf.nonempty);
+    }
+    pthread_mutex_unlock(&pf.lock);
+}
+
+/* Whether the path part of url ends in a subresource extension */
+static int is_subresource(const char *url) {
+    size_t len = strcspn(url, "?#");
+
+    for (int i = 0; subresource_ext[i]; i++) {
+        size_t n = strlen(subresource_ext[i]);
+        if (len >= n && !strncasecmp(url + len - n, subresource_ext[i], n))
+            return 1;
+    }
+    return 0;
+}
+
+/*
+ * Resolves a link on the page at path into an origin path, or returns 0
+ * if it is not on hostname:port.
+ */
+static int resolve(const char *hostname, int port, const char *path, char *url, char *out) {
+    char host[MAXLINE];
+    int linkPort = 80;
+
+    url[strcspn(url, "#")] = '\0';
+    if (!strncasecmp(url, "http://", 7) || !strncmp(url, "//", 2)) {
+        char *p = url + (url[0] == '/' ? 2 : 7);
+        size_t hostLen = strcspn(p, ":/?");
+
+        if (hostLen == 0 || hostLen >= sizeof(host))
+            return 0;
+        memcpy(host, p, hostLen);
+        host[hostLen] = '\0';
+        p += hostLen;
+        if (*p == ':')
+            linkPort = (int)strtol(p + 1, &p, 10);
+        if (strcasecmp(host, hostname) || linkPort != port)
+            return 0;
+        snprintf(out, MAXLINE, "%s%s", *p == '/' ? "" : "/", p);
+    } else if (url[0] == '/') {
+        snprintf(out, MAXLINE, "%s", url);
+    } else if (url[0] == '\0' || strchr(url, ':')) {
+        return 0;  /* data:, javascript:, https: and the like */
+    } else {
+        size_t dir = strcspn(path, "?");
+        while (dir > 0 && path[dir - 1] != '/')
+            dir--;
+        if (dir + strlen(url) >= MAXLINE)
+            return 0;
+        memcpy(out, path, dir);
+        strcpy(out + dir, url);
+    }
+    return 1;
+}
+
+void prefetch_page(const char *hostname, int port, const char *path, const char *html, size_t len) {
+    char url[MAXLINE], target[MAXLINE], key[MAXLINE];
+    int links = 0;
+
+    if (!prefetch_enabled())
+        return;
+    for (size_t i = 0; i + 5 < len && links < PREFETCH_PER_PAGE; i++) {
+        int href;
+        size_t n = 0;
+        char quote;
+
+        if (!strncasecmp(html + i, "src=", 4))
+            href = 0;
+        else if (!strncasecmp(html + i, "href=", 5))
+            href = 1;
+        else
+            continue;
+        if (i > 0 && !isspace((unsigned char)html[i - 1]))
+            continue;  /* Part of a longer attribute name */
+        i += href ? 5 : 4;
+        quote = i < len ? html[i] : '\0';
+        if (quote == '"' || quote == '\'')
+            i++;
+        else
+            quote = '\0';
+        while (i + n < len && n < sizeof(url) - 1 && html[i + n] != quote &&
+               (quote || (!isspace((unsigned char)html[i + n]) && html[i + n] != '>')))
+            n++;
+        memcpy(url, html + i, n);
+        url[n] = '\0';
+        i += n;
+
+        if ((href && !is_subresource(url)) || !resolve(hostname, port, path, url, target))
+            continue;
+        if (canon_key(key, sizeof(key), hostname, port, target) < 0 || cache_contains(key))
+            continue;
+        enqueue(hostname, port, target, key);
+        links++;
+    }
+}
+
+void prefetch_hit() {
+    pthread_mutex_lock(&pf.lock);
+    pf.hits++;
+    pthread_mutex_unlock(&pf.lock);
+}
+
+void prefetch_report(FILE *fp) {
+    if (!prefetch_enabled())
+        return;
+    pthread_mutex_lock(&pf.lock);
+    fprintf(fp, "prefetch.queued %ld\n", pf.queued);
+    fprintf(fp, "prefetch.dropped %ld\n", pf.dropped);
+    fprintf(fp, "prefetch.fetched %ld\n", pf.done);
+    fprintf(fp, "prefetch.failed %ld\n", pf.failed);
+    fprintf(fp, "prefetch.bytes %ld\n", pf.bytes);
+    fprintf(fp, "prefetch.hits %ld\n", pf.hits);
+    fprintf(fp, "prefetch.hit_ratio %.3f\n", pf.done ? (double)pf.hits / pf.done : 0.0);
+    pthread_mutex_unlock(&pf.lock);
+}
@@ -0,0 +1,33 @@
+/*
+ * prefetch.h - background fetches of subresources linked from HTML pages
+ */
+#ifndef __PREFETCH_H__
+#define __PREFETCH_H__
+
+#include <stdio.h>
+
+/* Largest HTML body the proxy keeps around for scanning */
+#define PREFETCH_SCAN_MAX 65536
+
+/*
+ * Fetches hostname:port/path from the origin into the cache under key.
+ * Returns the bytes received, or -1 on failure.
+ */
+typedef long (*prefetch_fetch_fn)(const char *hostname, int port, const char *path, const char *key);
+
+/*
+ * Starts workers fetching at most that many objects at once and, if rate
+ * is positive, at most rate bytes per second on average.
+ */
+void prefetch_init(int workers, long rate, prefetch_fetch_fn fetch);
+int prefetch_enabled();
+
+/* Queues same-origin subresources linked from an HTML page of len bytes */
+void prefetch_page(const char *hostname, int port, const char *path, const char *html, size_t len);
+
+/* Notes that a client was served an entry a prefetch brought in, see cache_take_prefetched */
+void prefetch_hit();
+
+void prefetch_report(FILE *fp);
+
+#endif /* __PREFETCH_H__ */
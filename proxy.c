@@ -1,14 +1,40 @@
 #include <stdio.h>
+#include <sys/epoll.h>
 #include "csapp.h"
+#include "cache.h"
+#include "canon.h"
+#include "gzip.h"
+#include "mrc.h"
+#include "http.h"
+#include "prefetch.h"
+#include "warm.h"
+#include "peer.h"
+#include "digest.h"
+#include "shmcache.h"
+#include "hparse.h"
+#include "hstream.h"
+#include "hdrhash.h"
+#include "arena.h"
+#include "timer.h"
+#include "fastconn.h"
 
-/* Recommended max cache and object sizes */
-#define MAX_CACHE_SIZE 1024000
-#define MAX_OBJECT_SIZE 102400
-#define LRU_MAGIC_NUMBER 9999
-// Least Recently Used
-// LRU: 가장 오랫동안 참조되지 않은 페이지를 교체하는 기법
+#define STATS_PATH "/proxy-stats"
+#define MRC_SAMPLE_RATE 0.01
+#define PREFETCH_RATE 1000000  // Default prefetch budget, bytes per second
+#define WARM_TOP 1000          // Warm-up defaults: most frequent URLs fetched,
+#define WARM_FRACTION 0.8      // share of MAX_CACHE_SIZE to stop at,
+#define WARM_RATE 500000       // and bytes per second
+#define DIGEST_FALSE_HIT 0.01  // Default sibling digest false-hit rate
+#define THREAD_STACK (512 * 1024)  // Deepest path, doit through a sibling fetch into cache_store, is ~50 KB
+#define PARK_EVENTS 64             // Woken connections taken per epoll_wait
 
-#define CACHE_OBJS_COUNT 10
+/* Connection lifecycle deadlines, each in seconds (0 for none); see -t */
+enum { T_CONNECT, T_HEADER, T_FIRST_BYTE, T_IDLE, T_KEEPALIVE, T_PHASES };
+#define CONNECT_TIMEOUT 10     // To establish the origin connection
+#define HEADER_TIMEOUT 30      // From the request's first byte to its blank line
+#define FIRST_BYTE_TIMEOUT 60  // From sending the request to the response's first byte
+#define IDLE_TIMEOUT 60        // Between body reads from the origin, or a stalled client write
+#define KEEPALIVE_TIMEOUT 15   // An open client connection that has sent nothing
 
 /* User agent header */
 static const char *user_agent_hdr =
@@ -19,282 +45,1114 @@ static const char *endof_hdr = "\r\n";
 static const char *host_hdr_format = "Host: %s\r\n";
 static const char *conn_hdr = "Connection: close\r\n";
 static const char *prox_hdr = "Proxy-Connection: close\r\n";
+static const char *gateway_timeout = "HTTP/1.0 504 Gateway Timeout\r\nContent-Length: 0\r\n\r\n";
+static const char *bad_request = "HTTP/1.0 400 Bad Request\r\nContent-Length: 0\r\n\r\n";
 
-static const char *host_key = "Host";
-static const char *connection_key = "Connection";
-static const char *proxy_connection_key = "Proxy-Connection";
-static const char *user_agent_key = "User-Agent";
+static const char *accept_encoding_key = "Accept-Encoding";
 
-void *thread(void *vargsp);
-void doit(int connfd);
-int parse_uri(char *uri, char *hostname, char *path, int *port);
-void build_http_header(char *http_header, char *hostname, char *path, int port, rio_t *client_rio);
-int connect_endServer(char *hostname, int port, char *http_header);
+/* Request headers that decide how a cached object is served */
+typedef struct {
+    int accept_gzip;  // Accept-Encoding lists gzip
+    int has_range;    // Single byte range, see http_parse_range
+    long range_first;
+    long range_last;
+    const char *if_range;  // Validators, "" if absent
+    const char *if_none_match;
+    const char *if_modified_since;
+    const char *headers;   // Client request head as received, for Vary
+    int from_peer;         // Forwarded by a sibling proxy, see peer.c
+    int only_if_cached;    // Cache-Control: only-if-cached
+} req_info;
 
-// Cache functions
-void cache_init();
-int cache_find(char *url);
-void cache_uri(char *uri, char *buf);
+/* Most slices an upstream request head adds to one per client header */
+#define OWN_SLICES 16
 
-void readerPre(int i);
-void readerAfter(int i);
-void writePre(int i);
-void writeAfter(int i);
+/* An upstream request head, as slices of the client's head and of constant strings */
+typedef struct {
+    struct iovec *iov;  // Room for one per client header plus OWN_SLICES
+    int n;
+    int line;  // Slices taken by the request line
+} hdr_slices;
 
-void cache_LRU(int index);
-int cache_eviction();
+/*
+ * The deadline for whatever one exchange is blocked on. When it passes,
+ * the sockets its phase waits on are shut down, and a fill being streamed
+ * is woken, which ends the blocked call with an error or end of file;
+ * expired then says why.
+ */
+typedef struct {
+    timer t;
+    int phase;           // T_*
+    int client, server;  // Sockets, -1 if none; the server one changes under timer_lock
+    cache_fill *fill;    // Streamed to the client, or NULL; changes under timer_lock
+    int expired;         // Set once the deadline passes
+} deadline;
 
+/*
+ * A client connection being served. Apart from a few words it holds only
+ * an arena: the request head, the strings parsed out of it and the
+ * origin's read buffer are carved from that as needed, sized to the
+ * request, and freed together when it is done.
+ */
 typedef struct {
-    char cache_obj[MAX_OBJECT_SIZE];
-    char cache_url[MAXLINE];
-    int LRU;  // Least recently used
-    int isEmpty; // If block is empty
+    int fd;
+    deadline dl;
+    arena mem;
+    char *head;        // Request head as received, NUL-terminated
+    size_t head_len;
+    hp_request *hreq;  // Offsets into head
+    req_info req;
+} conn;
+
+void serve(int listenfd);
+void *thread(void *vargsp);
+void *park_thread(void *vargp);
+void doit(conn *c);
+void conn_open(conn *c);
+void conn_park(conn *c);
+void conn_wake(conn *c);
+void conn_close(conn *c);
+int parse_uri(char *uri, char *hostname, char *path, int *port);
+int read_head(conn *c);
+void build_http_header(conn *c, hdr_slices *out, char **hostname, char *path, int *port);
+void sibling_request(arena *a, hdr_slices *to, const hdr_slices *from, const char *url, const char *extra);
+void serve_stats(int connfd);
+int serve_cached(int connfd, char *key, req_info *req);
+int serve_segment(int connfd, char *key, req_info *req);
+int serve_range(int connfd, cache_obj *obj, long start, long total, long first, long last);
+int write_gzip_head(int connfd, char *head, size_t len, size_t bodylen, const char *etag);
+int write_not_modified(int connfd, char *head, size_t len, const char *etag);
+int client_write(int connfd, const void *buf, size_t n);
+long fetch_to_cache(const char *hostname, int port, const char *path, const char *key);
+long fetch_request(const char *host, const char *port, struct iovec *request, int slices, const char *key,
+                   const char *req_headers, int only_ok);
+int connect_origin(deadline *d, const char *host, const char *port);
+void deadline_init(deadline *d, int client);
+void deadline_set(deadline *d, int phase);
+void deadline_server(deadline *d, int fd);
+void deadline_fill(deadline *d, cache_fill *fill);
+int stream_go_on(void *arg);
+void deadline_clear(deadline *d);
 
-    int readCnt;  // Count of readers
-    sem_t wmutex;  // Protects access to cache
-    sem_t rdcntmutex;  // Protects access to readCnt
-} cache_block;
+/* Components each proxy process starts for itself, from the options */
+static struct {
+    int prefetchers;
+    long prefetch_rate;
+    char warm_file[MAXLINE];
+    int warm_top;
+    double warm_fraction;
+    char digest_file[MAXLINE];
+    double digest_rate;
+    int timeouts[T_PHASES];
+} opts = { 0, PREFETCH_RATE, "", WARM_TOP, WARM_FRACTION, "", DIGEST_FALSE_HIT,
+           { CONNECT_TIMEOUT, HEADER_TIMEOUT, FIRST_BYTE_TIMEOUT, IDLE_TIMEOUT, KEEPALIVE_TIMEOUT } };
 
-typedef struct {
-    cache_block cacheobjs[CACHE_OBJS_COUNT];  // Ten cache blocks
-    int cache_num;
-} Cache;
+static const char *phase_names[T_PHASES] = { "connect", "header", "first_byte", "idle", "keepalive" };
+static long timeouts[T_PHASES];  // Deadlines that passed, by phase
 
-Cache cache;
+static long not_modified;        // 304s answered from the cache
+static long not_modified_bytes;  // Body bytes those did not send
+
+static int park_fd;                // epoll set of connections waiting to send their request
+static pthread_attr_t thread_attr;  // Of connection threads
+
+/* Connection memory, for /proxy-stats */
+static struct {
+    long active;     // Connections open, parked ones included
+    long parked;     // Waiting without a thread
+    long served;
+    long held;       // Arena bytes the active ones hold
+    long peak_sum;   // Of each served connection's arena peak
+    long peak_max;
+} conns;
 
 int main(int argc, char **argv) {
-    int listenfd, *connfdp;
+    int listenfd, opt, workers = 0;
+    char peer_file[MAXLINE] = "";
+
+    Signal(SIGPIPE, SIG_IGN);  // A vanished client must not kill the proxy
+    cache_init();
+    mrc_init(MRC_SAMPLE_RATE);
+
+    while ((opt = getopt(argc, argv, "d:f:m:p:P:r:s:t:w:z")) != -1) {
+        switch (opt) {
+        case 'd':
+            sscanf(optarg, "%[^,],%lf", opts.digest_file, &opts.digest_rate);
+            break;
+        case 'f':
+            sscanf(optarg, "%d,%ld", &opts.prefetchers, &opts.prefetch_rate);
+            break;
+        case 'm':
+            mrc_init(atof(optarg));
+            break;
+        case 'p':
+            if (cache_load_partitions(optarg) < 0) {
+                fprintf(stderr, "cannot load partitions from %s\n", optarg);
+                exit(1);
+            }
+            break;
+        case 'P':
+            workers = atoi(optarg);
+            break;
+        case 's':
+            snprintf(peer_file, sizeof(peer_file), "%s", optarg);
+            break;
+        case 't':
+            sscanf(optarg, "%d,%d,%d,%d,%d", &opts.timeouts[T_CONNECT], &opts.timeouts[T_HEADER],
+                   &opts.timeouts[T_FIRST_BYTE], &opts.timeouts[T_IDLE], &opts.timeouts[T_KEEPALIVE]);
+            break;
+        case 'w':
+            sscanf(optarg, "%[^,],%d,%lf", opts.warm_file, &opts.warm_top, &opts.warm_fraction);
+            break;
+        case 'z':
+            cache_set_compression(1);
+            break;
+        case 'r':
+            if (canon_load_rules(optarg) < 0) {
+                fprintf(stderr, "cannot read rules file %s\n", optarg);
+                exit(1);
+            }
+            break;
+        default:
+            argc = 0;  // Force the usage message
+        }
+    }
+    if (argc - optind != 1) {
+        fprintf(stderr, "usage: %s [-d siblings[,false-hit rate]] [-f workers[,bytes/s]] [-m rate] [-p partitions]\n"
+                "       [-P processes] [-r rules] [-s peers] [-t connect[,header[,first byte[,idle[,keep-alive]]]]]\n"
+                "       [-w urls[,top[,fraction]]] [-z] <port>\n", argv[0]);
+        exit(1);
+    }
+
+    if (peer_file[0] && peer_init(peer_file, argv[optind]) < 0) {
+        fprintf(stderr, "cannot load peers from %s\n", peer_file);
+        exit(1);
+    }
+
+    listenfd = Open_listenfd(argv[optind]);
+    if (workers <= 0)
+        serve(listenfd);
+
+    /*
+     * Prefork: worker processes accept on the shared socket and share the
+     * cache tier in shmcache.c. One that crashes is replaced; one that
+     * exits on its own (bad configuration) is not.
+     */
+    if (shm_cache_init(MAX_CACHE_SIZE) < 0) {
+        fprintf(stderr, "cannot map the shared cache\n");
+        exit(1);
+    }
+    pid_t *pids = Calloc(workers, sizeof(pid_t));
+    int alive = 0;
+    for (int i = 0; i < workers; i++, alive++) {
+        if ((pids[i] = Fork()) == 0)
+            serve(listenfd);
+    }
+    while (alive > 0) {
+        int status;
+        pid_t pid = Wait(&status);
+        for (int i = 0; i < workers; i++) {
+            if (pids[i] != pid)
+                continue;
+            if (WIFSIGNALED(status)) {
+                fprintf(stderr, "worker %d died (signal %d), restarting\n", (int)pid, WTERMSIG(status));
+                if ((pids[i] = Fork()) == 0)
+                    serve(listenfd);
+            } else {
+                alive--;
+            }
+        }
+    }
+    return 0;
+}
+
+/*
+ * Runs one proxy process: background components and the accept loop,
+ * which parks each new connection until its request arrives and then
+ * gives it a thread. Under -P warm-up runs once, in whichever process
+ * claims it in the shared segment, so a restarted worker does not repeat it.
+ */
+void serve(int listenfd) {
     socklen_t clientlen;
     char hostname[MAXLINE], port[MAXLINE];
     pthread_t tid;
     struct sockaddr_storage clientaddr;
+    conn *c;
 
-    cache_init();
-
-    if (argc != 2) {
-        fprintf(stderr, "usage: %s <port>\n", argv[0]);
+    if (opts.digest_file[0] && digest_init(opts.digest_file, opts.digest_rate, opts.timeouts[T_CONNECT] * 1000,
+                                           opts.timeouts[T_IDLE] * 1000) < 0) {
+        fprintf(stderr, "cannot load siblings from %s\n", opts.digest_file);
         exit(1);
     }
 
-    listenfd = Open_listenfd(argv[1]);
+    timer_start();
+    if (opts.prefetchers > 0)
+        prefetch_init(opts.prefetchers, opts.prefetch_rate, fetch_to_cache);
+    if (opts.warm_file[0] && (!shm_cache_enabled() || shm_claim_warm()) &&
+        warm_start(opts.warm_file, opts.warm_top, opts.warm_fraction, WARM_RATE, fetch_to_cache) < 0)
+        fprintf(stderr, "cannot read warm-up list %s\n", opts.warm_file);
+
+    /* A thread per connection with a request; their front caches (see cache.c) outlive them */
+    pthread_attr_init(&thread_attr);
+    pthread_attr_setstacksize(&thread_attr, THREAD_STACK);  // Connection state is in its arena, not here
+    if ((park_fd = epoll_create1(EPOLL_CLOEXEC)) < 0)
+        unix_error("epoll_create1 error");
+    Pthread_create(&tid, NULL, park_thread, NULL);
     while (1) {
         clientlen = sizeof(clientaddr);
-        connfdp = Malloc(sizeof(int));
-        *connfdp = Accept(listenfd, (SA *)&clientaddr, &clientlen);
+        c = Calloc(1, sizeof(conn));
+        c->fd = Accept(listenfd, (SA *)&clientaddr, &clientlen);
 
         Getnameinfo((SA *)&clientaddr, clientlen, hostname, MAXLINE, port, MAXLINE, 0);
         printf("Accepted connection from (%s %s).\n", hostname, port);
 
-        Pthread_create(&tid, NULL, thread, connfdp);
+        conn_open(c);
+        conn_park(c);
     }
-    return 0;
 }
 
 void *thread(void *vargp) {
-    int connfd = *((int*)vargp);
+    conn *c = vargp;
+
+    Pthread_detach(pthread_self());
+    doit(c);
+    conn_close(c);
+    Free(c);
+    cache_thread_done();
+    return NULL;
+}
+
+/*
+ * Parks a connection that has not sent anything yet. Until it does it
+ * holds no thread and no arena memory, only its conn and the keep-alive
+ * deadline; expiry shuts the socket down, which wakes it to be closed.
+ */
+void conn_park(conn *c) {
+    struct epoll_event ev = { .events = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT, .data.ptr = c };
+
+    __sync_fetch_and_add(&conns.parked, 1);
+    deadline_set(&c->dl, T_KEEPALIVE);
+    if (epoll_ctl(park_fd, EPOLL_CTL_ADD, c->fd, &ev) < 0)
+        conn_wake(c);  // Cannot wait for it; serve it now
+}
+
+/* Gives a parked connection a thread to be served on */
+void conn_wake(conn *c) {
+    pthread_t tid;
+
+    __sync_fetch_and_sub(&conns.parked, 1);
+    Pthread_create(&tid, &thread_attr, thread, c);
+}
+
+/* Wakes parked connections as they become readable, or are shut down */
+void *park_thread(void *vargp) {
+    struct epoll_event ev[PARK_EVENTS];
+    int n;
+
     Pthread_detach(pthread_self());
-    Free(vargp);
-    doit(connfd);
-    Close(connfd);
+    while (1) {
+        if ((n = epoll_wait(park_fd, ev, PARK_EVENTS, -1)) < 0) {
+            if (errno != EINTR)
+                unix_error("epoll_wait error");
+            continue;
+        }
+        for (int i = 0; i < n; i++) {
+            conn *c = ev[i].data.ptr;
+            epoll_ctl(park_fd, EPOLL_CTL_DEL, c->fd, NULL);
+            conn_wake(c);
+        }
+    }
     return NULL;
 }
 
-void doit(int connfd) {
-    int end_serverfd;
+void conn_open(conn *c) {
+    deadline_init(&c->dl, c->fd);
+    arena_init(&c->mem, &conns.held);
+    __sync_fetch_and_add(&conns.active, 1);
+}
+
+/* Closes the client connection and frees its arena, recording its peak use */
+void conn_close(conn *c) {
+    long peak = c->mem.peak, max;
+
+    deadline_clear(&c->dl);
+    Close(c->fd);
+    arena_free(&c->mem);
+    __sync_fetch_and_sub(&conns.active, 1);
+    __sync_fetch_and_add(&conns.served, 1);
+    __sync_fetch_and_add(&conns.peak_sum, peak);
+    while (peak > (max = conns.peak_max) && !__sync_bool_compare_and_swap(&conns.peak_max, max, peak))
+        ;
+}
+
+/* What the relay in doit keeps from the origin's response as it streams by */
+typedef struct {
+    http_meta meta;    // For the cache and the log
+    cache_fill *fill;  // Gets meta once the head is in
+    char *html;        // A successful HTML page, for the prefetcher to scan for links
+    size_t html_len;
+} relay_info;
+
+static int relay_start(hs_parser *p, const char *a, size_t alen, const char *b, size_t blen,
+                       const char *c, size_t clen) {
+    relay_info *r = p->arg;
+
+    http_meta_init(&r->meta);
+    r->meta.status = p->status;
+    return 0;
+}
+
+static int relay_header(hs_parser *p, const char *name, size_t nlen, const char *value, size_t vlen) {
+    relay_info *r = p->arg;
+
+    http_meta_header(&r->meta, name, nlen, value, vlen);
+    if (!r->html && p->status == 200 && prefetch_enabled() && hdr_lookup(name, nlen) == HDR_CONTENT_TYPE &&
+        vlen >= 9 && !strncasecmp(value, "text/html", 9))
+        r->html = Malloc(PREFETCH_SCAN_MAX);
+    return 0;
+}
+
+static int relay_headers_done(hs_parser *p) {
+    relay_info *r = p->arg;
+
+    if (r->fill)
+        cache_fill_head(r->fill, &r->meta, p->head_len);
+    return 0;
+}
+
+static int relay_body(hs_parser *p, const char *data, size_t len) {
+    relay_info *r = p->arg;
+
+    if (r->html && r->html_len < PREFETCH_SCAN_MAX) {
+        if (len > PREFETCH_SCAN_MAX - r->html_len)
+            len = PREFETCH_SCAN_MAX - r->html_len;
+        memcpy(r->html + r->html_len, data, len);
+        r->html_len += len;
+    }
+    return 0;
+}
+
+static const hs_callbacks relay_callbacks = { relay_start, relay_header, relay_headers_done, relay_body, NULL };
 
-    char buf[MAXLINE], method[MAXLINE], uri[MAXLINE], version[MAXLINE];
-    char endserver_http_header[MAXLINE];
-    char hostname[MAXLINE], path[MAXLINE];
+void doit(conn *c) {
+    int connfd = c->fd, end_serverfd;
+    char *uri, *hostname, *path;
+    hdr_slices upstream;
     int port;
-  
-    rio_t rio, server_rio;
+    req_info *req = &c->req;
+    rio_t *server_rio;
 
-    Rio_readinitb(&rio, connfd);
-    Rio_readlineb(&rio, buf, MAXLINE);
-    sscanf(buf, "%s %s %s", method, uri, version);
+    if (read_head(c) <= 0 || c->hreq->target.len >= MAXLINE)
+        return;
 
-    if (strcasecmp(method, "GET")) {
+    if (!hp_span_is(c->head, c->hreq->method, "GET")) {
         printf("Proxy does not implement the method");
         return;
     }
-  
-    char url_store[100];
-    strcpy(url_store, uri);
+    uri = arena_strndup(&c->mem, HP_AT(c->head, c->hreq->target), c->hreq->target.len);
 
-    int cache_index;
-    if ((cache_index = cache_find(url_store)) != -1) {
-        readerPre(cache_index);
-        Rio_writen(connfd, cache.cacheobjs[cache_index].cache_obj, strlen(cache.cacheobjs[cache_index].cache_obj));
-        readerAfter(cache_index);
+    /* Answers from here to the origin fetch are writes only; a client that stops reading is cut off */
+    deadline_set(&c->dl, T_IDLE);
+    if (!strcmp(uri, STATS_PATH)) {
+        serve_stats(connfd);
+        return;
+    }
+    if (!strcmp(uri, DIGEST_PATH)) {
+        digest_serve(connfd);
         return;
     }
 
+    hostname = arena_alloc(&c->mem, c->hreq->target.len + 1);
+    path = arena_alloc(&c->mem, c->hreq->target.len + 2);  // "/" for an empty one
     parse_uri(uri, hostname, path, &port);
 
-    build_http_header(endserver_http_header, hostname, path, port, &rio);
+    build_http_header(c, &upstream, &hostname, path, &port);
 
-    end_serverfd = connect_endServer(hostname, port, endserver_http_header);
-    if (end_serverfd < 0) {
-        printf("connection failed\n");
+    /* The canonical URL adds at most a scheme and port; a Vary suffix adds names and values from the head */
+    size_t url_size = strlen(hostname) + strlen(path) + 16;
+    size_t key_size = url_size + c->head_len + 256 < MAXLINE ? url_size + c->head_len + 256 : MAXLINE;
+    char *url = arena_alloc(&c->mem, url_size), *cache_key = arena_alloc(&c->mem, key_size);
+    *url = '\0';
+    int cacheable = canon_key(url, url_size, hostname, port, path) >= 0 && strlen(url) < key_size;
+    strcpy(cache_key, cacheable ? url : "");
+    cacheable = cacheable && cache_variant_key(cache_key, key_size, req->headers) >= 0;
+
+    if (cacheable && serve_cached(connfd, cache_key, req))
+        return;
+    if (cacheable && req->has_range && serve_segment(connfd, cache_key, req))
         return;
+
+    /* Someone may be fetching it right now; stream along with them */
+    cache_fill *fill = NULL;
+    if (cacheable && !req->has_range && (fill = cache_fill_attach(cache_key)) != NULL) {
+        deadline_fill(&c->dl, fill);
+        long sent = cache_fill_stream(fill, connfd, stream_go_on, &c->dl);
+        deadline_fill(&c->dl, NULL);
+        cache_fill_release(fill);
+        if (sent != -1)  // Anything but an abort before the first byte
+            return;
     }
 
-    Rio_readinitb(&server_rio, end_serverfd);
+    /* A sibling asking whether we have it; we do not */
+    if (req->only_if_cached) {
+        client_write(connfd, gateway_timeout, strlen(gateway_timeout));
+        return;
+    }
+    deadline_clear(&c->dl);
 
-    Rio_writen(end_serverfd, endserver_http_header, strlen(endserver_http_header));
+    /* In a peer tier, misses on keys another node owns go to that node, which caches them */
+    char *owner_host = NULL, *owner_port = NULL;
+    if (peer_enabled() || digest_enabled()) {  // Each is filled as a MAXLINE buffer
+        owner_host = arena_alloc(&c->mem, MAXLINE);
+        owner_port = arena_alloc(&c->mem, MAXLINE);
+    }
+    int via_peer = cacheable && !req->from_peer && peer_owner(url, owner_host, owner_port);
+    if (req->from_peer)
+        peer_served();
+    if (via_peer && (end_serverfd = connect_origin(&c->dl, owner_host, owner_port)) < 0) {
+        peer_failed(owner_host, owner_port);
+        via_peer = 0;
+    }
+    /* A sibling whose digest has the key probably holds a copy; take one before trying the origin */
+    hdr_slices sibling;
+    if (cacheable && !via_peer && !req->from_peer && !req->has_range &&
+        digest_lookup(cache_key, owner_host, owner_port)) {
+        sibling_request(&c->mem, &sibling, &upstream, url, "Cache-Control: only-if-cached\r\n");
+        long got = fetch_request(owner_host, owner_port, sibling.iov, sibling.n, cache_key, req->headers, 1);
+        if (got != 0)  // 0: someone here is already fetching it
+            digest_result(owner_host, owner_port, got > 0);
+        deadline_set(&c->dl, T_IDLE);
+        if (got > 0 && serve_cached(connfd, cache_key, req))
+            return;
+        deadline_clear(&c->dl);
+    }
 
-    char cachebuf[MAX_OBJECT_SIZE];
-    int sizebuf = 0;
-    size_t n;
-    while ((n = Rio_readlineb(&server_rio, buf, MAXLINE)) != 0) {
-        sizebuf += n;
-        if (sizebuf < MAX_OBJECT_SIZE)
-            strcat(cachebuf, buf);
-        Rio_writen(connfd, buf, n);
+    char port_str[16];
+    sprintf(port_str, "%d", port);
+    if (!via_peer) {
+        end_serverfd = connect_origin(&c->dl, hostname, port_str);
+        if (end_serverfd < 0) {
+            printf("connection failed%s\n", c->dl.expired ? ": timed out" : "");
+            if (c->dl.expired)
+                rio_writen(connfd, (void *)gateway_timeout, strlen(gateway_timeout));
+            return;
+        }
     }
-    Close(end_serverfd);
 
-    if (sizebuf < MAX_OBJECT_SIZE)
-        cache_uri(url_store, cachebuf);
-}
+    server_rio = arena_alloc(&c->mem, sizeof(rio_t));
+    Rio_readinitb(server_rio, end_serverfd);
+
+    deadline_set(&c->dl, T_FIRST_BYTE);
+    if (via_peer) {
+        sibling_request(&c->mem, &sibling, &upstream, url, "");
+        rio_writev(end_serverfd, sibling.iov, sibling.n);
+    } else {
+        rio_writev(end_serverfd, upstream.iov, upstream.n);
+    }
 
-void build_http_header(char *http_header, char *hostname, char *path, int port, rio_t *client_rio) {
-    char buf[MAXLINE], request_hdr[MAXLINE], other_hdr[MAXLINE], host_hdr[MAXLINE];
-  
-    sprintf(request_hdr, requestline_hdr_format, path);
+    /*
+     * Publish the response as it arrives. If our own client goes away the
+     * fill keeps going for the readers attached to it.
+     */
+    fill = cacheable && !req->has_range && !via_peer ? cache_fill_start(cache_key, req->headers) : NULL;
 
-    while (Rio_readlineb(client_rio, buf, MAXLINE) > 0) {
-        if (strcmp(buf, endof_hdr) == 0)
-            break;
-        
-        if (!strncasecmp(buf, host_key, strlen(host_key))) {
-            strcpy(host_hdr, buf);
-            continue;
+    /* Range responses are not shared while in flight; keep them to cache at the end */
+    char *range_buf = cacheable && req->has_range && !via_peer ? Malloc(MAX_OBJECT_SIZE) : NULL;
+    size_t range_len = 0;
+
+    /* The response is parsed as it streams by; see relay_callbacks */
+    relay_info relay = { .fill = fill };
+    hs_parser resp;
+    hs_init(&resp, HS_RESPONSE, &relay_callbacks, &relay, NULL);
+
+    int client_ok = 1, parsing = 1;
+    ssize_t n, used;
+    char *data;
+    while ((n = rio_peekb(server_rio, &data)) > 0) {
+        deadline_set(&c->dl, T_IDLE);  // Restarted by every read
+        used = n;
+        if (parsing && (used = hs_feed(&resp, data, n)) < 0) {
+            parsing = 0;  // Relay the rest blind, but it is not complete enough to keep
+            used = n;
         }
+        rio_consumeb(server_rio, used);  // Relayed from server_rio's buffer in place
+        if (fill)
+            cache_fill_append(fill, data, used);
+        if (range_buf && range_len + used <= MAX_OBJECT_SIZE)
+            memcpy(range_buf + range_len, data, used);
+        range_len += used;
+        if (client_ok && rio_writen(connfd, data, used) < 0) {
+            client_ok = 0;
+            if (!fill)
+                break;
+        }
+        if (parsing && hs_done(&resp))
+            break;
+    }
+    deadline_clear(&c->dl);
+    int complete = parsing && !c->dl.expired && (hs_done(&resp) || (n == 0 && hs_finish(&resp) == 0));
+    hs_free(&resp);
+    deadline_server(&c->dl, -1);
+    Close(end_serverfd);
+    if (c->dl.expired && range_len == 0)  // Nothing sent yet
+        rio_writen(connfd, (void *)gateway_timeout, strlen(gateway_timeout));
+    else if (range_len == 0)  // Refused after connecting, perhaps a stale address or Fast Open
+        fc_failed(via_peer ? owner_host : hostname, via_peer ? owner_port : port_str);
+    printf("%s -> %d, %zu bytes%s%s%s\n", url, relay.meta.status, range_len,
+           complete ? "" : ", incomplete", c->dl.expired ? ", timed out" : "",
+           http_meta_cacheable(&relay.meta, req->headers) ? "" : ", not cacheable");
 
-        if (!strncasecmp(buf, connection_key, strlen(connection_key)) &&
-            !strncasecmp(buf, proxy_connection_key, strlen(proxy_connection_key)) &&
-            !strncasecmp(buf, user_agent_key, strlen(user_agent_key))) {
-            strcat(other_hdr, buf);
+    if (fill)
+        cache_fill_end(fill, complete);
+    if (relay.html) {
+        if (complete)
+            prefetch_page(hostname, port, path, relay.html, relay.html_len);
+        Free(relay.html);
+    }
+    if (range_buf) {
+        if (complete && range_len <= MAX_OBJECT_SIZE) {
+            if (relay.meta.status == 206)
+                cache_segment_uri(cache_key, req->headers, &relay.meta, range_buf, range_len);
+            else if (relay.meta.status == 200)  // Origin ignored the range or If-Range failed
+                cache_store(cache_key, req->headers, &relay.meta, range_buf, range_len);
         }
+        Free(range_buf);
     }
-    if (strlen(host_hdr) == 0)
-        sprintf(host_hdr, host_hdr_format, hostname);
+}
 
-    sprintf(http_header, "%s%s%s%s%s%s%s",
-            request_hdr,
-            host_hdr,
-            conn_hdr,
-            prox_hdr,
-            user_agent_hdr,
-            other_hdr,
-            endof_hdr);
+void serve_stats(int connfd) {
+    char hdr[MAXLINE], *text;
+    size_t len;
+    FILE *fp = open_memstream(&text, &len);
+
+    fprintf(fp, "proxy.pid %d\n", (int)getpid());
+    cache_report(fp);
+    shm_cache_report(fp);
+    mrc_report(fp, MAX_CACHE_SIZE);
+    prefetch_report(fp);
+    warm_report(fp);
+    peer_report(fp);
+    digest_report(fp);
+    fprintf(fp, "proxy.not_modified %ld\n", not_modified);
+    fprintf(fp, "proxy.not_modified_saved_bytes %ld\n", not_modified_bytes);
+    fprintf(fp, "proxy.conn_struct_bytes %zu\n", sizeof(conn));
+    fprintf(fp, "proxy.conn_active %ld\n", conns.active);
+    fprintf(fp, "proxy.conn_parked %ld\n", conns.parked);
+    fprintf(fp, "proxy.conn_arena_bytes %ld\n", conns.held);
+    fprintf(fp, "proxy.conn_served %ld\n", conns.served);
+    fprintf(fp, "proxy.conn_peak_mean_bytes %ld\n", conns.served ? conns.peak_sum / conns.served : 0);
+    fprintf(fp, "proxy.conn_peak_max_bytes %ld\n", conns.peak_max);
+    fprintf(fp, "proxy.thread_stack_bytes %d\n", THREAD_STACK);
+    for (int i = 0; i < T_PHASES; i++)
+        fprintf(fp, "proxy.timeouts_%s %ld\n", phase_names[i], timeouts[i]);
+    timer_report(fp);
+    fc_report(fp);
+    fclose(fp);
+
+    sprintf(hdr, "HTTP/1.0 200 OK\r\nContent-Type: text/plain\r\nContent-Length: %zu\r\n\r\n", len);
+    if (client_write(connfd, hdr, strlen(hdr)) == 0)
+        client_write(connfd, text, len);
+    free(text);
 }
 
-int connect_endServer(char *hostname, int port, char *http_header) {
-    char portStr[100];
-    sprintf(portStr, "%d", port);
-    return Open_clientfd(hostname, portStr);
+/*
+ * Sends the cached response for key. A gzip-stored body goes out as is to
+ * clients that accept gzip, tagged with the stored ETag plus "-gzip", and
+ * is inflated on the fly for everyone else. A client whose validators
+ * match the representation it would get gets 304 and no body. A byte
+ * range of a 200 response is answered from the identity body with 206 (or
+ * 416) unless If-Range says the client's copy is stale.
+ */
+int serve_cached(int connfd, char *key, req_info *req) {
+    cache_obj obj;
+    http_meta gz;
+    int rc = 0;
+
+    if (!cache_lookup(key, &obj))
+        return 0;
+
+    const http_meta *meta = obj.head->meta, *rep = meta;
+    int ok = meta->status == 200, gzip_out = obj.gzip && req->accept_gzip;
+
+    if (gzip_out) {
+        gz = *meta;
+        if (http_etag_suffix(meta->etag, "-gzip", gz.etag, sizeof(gz.etag)) < 0)
+            gz.etag[0] = '\0';  // Better no tag than the identity one
+        rep = &gz;
+    }
+    if (ok && http_not_modified(rep, req->if_none_match, req->if_modified_since)) {
+        rc = write_not_modified(connfd, obj.head->data, obj.head->size, gzip_out ? rep->etag : NULL);
+        __sync_fetch_and_add(&not_modified, 1);
+        __sync_fetch_and_add(&not_modified_bytes, obj.body->size);
+    } else if (ok && req->has_range && http_if_range_match(meta, req->if_range)) {
+        long total = obj.gzip ? gzip_inflated_size(obj.body->data, obj.body->size) : obj.body->size;
+        long first = req->range_first, last = req->range_last;
+        char hdr[MAXLINE];
+
+        if (http_range_resolve(&first, &last, total)) {
+            rc = serve_range(connfd, &obj, 0, total, first, last);
+        } else {
+            sprintf(hdr, "HTTP/1.0 416 Range Not Satisfiable\r\nContent-Range: bytes */%ld\r\n"
+                    "Content-Length: 0\r\n\r\n", total);
+            rc = client_write(connfd, hdr, strlen(hdr));
+        }
+    } else if (gzip_out) {
+        if ((rc = write_gzip_head(connfd, obj.head->data, obj.head->size, obj.body->size, rep->etag)) == 0)
+            rc = client_write(connfd, obj.body->data, obj.body->size);
+    } else if ((rc = client_write(connfd, obj.head->data, obj.head->size)) == 0) {
+        if (!obj.gzip)
+            rc = client_write(connfd, obj.body->data, obj.body->size);
+        else if ((rc = gzip_inflate_to_fd(connfd, obj.body->data, obj.body->size)) < 0)
+            printf("cannot inflate cached body of %s\n", key);
+    }
+    if (rc < 0)
+        printf("client left during cached %s\n", key);
+    if (cache_take_prefetched(&obj))
+        prefetch_hit();
+    cache_release(&obj);
+    return 1;  // Served, or the client is gone: either way this connection is done
+}
+
+/* Sends a range of the object from a cached segment of it */
+int serve_segment(int connfd, char *key, req_info *req) {
+    long first = req->range_first, last = req->range_last, start, total;
+    cache_obj obj;
+
+    if (!cache_segment_lookup(key, &first, &last, &obj, &start, &total))
+        return 0;
+    if (!http_if_range_match(obj.head->meta, req->if_range)) {
+        cache_release(&obj);
+        return 0;
+    }
+    serve_range(connfd, &obj, start, total, first, last);  // A failed write just ends the connection
+    cache_release(&obj);
+    return 1;
 }
 
-void cache_init() {
-    cache.cache_num = 0;
-    for (int i = 0; i < CACHE_OBJS_COUNT; i++) {
-        cache.cacheobjs[i].LRU = 0;
-        cache.cacheobjs[i].isEmpty = 1;
-        cache.cacheobjs[i].readCnt = 0;
-        Sem_init(&cache.cacheobjs[i].wmutex, 0, 1);
-        Sem_init(&cache.cacheobjs[i].rdcntmutex, 0, 1);
+/*
+ * Sends bytes first-last of an object of total bytes as a 206 response.
+ * The body of obj holds the object from offset start, gzip-encoded if
+ * obj->gzip.
+ */
+int serve_range(int connfd, cache_obj *obj, long start, long total, long first, long last) {
+    static const char *drop[] = { "Content-Length", "Content-Range", NULL };
+    char extra[MAXLINE], *head;
+    size_t len, count = last - first + 1;
+    int rc;
+
+    sprintf(extra, "Content-Range: bytes %ld-%ld/%ld\r\nContent-Length: %zu\r\n", first, last, total, count);
+    len = http_rewrite_head(obj->head->data, obj->head->size, "HTTP/1.0 206 Partial Content", drop, extra, &head);
+    rc = client_write(connfd, head, len);
+    free(head);
+    if (rc < 0)
+        return -1;
+
+    if (!obj->gzip)
+        return client_write(connfd, obj->body->data + (first - start), count);
+    if (gzip_inflate_range_to_fd(connfd, obj->body->data, obj->body->size, first, count) < 0) {
+        printf("cannot inflate cached body range\n");
+        return -1;
     }
+    return 0;
+}
+
+/*
+ * Writes a 304 for the stored head, keeping its validators and caching
+ * headers; etag, if not NULL, replaces its ETag ("" for none).
+ */
+int write_not_modified(int connfd, char *head, size_t len, const char *etag) {
+    static const char *drop[] = { "ETag", "Content-Length", "Content-Type", "Content-Encoding", "Content-Range",
+                                  "Transfer-Encoding", NULL };
+    char extra[160], *buf;
+    int rc;
+
+    if (etag && etag[0])
+        snprintf(extra, sizeof(extra), "ETag: %s\r\n", etag);
+    len = http_rewrite_head(head, len, "HTTP/1.0 304 Not Modified", etag ? drop : drop + 1,
+                            etag && etag[0] ? extra : NULL, &buf);
+    rc = client_write(connfd, buf, len);
+    free(buf);
+    return rc;
 }
 
-void readerPre(int i) {
-    P(&cache.cacheobjs[i].rdcntmutex);
-    cache.cacheobjs[i].readCnt++;
-    if (cache.cacheobjs[i].readCnt == 1)
-        P(&cache.cacheobjs[i].wmutex);
-    V(&cache.cacheobjs[i].rdcntmutex);
+/*
+ * Writes the stored response head with its Content-Length replaced by the
+ * gzip-encoded length and its ETag by etag ("" for none).
+ */
+int write_gzip_head(int connfd, char *head, size_t len, size_t bodylen, const char *etag) {
+    static const char *drop[] = { "Content-Length", "ETag", NULL };
+    char extra[MAXLINE], *buf;
+    int rc;
+
+    sprintf(extra, "Content-Encoding: gzip\r\nContent-Length: %zu\r\nVary: %s\r\n",
+            bodylen, accept_encoding_key);
+    if (etag[0])
+        sprintf(extra + strlen(extra), "ETag: %s\r\n", etag);
+    len = http_rewrite_head(head, len, NULL, drop, extra, &buf);
+    rc = client_write(connfd, buf, len);
+    free(buf);
+    return rc;
 }
 
-void readerAfter(int i) {
-    P(&cache.cacheobjs[i].rdcntmutex);
-    cache.cacheobjs[i].readCnt--;
-    if (cache.cacheobjs[i].readCnt == 0)
-        V(&cache.cacheobjs[i].wmutex);
-    V(&cache.cacheobjs[i].rdcntmutex);
+/*
+ * Writes n bytes to the client. Returns 0, or -1 if the client has gone,
+ * which only ends this connection (Rio_writen would exit the proxy).
+ */
+int client_write(int connfd, const void *buf, size_t n) {
+    return rio_writen(connfd, (void *)buf, n) == (ssize_t)n ? 0 : -1;
 }
 
-int cache_find(char *url) {
-    for (int i = 0; i < CACHE_OBJS_COUNT; i++) {
-        readerPre(i);
-        if (cache.cacheobjs[i].isEmpty == 0 && strcmp(url, cache.cacheobjs[i].cache_url) == 0) {
-            readerAfter(i);
-            return i;
+/*
+ * Reads the client's request head into c->head, in an arena buffer that
+ * starts small and doubles up to HP_MAX_HEAD, and parses it into c->hreq.
+ * The connection has been parked under the keep-alive timeout until its
+ * first byte (see conn_park); the header timeout runs until the blank
+ * line. Returns the head length, or 0 if the client closed, timed out or
+ * sent a malformed or oversized head.
+ */
+int read_head(conn *c) {
+    size_t size = 1024, len = 0;
+    char *buf = arena_alloc(&c->mem, size);
+    long head_len = 0;
+    ssize_t n;
+
+    c->hreq = arena_alloc(&c->mem, sizeof(hp_request));
+    deadline_set(&c->dl, T_HEADER);  // Takes the wheel's lock, so expired is current
+    if (c->dl.expired)  // Woken by the keep-alive deadline
+        return 0;
+    while ((n = read(c->fd, buf + len, size - 1 - len)) != 0) {
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+            break;
+        len += n;
+        if ((head_len = hp_parse_request(buf, len, c->hreq)) != 0)
+            break;
+        if (len == size - 1) {
+            if (size > HP_MAX_HEAD)
+                break;
+            buf = arena_realloc(&c->mem, buf, size, size * 2);
+            size *= 2;
         }
-        readerAfter(i);
     }
-    return -1;
+    deadline_clear(&c->dl);
+    if (head_len < 0 && !c->dl.expired)
+        rio_writen(c->fd, (void *)bad_request, strlen(bad_request));  // Malformed or too large
+    if (head_len <= 0 || c->dl.expired)
+        return 0;
+    buf[head_len] = '\0';  // Nothing follows a GET head
+    c->head = buf;
+    c->head_len = head_len;
+    c->req.headers = buf;
+    return head_len;
 }
 
-void writePre(int i) {
-    P(&cache.cacheobjs[i].wmutex);
+static void slice_add(hdr_slices *s, const void *p, size_t len) {
+    s->iov[s->n].iov_base = (void *)p;
+    s->iov[s->n].iov_len = len;
+    s->n++;
 }
 
-void writeAfter(int i) {
-    V(&cache.cacheobjs[i].wmutex);
+static void slice_str(hdr_slices *s, const char *str) {
+    slice_add(s, str, strlen(str));
 }
 
-void cache_uri(char *uri, char *buf) {
-    int i = cache_eviction();
-    writePre(i);
+/* Header h's whole line in the client's head, through its LF */
+static void slice_line(hdr_slices *s, const char *head, const hp_header *h) {
+    const char *end = strchr(HP_AT(head, h->value) + h->value.len, '\n');
+    slice_add(s, HP_AT(head, h->name), end + 1 - HP_AT(head, h->name));
+}
 
-    strcpy(cache.cacheobjs[i].cache_obj, buf);
-    strcpy(cache.cacheobjs[i].cache_url, uri);
-    cache.cacheobjs[i].isEmpty = 0;
-    cache.cacheobjs[i].LRU = LRU_MAGIC_NUMBER;
-    cache_LRU(i);
+static void slices_init(arena *a, hdr_slices *s, int nheaders) {
+    s->iov = arena_alloc(a, (nheaders + OWN_SLICES) * sizeof(struct iovec));
+    s->n = 0;
+}
 
-    writeAfter(i);
+/* Header h's value as a string in the connection's arena */
+static char *value_copy(conn *c, const hp_header *h) {
+    return arena_strndup(&c->mem, HP_AT(c->head, h->value), h->value.len);
 }
 
-int cache_eviction() {
-    int min = LRU_MAGIC_NUMBER, minindex = 0;
-    for (int i = 0; i < CACHE_OBJS_COUNT; i++) {
-        readerPre(i);
-        if (cache.cacheobjs[i].isEmpty == 1) {
-            minindex = i;
-            readerAfter(i);
+/*
+ * Builds the origin request for the client's parsed head in out, as slices
+ * of head and of our fixed lines, and records in c->req what the cache
+ * needs from the client's headers. Headers are classified by hdr_lookup;
+ * the hop-by-hop ones, those the client's Connection header names, and the
+ * ones we replace are dropped, and the rest are forwarded in the client's
+ * order. An origin-form request takes
+ * *hostname and *port from Host.
+ */
+void build_http_header(conn *c, hdr_slices *out, char **hostname, char *path, int *port) {
+    const char *head = c->head;
+    const hp_request *hreq = c->hreq;
+    req_info *req = &c->req;
+    int fwd[HP_MAX_HEADERS], nfwd = 0, host = -1, range = -1, if_range = -1;
+    char *listed[HP_MAX_HEADERS];
+    int nlisted = 0;
+
+    req->if_range = req->if_none_match = req->if_modified_since = "";
+
+    /* Names in Connection (and the legacy Proxy-Connection) are hop-by-hop too (RFC 7230 6.1) */
+    for (int i = 0; i < hreq->nheaders; i++) {
+        const hp_header *h = &hreq->headers[i];
+        enum hdr_id id = hdr_lookup(HP_AT(head, h->name), h->name.len);
+        if (id == HDR_CONNECTION || id == HDR_PROXY_CONNECTION)
+            listed[nlisted++] = value_copy(c, h);
+    }
+
+    for (int i = 0; i < hreq->nheaders; i++) {
+        const hp_header *h = &hreq->headers[i];
+        enum hdr_id id = hdr_lookup(HP_AT(head, h->name), h->name.len);
+        int drop = 0;
+
+        if (hdr_flags(id) & HDR_F_HOP)
+            continue;
+        for (int j = 0; j < nlisted && !drop && id != HDR_HOST; j++)  // Every request keeps its Host
+            drop = http_list_has(listed[j], HP_AT(head, h->name), h->name.len);
+        if (drop)
+            continue;
+        switch (id) {
+        case HDR_HOST:
+            host = i;
+            break;
+        case HDR_X_PROXY_PEER:  // PEER_HOP_HDR
+            req->from_peer = 1;
+            break;
+        case HDR_USER_AGENT:  // Ours replaces it
+            break;
+        case HDR_RANGE:
+            /* Only a single byte range is forwarded; the origin sends the whole object otherwise */
+            if ((req->has_range = http_parse_range(value_copy(c, h), &req->range_first, &req->range_last)))
+                range = i;
+            break;
+        case HDR_IF_RANGE:
+            req->if_range = value_copy(c, h);
+            if_range = i;
+            break;
+        case HDR_IF_NONE_MATCH:  // We answer conditionals from the cache
+            req->if_none_match = value_copy(c, h);
+            break;
+        case HDR_IF_MODIFIED_SINCE:
+            req->if_modified_since = value_copy(c, h);
+            break;
+        case HDR_CACHE_CONTROL:
+            if (strstr(value_copy(c, h), "only-if-cached"))
+                req->only_if_cached = 1;
+            fwd[nfwd++] = i;
+            break;
+        case HDR_ACCEPT_ENCODING:
+            req->accept_gzip = http_accepts(value_copy(c, h), "gzip");
+            fwd[nfwd++] = i;
             break;
+        default:
+            fwd[nfwd++] = i;
         }
-        if (cache.cacheobjs[i].LRU < min) {
-            min = cache.cacheobjs[i].LRU;
-            minindex = i;
+    }
+    if (host >= 0 && **hostname == '\0') {  // Origin-form request: target is in Host
+        char *colon = strchr(*hostname = value_copy(c, &hreq->headers[host]), ':');
+        if (colon) {
+            *colon = '\0';
+            sscanf(colon + 1, "%d", port);
         }
-        readerAfter(i);
     }
-    return minindex;
+    if (!req->has_range)
+        req->if_range = "";
+
+    slices_init(&c->mem, out, hreq->nheaders);
+    slice_str(out, "GET ");
+    slice_str(out, path);
+    slice_str(out, " HTTP/1.0\r\n");
+    out->line = out->n;
+    if (host >= 0) {
+        slice_line(out, head, &hreq->headers[host]);
+    } else {
+        slice_str(out, "Host: ");
+        slice_str(out, *hostname);
+        slice_str(out, endof_hdr);
+    }
+    slice_str(out, conn_hdr);
+    slice_str(out, prox_hdr);
+    slice_str(out, user_agent_hdr);
+    if (range >= 0)
+        slice_line(out, head, &hreq->headers[range]);
+    if (range >= 0 && if_range >= 0)
+        slice_line(out, head, &hreq->headers[if_range]);
+    for (int i = 0; i < nfwd; i++)
+        slice_line(out, head, &hreq->headers[fwd[i]]);
+    slice_str(out, endof_hdr);
+}
+
+/* The request in from, addressed to a sibling proxy in absolute form, with extra header lines */
+void sibling_request(arena *a, hdr_slices *to, const hdr_slices *from, const char *url, const char *extra) {
+    slices_init(a, to, from->n - from->line);
+    slice_str(to, "GET ");
+    slice_str(to, url);
+    slice_str(to, " HTTP/1.0\r\n" PEER_HOP_HDR ": 1\r\n");  // So the sibling does not forward it again
+    slice_str(to, extra);
+    to->line = to->n;
+    for (int i = from->line; i < from->n; i++)
+        to->iov[to->n++] = from->iov[i];
 }
 
-void cache_LRU(int index) {
-    for (int i = 0; i < CACHE_OBJS_COUNT; i++) {
-        if (i == index) continue;
-        writePre(i);
-        if (cache.cacheobjs[i].isEmpty == 0) {
-            cache.cacheobjs[i].LRU--;
+/*
+ * Fetches an object straight into the cache, with no client waiting on
+ * it. Returns the bytes received, 0 if it is already being fetched, or -1
+ * on failure.
+ */
+long fetch_to_cache(const char *hostname, int port, const char *path, const char *key) {
+    char request[MAXLINE], host[MAXLINE], portStr[16];
+
+    if (port == 80)
+        sprintf(host, "%s", hostname);
+    else
+        sprintf(host, "%s:%d", hostname, port);
+    sprintf(portStr, "%d", port);
+    sprintf(request, requestline_hdr_format, path);
+    sprintf(request + strlen(request), host_hdr_format, host);
+    sprintf(request + strlen(request), "%s%s%s%s", conn_hdr, prox_hdr, user_agent_hdr, endof_hdr);
+    struct iovec iov = { request, strlen(request) };
+    return fetch_request(hostname, portStr, &iov, 1, key, NULL, 0);
+}
+
+/*
+ * Sends the request slices to host:port and publishes the response as a fill of key
+ * for a client request with req_headers (NULL for a background fetch, see
+ * cache_store). With only_ok, any status but 200 abandons it. Returns as
+ * fetch_to_cache.
+ */
+long fetch_request(const char *host, const char *port, struct iovec *request, int slices, const char *key,
+                   const char *req_headers, int only_ok) {
+    char buf[MAXLINE];
+    cache_fill *fill;
+    deadline d;
+    rio_t rio;
+    long total = 0;
+    ssize_t n;
+    int fd;
+
+    if ((fill = cache_fill_start(key, req_headers)) == NULL)
+        return 0;
+    deadline_init(&d, -1);
+    if ((fd = connect_origin(&d, host, port)) < 0) {
+        cache_fill_end(fill, 0);
+        return -1;
+    }
+
+    deadline_set(&d, T_FIRST_BYTE);
+    n = rio_writev(fd, request, slices);
+    Rio_readinitb(&rio, fd);
+    while (n >= 0 && total <= MAX_OBJECT_SIZE && (n = rio_readnb(&rio, buf, MAXLINE)) > 0) {
+        deadline_set(&d, T_IDLE);
+        if (total == 0 && only_ok && http_status(buf, n) != 200) {
+            n = -1;
+            break;
         }
-        writeAfter(i);
+        cache_fill_append(fill, buf, n);
+        total += n;
     }
+    deadline_clear(&d);
+    if (d.expired)
+        n = -1;
+    else if (total == 0 && n <= 0)
+        fc_failed(host, port);
+    deadline_server(&d, -1);
+    Close(fd);
+    cache_fill_end(fill, n == 0);
+    return n == 0 ? total : -1;
+}
+
+static void deadline_expired(timer *t) {
+    deadline *d = (deadline *)t;  // t is its first member
+    int origin = d->phase == T_FIRST_BYTE || d->phase == T_IDLE;  // fastconn times connects itself
+    int client = d->phase == T_HEADER || d->phase == T_KEEPALIVE || d->phase == T_IDLE;
+
+    d->expired = 1;
+    timeouts[d->phase]++;  // Under the wheel's lock
+    if (origin && d->server >= 0)
+        shutdown(d->server, SHUT_RDWR);
+    if (client && d->client >= 0)
+        shutdown(d->client, SHUT_RDWR);
+    if (client && d->fill)
+        cache_fill_wake(d->fill);
+}
+
+/* A deadline for an exchange with client (-1 for none), not yet armed */
+void deadline_init(deadline *d, int client) {
+    timer_setup(&d->t, deadline_expired);
+    d->phase = T_CONNECT;
+    d->client = client;
+    d->server = -1;
+    d->fill = NULL;
+    d->expired = 0;
+}
+
+/* Enters phase, whose timeout starts now; entering the same phase again restarts it */
+void deadline_set(deadline *d, int phase) {
+    d->phase = phase;
+    if (opts.timeouts[phase] > 0)
+        timer_arm(&d->t, opts.timeouts[phase] * 1000L);
+    else
+        timer_cancel(&d->t);
+}
+
+/* Sets the origin socket expiry shuts down; set it to -1 before closing the socket */
+void deadline_server(deadline *d, int fd) {
+    timer_lock();
+    d->server = fd;
+    timer_unlock();
+}
+
+/* Sets the fill a reader of the client is waiting on, or NULL */
+void deadline_fill(deadline *d, cache_fill *fill) {
+    timer_lock();
+    d->fill = fill;
+    timer_unlock();
+}
+
+/* For cache_fill_stream: restarts the idle timeout on each step, and stops once it has passed */
+int stream_go_on(void *arg) {
+    deadline *d = arg;
+    int expired;
+
+    timer_lock();
+    expired = d->expired;
+    timer_unlock();
+    if (expired)
+        return 0;
+    deadline_set(d, T_IDLE);
+    return 1;
+}
+
+void deadline_clear(deadline *d) {
+    timer_cancel(&d->t);
+}
+
+/*
+ * Connects to host:port through fastconn.c within the connect timeout,
+ * which fastconn applies itself, and registers the socket with d.
+ * Returns the socket or -1.
+ */
+int connect_origin(deadline *d, const char *host, const char *port) {
+    int fd = fc_connect(host, port, opts.timeouts[T_CONNECT] * 1000);
+
+    if (fd < 0 && errno == ETIMEDOUT) {
+        timer_lock();  // Counted as the wheel would have
+        d->expired = 1;
+        timeouts[T_CONNECT]++;
+        timer_unlock();
+    }
+    if (fd >= 0)
+        deadline_server(d, fd);
+    return fd;
 }
 
 int parse_uri(char *uri, char *hostname, char *path, int *port) {
     *port = 80; // 기본 포트 설정
 
     // URI에서 "http://" 부분을 제거하고 시작 위치를 찾습니다.
-    char *hostbegin = strstr(uri, "http://");
-    if (hostbegin) {
+    char *hostbegin = uri;
+    if (!strncasecmp(uri, "http://", 7)) {
         hostbegin += 7;
-    } else {
-        hostbegin = uri;
     }
 
     // 호스트 이름 뒤에 오는 경로를 구분하기 위해 '/' 위치를 찾습니다.
@@ -0,0 +1,317 @@
+/*
+ * shmcache.c - cache tier shared by forked worker processes
+ *
+ * The segment comes from memfd_create (anonymous shared memory if that is
+ * unavailable) and is mapped before the workers fork, so every worker sees
+ * it, possibly at different addresses: nothing in it is a pointer, only
+ * offsets from the segment's start. It holds a fixed slot index followed
+ * by a byte arena used as a ring: each object (key, then response) is
+ * written at the head, and whatever older objects the new bytes overlap
+ * are evicted first, so eviction is FIFO by insertion.
+ *
+ * One process-shared, robust mutex guards the segment. Readers copy the
+ * object out under it, so a later overwrite never races with a reader.
+ * Writers invalidate overlapped slots, then mark the new slot FILLING,
+ * then copy, then mark it VALID; at no point does a VALID slot describe
+ * bytes being written. A worker that dies holding the lock leaves at
+ * most one FILLING slot, which the next process to take the lock (told
+ * so by EOWNERDEAD) frees before marking the mutex consistent. Any other
+ * failure to lock counts as a miss, or a store not made.
+ *
+ * The segment also holds the Vary lists of canonical keys, so a variant
+ * stored by one worker is found under the same variant key by the others.
+ * Records are keyed by the canonical key's hash alone: a collision only
+ * makes a lookup build a variant key that misses.
+ */
+#include <sys/syscall.h>
+#include "csapp.h"
+#include "cache.h"
+#include "shmcache.h"
+
+#define SHM_MAGIC 0x70726f78   /* "prox" */
+#define SHM_SLOTS CACHE_OBJS_COUNT
+
+#define SHM_VARY_SLOTS 256
+#define SHM_VARY_PROBES 8
+#define SHM_VARY_NAMES 128  /* As cache.c's VARY_NAMES */
+
+#define SLOT_FREE    0
+#define SLOT_FILLING 1
+#define SLOT_VALID   2
+
+typedef struct {
+    unsigned long hash;   /* Hash of the key */
+    uint64_t off;         /* Arena offset of the key, response follows */
+    uint32_t keyLen;
+    uint32_t size;        /* Response bytes */
+    uint32_t state;
+    uint32_t hits;
+} shm_slot;
+
+typedef struct {
+    unsigned long hash;   /* Hash of the canonical key, 0 for a never-used record */
+    char names[SHM_VARY_NAMES];  /* "" once the key stops varying */
+} shm_vary;
+
+typedef struct {
+    uint32_t magic;
+    pthread_mutex_t lock;  /* PTHREAD_PROCESS_SHARED | PTHREAD_MUTEX_ROBUST */
+    size_t arenaSize;
+    uint64_t head;         /* Where the next object goes */
+    long objects;
+    size_t used;
+    long lookups, hits, inserts, evictions, recoveries, lockFailures;
+    int warmClaimed;       /* Set by the one process that runs warm-up */
+    shm_slot slots[SHM_SLOTS];
+    shm_vary varies[SHM_VARY_SLOTS];
+    char arena[];          /* arenaSize bytes */
+} shm_segment;
+
+static shm_segment *seg;
+
+int shm_cache_init(size_t arenaSize) {
+    size_t len = sizeof(shm_segment) + arenaSize;
+    pthread_mutexattr_t attr;
+    void *p = MAP_FAILED;
+    int fd = -1;
+
+#ifdef SYS_memfd_create
+    fd = syscall(SYS_memfd_create, "proxy-cache", 0);
+#endif
+    if (fd >= 0 && ftruncate(fd, len) == 0)
+        p = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (fd >= 0)
+        close(fd);  /* The mapping keeps the memory */
+    if (p == MAP_FAILED)
+        p = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED)
+        return -1;
+
+    seg = p;
+    memset(seg, 0, sizeof(shm_segment));
+    seg->arenaSize = arenaSize;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    pthread_mutex_init(&seg->lock, &attr);
+    pthread_mutexattr_destroy(&attr);
+    seg->magic = SHM_MAGIC;
+    return 0;
+}
+
+int shm_cache_enabled() {
+    return seg != NULL;
+}
+
+/* Drops what a dead lock holder left half-written; caller holds the lock */
+static void shm_recover() {
+    seg->objects = 0;
+    seg->used = 0;
+    for (int i = 0; i < SHM_SLOTS; i++) {
+        shm_slot *s = &seg->slots[i];
+        if (s->state == SLOT_FILLING)
+            s->state = SLOT_FREE;
+        if (s->state == SLOT_VALID) {
+            seg->objects++;
+            seg->used += s->keyLen + s->size;
+        }
+    }
+    seg->recoveries++;
+}
+
+/* Returns 0 with the lock held, or -1 if it could not be taken */
+static int shm_lock() {
+    int rc = pthread_mutex_lock(&seg->lock);
+
+    if (rc == EOWNERDEAD) {
+        shm_recover();
+        pthread_mutex_consistent(&seg->lock);
+        return 0;
+    }
+    if (rc != 0) {  /* ENOTRECOVERABLE and the like: leave the segment alone */
+        __sync_fetch_and_add(&seg->lockFailures, 1);
+        return -1;
+    }
+    return 0;
+}
+
+static void shm_unlock() {
+    pthread_mutex_unlock(&seg->lock);
+}
+
+static void slot_free(shm_slot *s) {
+    if (s->state == SLOT_VALID) {
+        seg->objects--;
+        seg->used -= s->keyLen + s->size;
+    }
+    s->state = SLOT_FREE;
+}
+
+/* Caller holds the lock */
+static shm_slot *shm_find(const char *key, size_t keyLen, unsigned long hash) {
+    for (int i = 0; i < SHM_SLOTS; i++) {
+        shm_slot *s = &seg->slots[i];
+        if (s->state == SLOT_VALID && s->hash == hash && s->keyLen == keyLen &&
+            !memcmp(seg->arena + s->off, key, keyLen))
+            return s;
+    }
+    return NULL;
+}
+
+void shm_cache_put(const char *key, const char *buf, size_t size) {
+    size_t keyLen = strlen(key), need = keyLen + size;
+    unsigned long hash = cache_hash(key, keyLen);
+    shm_slot *s, *slot = NULL;
+    uint64_t off;
+
+    if (!seg || need > seg->arenaSize || shm_lock() < 0)
+        return;
+    if ((s = shm_find(key, keyLen, hash)) != NULL)
+        slot_free(s);
+
+    off = seg->head + need > seg->arenaSize ? 0 : seg->head;
+    for (int i = 0; i < SHM_SLOTS; i++) {
+        s = &seg->slots[i];
+        if (s->state != SLOT_FREE && s->off < off + need && off < s->off + s->keyLen + s->size) {
+            slot_free(s);  /* About to be overwritten */
+            seg->evictions++;
+        }
+        if (s->state == SLOT_FREE && slot == NULL)
+            slot = s;
+    }
+    if (slot == NULL) {  /* Index full: the object the ring would reach next */
+        uint64_t best = UINT64_MAX;
+        for (int i = 0; i < SHM_SLOTS; i++) {
+            uint64_t ahead = (seg->slots[i].off + seg->arenaSize - off) % seg->arenaSize;
+            if (ahead < best) {
+                best = ahead;
+                slot = &seg->slots[i];
+            }
+        }
+        slot_free(slot);
+        seg->evictions++;
+    }
+
+    slot->hash = hash;
+    slot->off = off;
+    slot->keyLen = keyLen;
+    slot->size = size;
+    slot->hits = 0;
+    slot->state = SLOT_FILLING;
+    seg->head = off + need;
+    memcpy(seg->arena + off, key, keyLen);
+    memcpy(seg->arena + off + keyLen, buf, size);
+    __atomic_store_n(&slot->state, SLOT_VALID, __ATOMIC_RELEASE);
+    seg->objects++;
+    seg->used += need;
+    seg->inserts++;
+    shm_unlock();
+}
+
+size_t shm_cache_get(const char *key, char **buf) {
+    size_t keyLen = strlen(key), size = 0;
+    unsigned long hash = cache_hash(key, keyLen);
+    shm_slot *s;
+
+    if (!seg || shm_lock() < 0)
+        return 0;
+    seg->lookups++;
+    if ((s = shm_find(key, keyLen, hash)) != NULL) {
+        size = s->size;
+        *buf = Malloc(size);
+        memcpy(*buf, seg->arena + s->off + keyLen, size);
+        s->hits++;
+        seg->hits++;
+    }
+    shm_unlock();
+    return size;
+}
+
+size_t shm_cache_bytes_used() {
+    return seg ? __atomic_load_n(&seg->used, __ATOMIC_RELAXED) : 0;
+}
+
+/* Calls fn on the key of every object in the segment, under its lock */
+void shm_cache_for_each_key(void (*fn)(const char *key, void *arg), void *arg) {
+    char key[MAXLINE];
+
+    if (!seg || shm_lock() < 0)
+        return;
+    for (int i = 0; i < SHM_SLOTS; i++) {
+        shm_slot *s = &seg->slots[i];
+        if (s->state != SLOT_VALID || s->keyLen >= sizeof(key))
+            continue;
+        memcpy(key, seg->arena + s->off, s->keyLen);
+        key[s->keyLen] = '\0';
+        fn(key, arg);
+    }
+    shm_unlock();
+}
+
+/* Record for hash, or with create the record to reuse for it; caller holds the lock */
+static shm_vary *vary_slot(unsigned long hash, int create) {
+    shm_vary *spare = NULL;
+
+    for (int p = 0; p < SHM_VARY_PROBES; p++) {
+        shm_vary *v = &seg->varies[(hash + p) % SHM_VARY_SLOTS];
+        if (v->hash == hash)
+            return v;
+        if (spare == NULL && (v->hash == 0 || v->names[0] == '\0'))
+            spare = v;
+        if (v->hash == 0)
+            break;
+    }
+    if (!create)
+        return NULL;
+    return spare ? spare : &seg->varies[hash % SHM_VARY_SLOTS];  /* Crowded: the displaced key stops varying */
+}
+
+/* Records that key varies by names, its normalized Vary list ("" for not at all) */
+void shm_vary_put(const char *key, const char *names) {
+    unsigned long hash = cache_hash(key, strlen(key));
+    shm_vary *v;
+
+    if (!seg || strlen(names) >= SHM_VARY_NAMES || shm_lock() < 0)
+        return;
+    if ((v = vary_slot(hash, names[0] != '\0')) != NULL) {
+        v->hash = hash;
+        strcpy(v->names, names);
+    }
+    shm_unlock();
+}
+
+/* Copies the Vary list of key into names; returns 1 if key is known to vary */
+int shm_vary_get(const char *key, char *names, size_t size) {
+    unsigned long hash = cache_hash(key, strlen(key));
+    shm_vary *v;
+    int found = 0;
+
+    if (!seg || shm_lock() < 0)
+        return 0;
+    if ((v = vary_slot(hash, 0)) != NULL && v->names[0] && strlen(v->names) < size) {
+        strcpy(names, v->names);
+        found = 1;
+    }
+    shm_unlock();
+    return found;
+}
+
+/* Returns 1 to the first process to ask, which runs warm-up for all of them */
+int shm_claim_warm() {
+    return seg && __sync_bool_compare_and_swap(&seg->warmClaimed, 0, 1);
+}
+
+void shm_cache_report(FILE *fp) {
+    if (!seg || shm_lock() < 0)
+        return;
+    fprintf(fp, "shm.arena_bytes %zu\n", seg->arenaSize);
+    fprintf(fp, "shm.objects %ld\n", seg->objects);
+    fprintf(fp, "shm.bytes_used %zu\n", seg->used);
+    fprintf(fp, "shm.lookups %ld\n", seg->lookups);
+    fprintf(fp, "shm.hits %ld\n", seg->hits);
+    fprintf(fp, "shm.inserts %ld\n", seg->inserts);
+    fprintf(fp, "shm.evictions %ld\n", seg->evictions);
+    fprintf(fp, "shm.recoveries %ld\n", seg->recoveries);
+    fprintf(fp, "shm.lock_failures %ld\n", seg->lockFailures);
+    shm_unlock();
+}
@@ -0,0 +1,35 @@
+/*
+ * shmcache.h - cache tier shared by forked worker processes
+ */
+#ifndef __SHMCACHE_H__
+#define __SHMCACHE_H__
+
+#include <stdio.h>
+#include <stddef.h>
+
+/*
+ * Maps a shared segment with an arena of arenaSize bytes. Must be called
+ * before forking the workers that will share it. Returns 0 or -1.
+ */
+int shm_cache_init(size_t arenaSize);
+int shm_cache_enabled();
+
+/* Publishes a complete response under key, replacing any older copy */
+void shm_cache_put(const char *key, const char *buf, size_t size);
+
+/*
+ * Copies the response cached under key into a Malloc'd *buf. Returns its
+ * size, or 0 on a miss.
+ */
+size_t shm_cache_get(const char *key, char **buf);
+size_t shm_cache_bytes_used();
+void shm_cache_for_each_key(void (*fn)(const char *key, void *arg), void *arg);
+
+/* The Vary list of a canonical key, shared so every worker builds the same variant keys */
+void shm_vary_put(const char *key, const char *names);
+int shm_vary_get(const char *key, char *names, size_t size);
+
+int shm_claim_warm();
+void shm_cache_report(FILE *fp);
+
+#endif /* __SHMCACHE_H__ */
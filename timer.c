@@ -0,0 +1,200 @@
+/*
+ * timer.c - hierarchical timer wheel
+ *
+ * Four wheels of 64 slots each. A timer due within 64 ticks sits in the
+ * first wheel, in the slot for its tick; one due later sits in the slot
+ * for its tick's bits in the coarser wheel whose range covers it. Every
+ * 64 ticks the current slot of the next wheel up is emptied into the
+ * finer ones, so a timer moves down at most three times before it fires.
+ * Arming and cancelling are a list insert and unlink; each tick looks at
+ * one slot. With 100 ms ticks the wheels reach about 19 days, and later
+ * deadlines are clamped to that.
+ *
+ * One thread advances the wheel, by the monotonic clock, and runs the
+ * expired timers' callbacks with the lock held. A timer_cancel that
+ * returns therefore leaves no callback running or about to run.
+ */
+#include "csapp.h"
+#include "timer.h"
+
+#define LEVELS 4
+#define SLOT_BITS 6
+#define SLOTS (1 << SLOT_BITS)
+#define SLOT_MASK (SLOTS - 1)
+#define MAX_TICKS ((1UL << (LEVELS * SLOT_BITS)) - 1)
+
+static struct {
+    pthread_mutex_t lock;
+    timer slots[LEVELS][SLOTS];  // List heads
+    unsigned long now;           // Next tick to run
+    struct timespec start;       // Tick 0
+    int started;
+    long pending, armed, fired, cancelled;
+} tw = { PTHREAD_MUTEX_INITIALIZER };
+
+static void unlink_timer(timer *t) {
+    t->prev->next = t->next;
+    t->next->prev = t->prev;
+    t->next = t->prev = NULL;
+}
+
+/* Puts t in the slot for its expiry; caller holds the lock */
+static void place(timer *t) {
+    unsigned long delta = t->expires - tw.now;
+    timer *head;
+    int level;
+
+    if ((long)delta < 0) {  // Already due: the slot about to run
+        delta = 0;
+        t->expires = tw.now;
+    }
+    for (level = 0; level < LEVELS - 1 && delta >= 1UL << (SLOT_BITS * (level + 1)); level++)
+        ;
+    head = &tw.slots[level][(t->expires >> (SLOT_BITS * level)) & SLOT_MASK];
+    t->prev = head->prev;
+    t->next = head;
+    head->prev->next = t;
+    head->prev = t;
+}
+
+/* Moves a coarse slot's timers down; returns its index, which is 0 when the next level is due too */
+static int cascade(int level) {
+    int idx = (tw.now >> (SLOT_BITS * level)) & SLOT_MASK;
+    timer *head = &tw.slots[level][idx], *t, *next;
+
+    if (head->next == head)
+        return idx;
+    /* Detached first: a timer a whole turn of this wheel away lands back in the same slot */
+    t = head->next;
+    head->prev->next = NULL;
+    head->next = head->prev = head;
+    for (; t; t = next) {
+        next = t->next;
+        place(t);
+    }
+    return idx;
+}
+
+/* Runs one tick; caller holds the lock */
+static void tick() {
+    timer *head = &tw.slots[0][tw.now & SLOT_MASK], *t;
+
+    if ((tw.now & SLOT_MASK) == 0)
+        for (int level = 1; level < LEVELS && cascade(level) == 0; level++)
+            ;
+    while ((t = head->next) != head) {
+        unlink_timer(t);
+        tw.pending--;
+        tw.fired++;
+        t->fn(t);
+    }
+    tw.now++;
+}
+
+/* Ticks elapsed since tw.start */
+static unsigned long clock_ticks() {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((ts.tv_sec - tw.start.tv_sec) * 1000 + (ts.tv_nsec - tw.start.tv_nsec) / 1000000) / TIMER_TICK_MS;
+}
+
+static void *timer_thread(void *vargp) {
+    struct timespec next;
+
+    Pthread_detach(pthread_self());
+    while (1) {
+        pthread_mutex_lock(&tw.lock);
+        for (unsigned long due = clock_ticks(); tw.now <= due;)
+            tick();
+        next.tv_sec = tw.start.tv_sec + tw.now * TIMER_TICK_MS / 1000;
+        next.tv_nsec = tw.start.tv_nsec + tw.now * TIMER_TICK_MS % 1000 * 1000000;
+        if (next.tv_nsec >= 1000000000) {
+            next.tv_sec++;
+            next.tv_nsec -= 1000000000;
+        }
+        pthread_mutex_unlock(&tw.lock);
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL) == EINTR)
+            ;
+    }
+    return NULL;
+}
+
+/* Starts the wheel's thread; call once per process, after any fork */
+void timer_start() {
+    pthread_t tid;
+
+    pthread_mutex_lock(&tw.lock);
+    for (int l = 0; l < LEVELS; l++)
+        for (int s = 0; s < SLOTS; s++)
+            tw.slots[l][s].next = tw.slots[l][s].prev = &tw.slots[l][s];
+    clock_gettime(CLOCK_MONOTONIC, &tw.start);
+    tw.now = 0;
+    tw.started = 1;
+    pthread_mutex_unlock(&tw.lock);
+    Pthread_create(&tid, NULL, timer_thread, NULL);
+}
+
+void timer_setup(timer *t, timer_fn fn) {
+    t->next = t->prev = NULL;
+    t->fn = fn;
+}
+
+/*
+ * Arms t to fire once ms milliseconds have passed, within a tick after,
+ * replacing any earlier deadline.
+ */
+void timer_arm(timer *t, long ms) {
+    unsigned long ticks = ms > 0 ? (ms + TIMER_TICK_MS - 1) / TIMER_TICK_MS : 0, clock;
+
+    if (ticks > MAX_TICKS)
+        ticks = MAX_TICKS;
+    pthread_mutex_lock(&tw.lock);
+    if (!tw.started) {
+        pthread_mutex_unlock(&tw.lock);
+        return;
+    }
+    if (t->next)
+        unlink_timer(t);
+    else
+        tw.pending++;
+    /* The current tick is partly gone, and the wheel may lag the clock by one it has not run */
+    clock = clock_ticks();
+    t->expires = (clock > tw.now ? clock : tw.now) + ticks + 1;
+    place(t);
+    tw.armed++;
+    pthread_mutex_unlock(&tw.lock);
+}
+
+/* Disarms t. Returns 1 if it was armed, 0 if it had fired or was never armed */
+int timer_cancel(timer *t) {
+    int was = 0;
+
+    pthread_mutex_lock(&tw.lock);
+    if (t->next) {
+        unlink_timer(t);
+        tw.pending--;
+        tw.cancelled++;
+        was = 1;
+    }
+    pthread_mutex_unlock(&tw.lock);
+    return was;
+}
+
+/* Excludes callbacks, for changing what they read */
+void timer_lock() {
+    pthread_mutex_lock(&tw.lock);
+}
+
+void timer_unlock() {
+    pthread_mutex_unlock(&tw.lock);
+}
+
+void timer_report(FILE *fp) {
+    pthread_mutex_lock(&tw.lock);
+    fprintf(fp, "timer.pending %ld\n", tw.pending);
+    fprintf(fp, "timer.armed %ld\n", tw.armed);
+    fprintf(fp, "timer.fired %ld\n", tw.fired);
+    fprintf(fp, "timer.cancelled %ld\n", tw.cancelled);
+    pthread_mutex_unlock(&tw.lock);
+}
@@ -0,0 +1,34 @@
+/*
+ * timer.h - hierarchical timer wheel
+ */
+#ifndef __TIMER_H__
+#define __TIMER_H__
+
+#include <stdio.h>
+
+#define TIMER_TICK_MS 100  // Resolution of every timer
+
+typedef struct timer timer;
+
+/*
+ * Called from the wheel's thread when t expires, with the wheel locked:
+ * it must be short and must not arm or cancel timers.
+ */
+typedef void (*timer_fn)(timer *t);
+
+/* Embed one in whatever the timer is for; the wheel owns the links while it is armed */
+struct timer {
+    timer *next, *prev;
+    unsigned long expires;  // Tick
+    timer_fn fn;
+};
+
+void timer_start();
+void timer_setup(timer *t, timer_fn fn);
+void timer_arm(timer *t, long ms);
+int timer_cancel(timer *t);
+void timer_lock();
+void timer_unlock();
+void timer_report(FILE *fp);
+
+#endif /* __TIMER_H__ */
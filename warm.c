@@ -0,0 +1,193 @@
+/*
+ * warm.c - cache warm-up from URL lists and access logs
+ *
+ * Each line of the input is either a bare URL, a log line with an
+ * absolute http:// URL somewhere in it, or a JSON object whose "url",
+ * "uri" or "request" member holds one. URLs are counted by canonical
+ * cache key (canon.c), so spellings of one object add up, the most
+ * frequent come first, and a background thread fetches them through the same path
+ * as prefetching, paced to a byte rate so a cold start does not flood the
+ * origins, until the cache is filled to the requested fraction.
+ */
+#include "csapp.h"
+#include "cache.h"
+#include "canon.h"
+#include "warm.h"
+
+#define WARM_TABLE 65536  /* Distinct URLs counted */
+
+typedef struct {
+    char *key;              /* Canonical cache key */
+    char *url;              /* First spelling seen, to fetch */
+    long count;
+} warm_url;
+
+static struct {
+    warm_url *urls;         /* Sorted by count once loaded */
+    int nurls;
+    int top;
+    double fraction;
+    long rate;
+    prefetch_fetch_fn fetch;
+
+    long fetched, failed, skipped, bytes;
+    int done;               /* 1 once the thread has finished */
+    const char *stop;       /* Why it finished */
+} warm;
+
+/* Copies the URL a line refers to into url; returns 0 if there is none */
+static int line_url(char *line, char *url, size_t size) {
+    static const char *members[] = { "\"url\"", "\"uri\"", "\"request\"", NULL };
+    char *p = NULL, *q;
+    size_t n = 0;
+
+    if (line[0] == '{') {
+        for (p = q = line; *p; p++) {  /* JSON may escape "/" as "\/" */
+            if (*p == '\\' && p[1] == '/')
+                p++;
+            *q++ = *p;
+        }
+        *q = '\0';
+        p = NULL;
+    }
+    for (int i = 0; line[0] == '{' && members[i] && !p; i++) {
+        if ((p = strstr(line, members[i])) != NULL) {
+            p += strlen(members[i]);
+            p += strspn(p, " \t:");
+            if (*p++ != '"')
+                p = NULL;
+        }
+    }
+    if (p == NULL)
+        p = line;
+    if ((p = strstr(p, "http://")) == NULL)
+        return 0;
+    while (*p && !isspace((unsigned char)*p) && *p != '"' && n < size - 1)
+        url[n++] = *p++;
+    url[n] = '\0';
+    return n > 7;
+}
+
+static int by_count(const void *a, const void *b) {
+    const warm_url *x = a, *y = b;
+    return (y->count > x->count) - (y->count < x->count);
+}
+
+/* Splits http://host[:port]/path; returns 0 if url is not of that form */
+static int split_url(const char *url, char *hostname, int *port, char *path) {
+    const char *p = url + 7;
+    size_t hostLen = strcspn(p, ":/?");
+
+    if (hostLen == 0 || hostLen >= MAXLINE)
+        return 0;
+    memcpy(hostname, p, hostLen);
+    hostname[hostLen] = '\0';
+    p += hostLen;
+    *port = 80;
+    if (*p == ':')
+        *port = (int)strtol(p + 1, (char **)&p, 10);
+    snprintf(path, MAXLINE, "%s%s", *p == '/' ? "" : "/", p);
+    return *port > 0;
+}
+
+static void *warm_thread(void *vargp) {
+    char hostname[MAXLINE], path[MAXLINE];
+    size_t goal = warm.fraction * MAX_CACHE_SIZE;
+    int port, i;
+
+    Pthread_detach(pthread_self());
+    warm.stop = "list exhausted";
+    for (i = 0; i < warm.nurls && i < warm.top; i++) {
+        long n;
+
+        if (cache_bytes_used() >= goal) {
+            warm.stop = "byte budget reached";
+            break;
+        }
+        if (cache_contains(warm.urls[i].key)) {
+            warm.skipped++;
+            continue;
+        }
+        split_url(warm.urls[i].url, hostname, &port, path);  /* Did when it was counted */
+        if ((n = warm.fetch(hostname, port, path, warm.urls[i].key)) < 0) {
+            warm.failed++;
+            continue;
+        }
+        warm.fetched++;
+        warm.bytes += n;
+        if (warm.rate > 0 && n > 0) {
+            struct timespec ts;
+            double wait = (double)n / warm.rate;
+            ts.tv_sec = (time_t)wait;
+            ts.tv_nsec = (long)((wait - ts.tv_sec) * 1e9);
+            nanosleep(&ts, NULL);
+        }
+    }
+    if (i == warm.top && i < warm.nurls)
+        warm.stop = "top reached";
+    warm.done = 1;
+    return NULL;
+}
+
+int warm_start(const char *filename, int top, double fraction, long rate, prefetch_fetch_fn fetch) {
+    char line[MAXBUF], url[MAXLINE], hostname[MAXLINE], path[MAXLINE], key[MAXLINE];
+    int port;
+    warm_url *table = Calloc(WARM_TABLE, sizeof(warm_url));
+    pthread_t tid;
+    FILE *fp;
+
+    if ((fp = fopen(filename, "r")) == NULL) {
+        Free(table);
+        return -1;
+    }
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        if (!line_url(line, url, sizeof(url)) || !split_url(url, hostname, &port, path) ||
+            canon_key(key, sizeof(key), hostname, port, path) < 0)
+            continue;
+        unsigned long h = cache_hash(key, strlen(key));
+        for (int p = 0; p < WARM_TABLE; p++) {
+            warm_url *w = &table[(h + p) % WARM_TABLE];
+            if (w->key == NULL) {
+                if (warm.nurls < WARM_TABLE / 2) {  /* Past that, only known URLs count */
+                    w->key = strdup(key);
+                    w->url = strdup(url);
+                    w->count = 1;
+                    warm.nurls++;
+                }
+                break;
+            }
+            if (!strcmp(w->key, key)) {
+                w->count++;
+                break;
+            }
+        }
+    }
+    fclose(fp);
+
+    /* Compact and order by frequency */
+    warm.urls = Malloc((warm.nurls + 1) * sizeof(warm_url));
+    for (int i = 0, n = 0; i < WARM_TABLE; i++) {
+        if (table[i].key)
+            warm.urls[n++] = table[i];
+    }
+    Free(table);
+    qsort(warm.urls, warm.nurls, sizeof(warm_url), by_count);
+
+    warm.top = top;
+    warm.fraction = fraction;
+    warm.rate = rate;
+    warm.fetch = fetch;
+    Pthread_create(&tid, NULL, warm_thread, NULL);
+    return warm.nurls;
+}
+
+void warm_report(FILE *fp) {
+    if (warm.fetch == NULL)
+        return;
+    fprintf(fp, "warm.urls %d\n", warm.nurls);
+    fprintf(fp, "warm.fetched %ld\n", warm.fetched);
+    fprintf(fp, "warm.failed %ld\n", warm.failed);
+    fprintf(fp, "warm.skipped %ld\n", warm.skipped);
+    fprintf(fp, "warm.bytes %ld\n", warm.bytes);
+    fprintf(fp, "warm.state %s\n", warm.done ? warm.stop : "running");
+}
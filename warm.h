@@ -0,0 +1,20 @@
+/*
+ * warm.h - cache warm-up from URL lists and access logs
+ */
+#ifndef __WARM_H__
+#define __WARM_H__
+
+#include <stdio.h>
+#include "prefetch.h"
+
+/*
+ * Reads URLs from filename and starts a background thread fetching the
+ * top most frequent ones at up to rate bytes per second, stopping once the
+ * cache holds fraction of MAX_CACHE_SIZE. Returns the number of distinct
+ * URLs found, or -1 if the file cannot be read.
+ */
+int warm_start(const char *filename, int top, double fraction, long rate, prefetch_fetch_fn fetch);
+
+void warm_report(FILE *fp);
+
+#endif /* __WARM_H__ */